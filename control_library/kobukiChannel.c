@@ -0,0 +1,426 @@
+#include "kobukiChannel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "kobukiStats.h"
+
+// tries to copy a slot while the detector is writing it, before leaving it for the next wakeup
+#define SEQLOCK_RETRIES 1000
+
+static int socket_poll(KobukiChannel_t* channel) {
+	if (channel->socket.decoder.error) {
+		return -1;
+	}
+
+	return kobukiInstructionRead(&channel->socket.decoder, channel->fd);
+}
+
+static bool socket_next(KobukiChannel_t* channel, KobukiInstruction_t* instruction) {
+	return kobukiInstructionNext(&channel->socket.decoder, instruction);
+}
+
+static int socket_flush(KobukiChannel_t* channel) {
+	KobukiSendQueue_t* queue = &channel->socket.queue;
+
+	while (queue->head != queue->tail) {
+		int slot = queue->head % KOBUKI_CHANNEL_QUEUE_SLOTS;
+		int count = send(channel->fd, queue->data[slot] + queue->offset, queue->length[slot] - queue->offset,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (count == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+				break;
+			}
+			return -1;
+		}
+
+		queue->offset += count;
+		if (queue->offset == queue->length[slot]) {
+			queue->head++;
+			queue->offset = 0;
+		}
+	}
+
+	return queue->tail - queue->head;
+}
+
+// Makes room for one message by dropping the oldest one that was not started yet.
+static void drop_oldest(KobukiSendQueue_t* queue) {
+	int first = queue->head % KOBUKI_CHANNEL_QUEUE_SLOTS;
+
+	// half a message would garble the stream, so one that is partly sent stays in front
+	if (queue->offset > 0) {
+		int second = (queue->head + 1) % KOBUKI_CHANNEL_QUEUE_SLOTS;
+		memcpy(queue->data[second], queue->data[first], queue->length[first]);
+		queue->length[second] = queue->length[first];
+	}
+
+	queue->head++;
+	queue->dropped++;
+}
+
+static int socket_send(KobukiChannel_t* channel, const KobukiInstruction_t* instruction) {
+	KobukiSendQueue_t* queue = &channel->socket.queue;
+
+	if (queue->tail - queue->head == KOBUKI_CHANNEL_QUEUE_SLOTS) {
+		if (queue->policy == KOBUKI_QUEUE_DISCONNECT) {
+			printf("ERROR - client does not keep up, its send queue is full\n");
+			return -1;
+		}
+		drop_oldest(queue);
+	}
+
+	int slot = queue->tail % KOBUKI_CHANNEL_QUEUE_SLOTS;
+	int length = kobukiInstructionEncode(instruction, queue->data[slot], KOBUKI_CHANNEL_SLOT_SIZE);
+	if (length == 0) {
+		printf("ERROR - message of type %d is too long for the send queue\n", instruction->type);
+		return -1;
+	}
+	queue->length[slot] = length;
+	queue->tail++;
+
+	return socket_flush(channel) < 0 ? -1 : 1;
+}
+
+static void socket_close(KobukiChannel_t* channel) {
+	if (channel->fd != -1) {
+		close(channel->fd);
+		channel->fd = -1;
+	}
+}
+
+void kobukiChannelSocket(KobukiChannel_t * channel, int fd) {
+	memset(channel, 0, sizeof(KobukiChannel_t));
+	channel->poll = socket_poll;
+	channel->next = socket_next;
+	channel->send = socket_send;
+	channel->flush = socket_flush;
+	channel->close = socket_close;
+	channel->fd = fd;
+	kobukiInstructionDecoderInit(&channel->socket.decoder);
+	channel->socket.queue.policy = KOBUKI_QUEUE_DISCONNECT;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+void kobukiChannelSetQueuePolicy(KobukiChannel_t * channel, KobukiQueuePolicy_t policy) {
+	if (channel->flush == socket_flush) {
+		channel->socket.queue.policy = policy;
+	}
+}
+
+static long futex(atomic_uint* word, int op, unsigned int value) {
+	// not FUTEX_PRIVATE_FLAG, the word is shared with another process
+	return syscall(SYS_futex, word, op, value, NULL, NULL, 0);
+}
+
+static void wake_up(atomic_uint* word) {
+	atomic_fetch_add_explicit(word, 1, memory_order_release);
+	futex(word, FUTEX_WAKE, INT_MAX);
+}
+
+/* Copies the slot guarded by sequence. Returns false if it did not change since seen,
+   or if the writer is stuck in the middle of writing it. */
+static bool read_slot(atomic_uint* sequence, const void* slot, void* copy, size_t size, unsigned int* seen) {
+	unsigned int before, after;
+
+	for (int tries = 0; tries < SEQLOCK_RETRIES; tries++) {
+		before = atomic_load_explicit(sequence, memory_order_acquire);
+		if (before == *seen) {
+			return false;
+		}
+		if (before & 1) {
+			continue;
+		}
+
+		memcpy(copy, slot, size);
+
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(sequence, memory_order_relaxed);
+		if (before == after) {
+			*seen = before;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static int shared_poll(KobukiChannel_t* channel) {
+	KobukiChannelShared_t* shared = channel->shm.shared;
+	KobukiChannelDetection_t detection;
+	KobukiChannelRoute_t route;
+	uint64_t wakeups;
+	int arrived = 0;
+
+	// clear the eventfd before looking, so a write during the look wakes the loop again
+	read(channel->fd, &wakeups, sizeof(wakeups));
+
+	unsigned int last = channel->shm.detectionSequence;
+	if (read_slot(&shared->detectionSequence, &shared->detection, &detection, sizeof(detection),
+			&channel->shm.detectionSequence)) {
+		// every write adds 2 to the sequence
+		for (unsigned int missed = (channel->shm.detectionSequence - last) / 2 - 1; missed > 0; missed--) {
+			channel->shm.overwritten++;
+			kobukiStatsCount(KOBUKI_COUNTER_STALE_DETECTIONS);
+		}
+
+		KobukiInstruction_t* instruction = &channel->shm.detection;
+		instruction->type = KOBUKI_INSTRUCTION_DETECTION;
+		instruction->sequence = detection.message;
+		instruction->detection.left = detection.left;
+		instruction->detection.center = detection.center;
+		instruction->detection.right = detection.right;
+		instruction->detection.ageUs = detection.ageUs;
+		channel->shm.haveDetection = true;
+		arrived++;
+	}
+
+	if (read_slot(&shared->routeSequence, &shared->route, &route, sizeof(route), &channel->shm.routeSequence)) {
+		KobukiInstruction_t* instruction = &channel->shm.route;
+		instruction->type = KOBUKI_INSTRUCTION_ROUTE;
+		instruction->sequence = route.message;
+		instruction->route.count = route.count < KOBUKI_INSTRUCTION_MAX_STEPS ? route.count : KOBUKI_INSTRUCTION_MAX_STEPS;
+		memcpy(instruction->route.steps, route.steps, instruction->route.count * sizeof(KobukiRouteStep_t));
+		channel->shm.haveRoute = true;
+		arrived++;
+	}
+
+	return arrived;
+}
+
+static bool shared_next(KobukiChannel_t* channel, KobukiInstruction_t* instruction) {
+	if (channel->shm.haveDetection) {
+		*instruction = channel->shm.detection;
+		channel->shm.haveDetection = false;
+		return true;
+	}
+
+	if (channel->shm.haveRoute) {
+		*instruction = channel->shm.route;
+		channel->shm.haveRoute = false;
+		return true;
+	}
+
+	return false;
+}
+
+static int shared_send(KobukiChannel_t* channel, const KobukiInstruction_t* instruction) {
+	if (instruction->type != KOBUKI_INSTRUCTION_ROUTE_REQUEST) {
+		printf("ERROR - only route requests go to the detector through shared memory\n");
+		return -1;
+	}
+
+	wake_up(&channel->shm.shared->routeRequests);
+	return 1;
+}
+
+static int nothing_to_flush(KobukiChannel_t* channel) {
+	(void) channel;
+	return 0;
+}
+
+static void* shared_waker_main(void* arg) {
+	KobukiChannel_t* channel = arg;
+	atomic_uint* wake = &channel->shm.shared->wake;
+	unsigned int seen = atomic_load_explicit(wake, memory_order_acquire);
+	const uint64_t one = 1;
+
+	while (!atomic_load(&channel->shm.stopping)) {
+		// returns right away if the detector wrote since we last looked
+		futex(wake, FUTEX_WAIT, seen);
+
+		unsigned int now = atomic_load_explicit(wake, memory_order_acquire);
+		if (now != seen) {
+			seen = now;
+			write(channel->fd, &one, sizeof(one));
+		}
+	}
+
+	return NULL;
+}
+
+static void shared_close(KobukiChannel_t* channel) {
+	if (channel->shm.shared == NULL) {
+		return;
+	}
+
+	atomic_store(&channel->shm.stopping, true);
+	wake_up(&channel->shm.shared->wake);
+	pthread_join(channel->shm.waker, NULL);
+
+	close(channel->fd);
+	channel->fd = -1;
+	munmap(channel->shm.shared, sizeof(KobukiChannelShared_t));
+	channel->shm.shared = NULL;
+}
+
+static KobukiChannelShared_t* map_shared(const char* name, bool create) {
+	char path[128];
+	snprintf(path, sizeof(path), "/dev/shm/%s", name);
+
+	// what shm_open does, without needing librt on older systems. Whoever can write the
+	// channel can drive the robot, so only explore's user may; the detector runs as the same user.
+	int fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDWR | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		printf("ERROR - cannot open %s\n\t%s\n", path, strerror(errno));
+		return NULL;
+	}
+	// a file left over from an older explore keeps its mode otherwise
+	if (create && fchmod(fd, 0600) == -1) {
+		printf("ERROR - cannot restrict access to %s\n\t%s\n", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	struct stat status;
+	if (create && ftruncate(fd, sizeof(KobukiChannelShared_t)) == -1) {
+		printf("ERROR - cannot size %s\n\t%s\n", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	if (fstat(fd, &status) == -1 || status.st_size < (off_t) sizeof(KobukiChannelShared_t)) {
+		printf("ERROR - %s is too small for an instruction channel\n", path);
+		close(fd);
+		return NULL;
+	}
+
+	KobukiChannelShared_t* shared = mmap(NULL, sizeof(KobukiChannelShared_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shared == MAP_FAILED) {
+		printf("ERROR - cannot map %s\n\t%s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	return shared;
+}
+
+bool kobukiChannelSharedCreate(KobukiChannel_t * channel, const char * name) {
+	memset(channel, 0, sizeof(KobukiChannel_t));
+	channel->poll = shared_poll;
+	channel->next = shared_next;
+	channel->send = shared_send;
+	channel->flush = nothing_to_flush;
+	channel->close = shared_close;
+
+	channel->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (channel->fd == -1) {
+		printf("ERROR - cannot create eventfd\n\t%s\n", strerror(errno));
+		return false;
+	}
+
+	KobukiChannelShared_t* shared = map_shared(name, true);
+	if (shared == NULL) {
+		close(channel->fd);
+		channel->fd = -1;
+		return false;
+	}
+	shared->version = KOBUKI_CHANNEL_VERSION;
+	// the magic last, a detector attaching sooner does not find it
+	atomic_thread_fence(memory_order_release);
+	memcpy(shared->magic, KOBUKI_CHANNEL_MAGIC, sizeof(shared->magic));
+
+	channel->shm.shared = shared;
+	if (pthread_create(&channel->shm.waker, NULL, shared_waker_main, channel) != 0) {
+		printf("ERROR - could not start instruction channel waker thread\n");
+		munmap(shared, sizeof(KobukiChannelShared_t));
+		channel->shm.shared = NULL;
+		close(channel->fd);
+		channel->fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+KobukiChannelShared_t* kobukiChannelSharedAttach(const char * name) {
+	KobukiChannelShared_t* shared = map_shared(name, false);
+	if (shared == NULL) {
+		return NULL;
+	}
+
+	if (memcmp(shared->magic, KOBUKI_CHANNEL_MAGIC, sizeof(shared->magic)) != 0 ||
+			shared->version != KOBUKI_CHANNEL_VERSION) {
+		printf("ERROR - /dev/shm/%s is not an instruction channel of version %d\n", name, KOBUKI_CHANNEL_VERSION);
+		munmap(shared, sizeof(KobukiChannelShared_t));
+		return NULL;
+	}
+
+	return shared;
+}
+
+void kobukiChannelSharedDetach(KobukiChannelShared_t * shared) {
+	munmap(shared, sizeof(KobukiChannelShared_t));
+}
+
+static void publish_detection(KobukiChannelShared_t* shared, const KobukiInstruction_t* instruction) {
+	unsigned int sequence = atomic_load_explicit(&shared->detectionSequence, memory_order_relaxed);
+
+	atomic_store_explicit(&shared->detectionSequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	shared->detection.message = instruction->sequence;
+	shared->detection.left = instruction->detection.left;
+	shared->detection.center = instruction->detection.center;
+	shared->detection.right = instruction->detection.right;
+	shared->detection.ageUs = instruction->detection.ageUs;
+
+	atomic_store_explicit(&shared->detectionSequence, sequence + 2, memory_order_release);
+}
+
+static void publish_route(KobukiChannelShared_t* shared, const KobukiInstruction_t* instruction) {
+	unsigned int sequence = atomic_load_explicit(&shared->routeSequence, memory_order_relaxed);
+
+	atomic_store_explicit(&shared->routeSequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	shared->route.message = instruction->sequence;
+	shared->route.count = instruction->route.count;
+	memcpy(shared->route.steps, instruction->route.steps, instruction->route.count * sizeof(KobukiRouteStep_t));
+
+	atomic_store_explicit(&shared->routeSequence, sequence + 2, memory_order_release);
+}
+
+int kobukiChannelPublish(KobukiChannelShared_t * shared, const uint8_t * messages, int length) {
+	KobukiInstructionDecoder_t decoder;
+	KobukiInstruction_t instruction;
+	int published = 0;
+
+	if (length < 0 || length > KOBUKI_INSTRUCTION_BUFFER_SIZE) {
+		return -1;
+	}
+	kobukiInstructionDecoderInit(&decoder);
+	memcpy(decoder.data, messages, length);
+	decoder.tail = length;
+
+	while (kobukiInstructionNext(&decoder, &instruction)) {
+		if (instruction.type == KOBUKI_INSTRUCTION_DETECTION) {
+			publish_detection(shared, &instruction);
+			published++;
+		} else if (instruction.type == KOBUKI_INSTRUCTION_ROUTE) {
+			publish_route(shared, &instruction);
+			published++;
+		}
+	}
+
+	if (published > 0) {
+		wake_up(&shared->wake);
+	}
+
+	// a message cut off is an error here, there is no next read to complete it
+	return decoder.error || decoder.head != decoder.tail ? -1 : published;
+}
+
+uint32_t kobukiChannelRouteRequests(KobukiChannelShared_t * shared) {
+	return atomic_load_explicit(&shared->routeRequests, memory_order_acquire);
+}
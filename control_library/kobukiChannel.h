@@ -0,0 +1,143 @@
+#ifndef _KOBUKICHANNEL_H
+#define _KOBUKICHANNEL_H
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "kobukiInstruction.h"
+
+/* Way the instructions (kobukiInstruction.h) travel between explore and the detector.
+
+   Over a socket, the messages are the framed byte stream. If both run on the same host they can
+   use shared memory instead, /dev/shm/<name>, created by explore and attached to by the detector:
+   the newest detection and the newest route each sit in a seqlock, and a counter of route
+   requests goes the other way. Publishing is a few stores and one futex wake, and explore wakes
+   up through an eventfd in its event loop, so a detection gets there in microseconds.
+
+   The state machine sees the same messages either way. */
+
+#define KOBUKI_CHANNEL_MAGIC "KOBCHANL"
+#define KOBUKI_CHANNEL_VERSION 2
+#define KOBUKI_CHANNEL_DEFAULT_NAME "kobuki_instructions"
+#define KOBUKI_CHANNEL_QUEUE_SLOTS 32
+#define KOBUKI_CHANNEL_SLOT_SIZE 64    // largest message sent to a client, telemetry is 40 bytes
+
+typedef struct {
+    uint16_t message;                   // the sender's sequence number of the message
+    uint16_t reserved;
+    int32_t left;
+    int32_t center;
+    int32_t right;
+    uint32_t ageUs;
+} KobukiChannelDetection_t;
+
+typedef struct {
+    uint16_t message;
+    uint16_t count;
+    KobukiRouteStep_t steps[KOBUKI_INSTRUCTION_MAX_STEPS];
+} KobukiChannelRoute_t;
+
+/* The shared memory, as laid out in /dev/shm. Each sequence is odd while its slot is written. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+
+    // detector -> explore
+    atomic_uint detectionSequence;
+    KobukiChannelDetection_t detection;
+    atomic_uint routeSequence;
+    KobukiChannelRoute_t route;
+
+    // bumped after every write above, explore's waker thread sleeps on it with a futex
+    atomic_uint wake;
+
+    // explore -> detector
+    atomic_uint routeRequests;
+} KobukiChannelShared_t;
+
+/* What happens to a message for a socket whose send queue is full, because the client
+   does not read fast enough. Either way the sender never waits for it. */
+typedef enum {
+    KOBUKI_QUEUE_DISCONNECT,     // messages that must arrive: give up on the client, it can reconnect
+    KOBUKI_QUEUE_DROP_OLDEST     // telemetry and the like, where only the newest counts
+} KobukiQueuePolicy_t;
+
+typedef struct {
+    uint8_t data[KOBUKI_CHANNEL_QUEUE_SLOTS][KOBUKI_CHANNEL_SLOT_SIZE];
+    uint8_t length[KOBUKI_CHANNEL_QUEUE_SLOTS];
+    uint32_t head;               // messages sent so far
+    uint32_t tail;               // messages queued so far
+    int offset;                  // bytes of the message at head that are sent already
+    KobukiQueuePolicy_t policy;
+    uint32_t dropped;
+} KobukiSendQueue_t;
+
+typedef struct KobukiChannel {
+    /* Takes in what arrived, without blocking. Returns > 0 if something did, 0 if nothing,
+       < 0 if the other end is gone or sent something unreadable. */
+    int (*poll)(struct KobukiChannel* channel);
+
+    /* Hands out the next message taken in by poll. Returns false if there is none. */
+    bool (*next)(struct KobukiChannel* channel, KobukiInstruction_t* instruction);
+
+    /* Sends the message, or queues what cannot be written right away. Never blocks.
+       Returns 1 if the message was sent or queued, 0 if it has to be tried again later, < 0 on error. */
+    int (*send)(struct KobukiChannel* channel, const KobukiInstruction_t* instruction);
+
+    /* Writes out what is queued, without blocking. Returns the number of messages still queued
+       (watch fd for writing until it is 0), or < 0 on error. */
+    int (*flush)(struct KobukiChannel* channel);
+
+    void (*close)(struct KobukiChannel* channel);
+
+    /* Becomes readable when poll may have something, for epoll. */
+    int fd;
+
+    union {
+        struct {
+            KobukiInstructionDecoder_t decoder;
+            KobukiSendQueue_t queue;
+        } socket;
+
+        struct {
+            KobukiChannelShared_t* shared;
+            unsigned int detectionSequence;  // last seen
+            unsigned int routeSequence;
+            bool haveDetection;
+            bool haveRoute;
+            KobukiInstruction_t detection;
+            KobukiInstruction_t route;
+            uint32_t overwritten;            // detections replaced before poll got to them
+            pthread_t waker;
+            atomic_bool stopping;
+        } shm;
+    };
+} KobukiChannel_t;
+
+/* Connected stream socket, made non-blocking. The channel closes it.
+   Messages to it are queued with KOBUKI_QUEUE_DISCONNECT. */
+void kobukiChannelSocket(KobukiChannel_t * channel, int fd);
+
+/* Sets what happens when the socket's send queue is full. */
+void kobukiChannelSetQueuePolicy(KobukiChannel_t * channel, KobukiQueuePolicy_t policy);
+
+/* Creates /dev/shm/name for a detector to attach to. Returns false on error. */
+bool kobukiChannelSharedCreate(KobukiChannel_t * channel, const char * name);
+
+/* The detector's side, simple enough to call from python through ctypes. */
+
+/* Maps /dev/shm/name created by explore. Returns NULL on error. */
+KobukiChannelShared_t* kobukiChannelSharedAttach(const char * name);
+
+void kobukiChannelSharedDetach(KobukiChannelShared_t * shared);
+
+/* Publishes framed messages (as sent over the socket) and wakes up explore.
+   Returns the number of messages published, or < 0 if they could not be decoded. */
+int kobukiChannelPublish(KobukiChannelShared_t * shared, const uint8_t * messages, int length);
+
+/* Number of route requests explore made so far. */
+uint32_t kobukiChannelRouteRequests(KobukiChannelShared_t * shared);
+
+#endif
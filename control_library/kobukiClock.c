@@ -0,0 +1,197 @@
+#include "kobukiClock.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+/*
+	Host/robot clock synchronization.
+
+	Every packet gives a pair (robot timeStamp, host arrival time). Their difference is the
+	clock offset plus the transport delay, and the delay is never negative, so the smallest
+	differences are the best offset measurements. We keep the smallest difference of every
+	WINDOW_MS of robot time and fit a line through the last NUM_WINDOWS of them:
+	the line is the offset and its slope is the drift between the two clocks.
+*/
+
+#define WINDOW_MS 2000
+#define NUM_WINDOWS 8
+#define MAX_DRIFT 0.001 // crystals are good to ~50 ppm, anything beyond this is noise
+
+typedef struct {
+	uint64_t deviceMs;
+	int64_t offsetUs;
+} clock_sample_t;
+
+typedef struct {
+	bool initialized;
+	uint16_t lastTimeStamp;
+	uint64_t deviceTimeMs;
+
+	// smallest offset seen in the current window
+	clock_sample_t windowMin;
+	uint64_t windowStartMs;
+
+	// minima of the last completed windows, oldest first
+	clock_sample_t windows[NUM_WINDOWS];
+	int numWindows;
+
+	// current estimate: offset(t) = offsetUs + slope * (t - referenceMs) * 1000
+	int64_t offsetUs;
+	double slope;
+	uint64_t referenceMs;
+	uint32_t samples;
+} kobuki_clock_t;
+
+static kobuki_clock_t clock_state = {0};
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+// replaces CLOCK_MONOTONIC if set, see kobukiClockSetSource
+static uint64_t (*clock_source)(void) = NULL;
+
+uint64_t kobukiClockNowUs(void) {
+	if (clock_source) {
+		return clock_source();
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void kobukiClockSetSource(uint64_t (*now)(void)) {
+	clock_source = now;
+}
+
+static int64_t predicted_offset(const kobuki_clock_t* clock, uint64_t deviceMs) {
+	return clock->offsetUs + (int64_t) (clock->slope * ((int64_t) deviceMs - (int64_t) clock->referenceMs) * 1000.0);
+}
+
+/* Least squares line through the window minima. */
+static void fit_windows(kobuki_clock_t* clock) {
+	const clock_sample_t* newest = &clock->windows[clock->numWindows - 1];
+
+	if (clock->numWindows >= 2) {
+		double mean_t = 0, mean_o = 0;
+		for (int i = 0; i < clock->numWindows; i++) {
+			mean_t += (double) ((int64_t) clock->windows[i].deviceMs - (int64_t) newest->deviceMs);
+			mean_o += (double) (clock->windows[i].offsetUs - newest->offsetUs);
+		}
+		mean_t /= clock->numWindows;
+		mean_o /= clock->numWindows;
+
+		double stt = 0, sto = 0;
+		for (int i = 0; i < clock->numWindows; i++) {
+			double t = (double) ((int64_t) clock->windows[i].deviceMs - (int64_t) newest->deviceMs) - mean_t;
+			double o = (double) (clock->windows[i].offsetUs - newest->offsetUs) - mean_o;
+			stt += t * t;
+			sto += t * o;
+		}
+
+		double slope = (stt > 0) ? sto / stt / 1000.0 : 0;
+		if (slope > MAX_DRIFT) slope = MAX_DRIFT;
+		if (slope < -MAX_DRIFT) slope = -MAX_DRIFT;
+
+		clock->slope = slope;
+		clock->referenceMs = newest->deviceMs;
+		clock->offsetUs = newest->offsetUs + (int64_t) (mean_o - slope * mean_t * 1000.0);
+	} else {
+		clock->slope = 0;
+		clock->referenceMs = newest->deviceMs;
+		clock->offsetUs = newest->offsetUs;
+	}
+}
+
+static void add_sample(kobuki_clock_t* clock, uint64_t deviceMs, uint64_t hostUs) {
+	int64_t offset = (int64_t) hostUs - (int64_t) (deviceMs * 1000);
+
+	if (clock->samples == 0) {
+		clock->windowStartMs = deviceMs;
+		clock->windowMin.deviceMs = deviceMs;
+		clock->windowMin.offsetUs = offset;
+		clock->offsetUs = offset;
+		clock->referenceMs = deviceMs;
+		clock->slope = 0;
+	}
+	clock->samples++;
+
+	if (offset < clock->windowMin.offsetUs) {
+		clock->windowMin.deviceMs = deviceMs;
+		clock->windowMin.offsetUs = offset;
+	}
+
+	// a packet that got through faster than the model allows: the line is too high
+	if (offset < predicted_offset(clock, deviceMs)) {
+		clock->offsetUs = offset;
+		clock->referenceMs = deviceMs;
+	}
+
+	if (deviceMs - clock->windowStartMs >= WINDOW_MS) {
+		if (clock->numWindows == NUM_WINDOWS) {
+			memmove(clock->windows, clock->windows + 1, (NUM_WINDOWS - 1) * sizeof(clock_sample_t));
+			clock->numWindows--;
+		}
+		clock->windows[clock->numWindows++] = clock->windowMin;
+		fit_windows(clock);
+
+		clock->windowStartMs = deviceMs;
+		clock->windowMin.deviceMs = deviceMs;
+		clock->windowMin.offsetUs = offset;
+	}
+}
+
+uint64_t kobukiClockObserve(uint16_t timeStamp, uint64_t hostReceiveUs) {
+	kobuki_clock_t* clock = &clock_state;
+
+	pthread_mutex_lock(&clock_lock);
+
+	if (!clock->initialized) {
+		clock->initialized = true;
+		clock->deviceTimeMs = timeStamp;
+	} else {
+		// unsigned 16 bit difference handles the roll over at 65535
+		clock->deviceTimeMs += (uint16_t) (timeStamp - clock->lastTimeStamp);
+	}
+	clock->lastTimeStamp = timeStamp;
+
+	uint64_t deviceTimeMs = clock->deviceTimeMs;
+	add_sample(clock, deviceTimeMs, hostReceiveUs);
+
+	pthread_mutex_unlock(&clock_lock);
+
+	return deviceTimeMs;
+}
+
+uint64_t kobukiClockDeviceToHostUs(uint64_t deviceTimeMs) {
+	pthread_mutex_lock(&clock_lock);
+	int64_t host = (int64_t) (deviceTimeMs * 1000) + predicted_offset(&clock_state, deviceTimeMs);
+	pthread_mutex_unlock(&clock_lock);
+
+	return host > 0 ? (uint64_t) host : 0;
+}
+
+uint64_t kobukiClockHostToDeviceMs(uint64_t hostUs) {
+	const kobuki_clock_t* clock = &clock_state;
+
+	// invert host = t * 1000 + offsetUs + slope * (t - referenceMs) * 1000
+	pthread_mutex_lock(&clock_lock);
+	double device = ((double) hostUs - clock->offsetUs + clock->slope * clock->referenceMs * 1000.0) /
+			(1000.0 * (1.0 + clock->slope));
+	pthread_mutex_unlock(&clock_lock);
+
+	return device > 0 ? (uint64_t) device : 0;
+}
+
+void kobukiClockGetEstimate(KobukiClockEstimate_t * estimate) {
+	pthread_mutex_lock(&clock_lock);
+	estimate->offsetUs = clock_state.offsetUs;
+	estimate->driftPpm = -clock_state.slope * 1e6;
+	estimate->referenceDeviceMs = clock_state.referenceMs;
+	estimate->samples = clock_state.samples;
+	pthread_mutex_unlock(&clock_lock);
+}
+
+void kobukiClockReset(void) {
+	pthread_mutex_lock(&clock_lock);
+	memset(&clock_state, 0, sizeof(clock_state));
+	pthread_mutex_unlock(&clock_lock);
+}
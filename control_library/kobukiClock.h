@@ -0,0 +1,41 @@
+#ifndef _KOBUKICLOCK_H
+#define _KOBUKICLOCK_H
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Host time used throughout the library: CLOCK_MONOTONIC in microseconds. */
+uint64_t kobukiClockNowUs(void);
+
+/* Makes kobukiClockNowUs return now() instead, e.g. a virtual clock to replay a recording
+   faster than real time. NULL goes back to CLOCK_MONOTONIC. Set it before starting any threads.
+   Waits with a timeout (kobuki_uart_recv_frame_timeout) still take real time. */
+void kobukiClockSetSource(uint64_t (*now)(void));
+
+/* Feeds one packet's 16 bit timeStamp and the host time it arrived into the clock.
+   Returns the timeStamp unwrapped to a 64 bit millisecond count that does not roll over.
+   Packets must be fed in order and less than 32 s of robot time apart. */
+uint64_t kobukiClockObserve(uint16_t timeStamp, uint64_t hostReceiveUs);
+
+/* Host time (as kobukiClockNowUs) at which the robot's unwrapped clock read deviceTimeMs. */
+uint64_t kobukiClockDeviceToHostUs(uint64_t deviceTimeMs);
+
+/* Unwrapped robot time in ms at host time hostUs. */
+uint64_t kobukiClockHostToDeviceMs(uint64_t hostUs);
+
+typedef struct {
+    // host time minus robot time at the reference point, i.e. the smallest transport delay seen
+    int64_t offsetUs;
+    // how much faster the robot clock runs than the host clock, in parts per million
+    double driftPpm;
+    // robot time the offset refers to
+    uint64_t referenceDeviceMs;
+    uint32_t samples;
+} KobukiClockEstimate_t;
+
+/* Copies the current offset/drift estimate. */
+void kobukiClockGetEstimate(KobukiClockEstimate_t * estimate);
+
+/* Forgets the estimate and the unwrapping state, e.g. after reconnecting to a robot. */
+void kobukiClockReset(void);
+
+#endif
@@ -0,0 +1,292 @@
+#include "kobukiInstruction.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "kobukiClock.h"
+#include "kobukiStats.h"
+
+static uint16_t get16(const uint8_t* p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static float get_float(const uint8_t* p) {
+	uint32_t bits = get32(p);
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+static void put16(uint8_t* p, uint16_t value) {
+	p[0] = value;
+	p[1] = value >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t value) {
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+static void put_float(uint8_t* p, float value) {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	put32(p, bits);
+}
+
+void kobukiInstructionDecoderInit(KobukiInstructionDecoder_t * decoder) {
+	memset(decoder, 0, sizeof(KobukiInstructionDecoder_t));
+}
+
+int kobukiInstructionRead(KobukiInstructionDecoder_t * decoder, int fd) {
+	// move a partial message to the front to make room behind it
+	if (decoder->head == decoder->tail) {
+		decoder->head = decoder->tail = 0;
+	} else if (decoder->head > 0) {
+		memmove(decoder->data, decoder->data + decoder->head, decoder->tail - decoder->head);
+		decoder->tail -= decoder->head;
+		decoder->head = 0;
+	}
+
+	int space = KOBUKI_INSTRUCTION_BUFFER_SIZE - decoder->tail;
+	if (space == 0) {
+		return 0;
+	}
+
+	int count = recv(fd, decoder->data + decoder->tail, space, MSG_DONTWAIT);
+	if (count == 0) {
+		return -1;
+	}
+	if (count < 0) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+	}
+
+	decoder->tail += count;
+	return count;
+}
+
+// Returns 1 if the message was decoded, 0 if it is too short for its type, -1 if its type is unknown.
+static int decode_payload(KobukiInstruction_t* instruction, const uint8_t* payload, uint16_t length) {
+	switch (instruction->type) {
+		case KOBUKI_INSTRUCTION_DETECTION:
+			if (length < 12) {
+				return 0;
+			}
+			instruction->detection.left = (int32_t) get32(payload);
+			instruction->detection.center = (int32_t) get32(payload + 4);
+			instruction->detection.right = (int32_t) get32(payload + 8);
+			instruction->detection.ageUs = length >= 16 ? get32(payload + 12) : 0;
+			return 1;
+
+		case KOBUKI_INSTRUCTION_ROUTE_REQUEST:
+			return 1;
+
+		case KOBUKI_INSTRUCTION_HELLO:
+			if (length < 1) {
+				return 0;
+			}
+			instruction->hello.role = payload[0];
+			return 1;
+
+		case KOBUKI_INSTRUCTION_TELEMETRY:
+			if (length < KOBUKI_INSTRUCTION_TELEMETRY_SIZE) {
+				return 0;
+			}
+			instruction->telemetry.timeMs = get32(payload);
+			instruction->telemetry.state = payload[4];
+			instruction->telemetry.bumpers = payload[5];
+			instruction->telemetry.x = get_float(payload + 8);
+			instruction->telemetry.y = get_float(payload + 12);
+			instruction->telemetry.theta = get_float(payload + 16);
+			instruction->telemetry.left = (int32_t) get32(payload + 20);
+			instruction->telemetry.center = (int32_t) get32(payload + 24);
+			instruction->telemetry.right = (int32_t) get32(payload + 28);
+			return 1;
+
+		case KOBUKI_INSTRUCTION_ROUTE: {
+			if (length < 2) {
+				return 0;
+			}
+			uint16_t count = get16(payload);
+			if (length < 2 + 8 * count) {
+				return 0;
+			}
+			// like the encoder, cut off what does not fit rather than lose the whole route
+			if (count > KOBUKI_INSTRUCTION_MAX_STEPS) {
+				printf("ERROR - route has %d steps, following the first %d\n", count, KOBUKI_INSTRUCTION_MAX_STEPS);
+				count = KOBUKI_INSTRUCTION_MAX_STEPS;
+			}
+			instruction->route.count = count;
+			for (int i = 0; i < count; i++) {
+				instruction->route.steps[i].angle = get_float(payload + 2 + 8 * i);
+				instruction->route.steps[i].distance = get_float(payload + 6 + 8 * i);
+			}
+			return 1;
+		}
+
+		default:
+			return -1;
+	}
+}
+
+bool kobukiInstructionNext(KobukiInstructionDecoder_t * decoder, KobukiInstruction_t * instruction) {
+	while (!decoder->error && decoder->tail - decoder->head >= KOBUKI_INSTRUCTION_HEADER_SIZE) {
+		const uint8_t* header = decoder->data + decoder->head;
+		uint16_t length = get16(header + 4);
+
+		if (header[0] != KOBUKI_INSTRUCTION_MAGIC || header[1] != KOBUKI_INSTRUCTION_VERSION ||
+				length > KOBUKI_INSTRUCTION_BUFFER_SIZE - KOBUKI_INSTRUCTION_HEADER_SIZE) {
+			printf("ERROR - instruction stream is not protocol version %d\n", KOBUKI_INSTRUCTION_VERSION);
+			decoder->error = true;
+			return false;
+		}
+
+		if (decoder->tail - decoder->head < KOBUKI_INSTRUCTION_HEADER_SIZE + length) {
+			return false;
+		}
+		decoder->head += KOBUKI_INSTRUCTION_HEADER_SIZE + length;
+
+		instruction->type = header[2];
+		instruction->sequence = get16(header + 6);
+
+		int status = decode_payload(instruction, header + KOBUKI_INSTRUCTION_HEADER_SIZE, length);
+		if (status > 0) {
+			decoder->messages++;
+			return true;
+		}
+
+		if (status == 0) {
+			printf("ERROR - instruction of type %d is too short (%d bytes), skipped\n", instruction->type, length);
+			decoder->malformed++;
+		} else {
+			// newer senders may add types, skip what we do not understand
+			decoder->unknown++;
+		}
+	}
+
+	return false;
+}
+
+int kobukiInstructionEncode(const KobukiInstruction_t * instruction, uint8_t * buffer, int size) {
+	uint8_t* payload = buffer + KOBUKI_INSTRUCTION_HEADER_SIZE;
+	int length = 0;
+
+	switch (instruction->type) {
+		case KOBUKI_INSTRUCTION_DETECTION:
+			length = 16;
+			break;
+		case KOBUKI_INSTRUCTION_ROUTE_REQUEST:
+			length = 0;
+			break;
+		case KOBUKI_INSTRUCTION_HELLO:
+			length = 1;
+			break;
+		case KOBUKI_INSTRUCTION_TELEMETRY:
+			length = KOBUKI_INSTRUCTION_TELEMETRY_SIZE;
+			break;
+		case KOBUKI_INSTRUCTION_ROUTE: {
+			uint16_t count = instruction->route.count;
+			if (count > KOBUKI_INSTRUCTION_MAX_STEPS) {
+				count = KOBUKI_INSTRUCTION_MAX_STEPS;
+			}
+			length = 2 + 8 * count;
+			break;
+		}
+		default:
+			return 0;
+	}
+
+	if (size < KOBUKI_INSTRUCTION_HEADER_SIZE + length) {
+		return 0;
+	}
+
+	buffer[0] = KOBUKI_INSTRUCTION_MAGIC;
+	buffer[1] = KOBUKI_INSTRUCTION_VERSION;
+	buffer[2] = instruction->type;
+	buffer[3] = 0;
+	put16(buffer + 4, length);
+	put16(buffer + 6, instruction->sequence);
+
+	if (instruction->type == KOBUKI_INSTRUCTION_DETECTION) {
+		put32(payload, instruction->detection.left);
+		put32(payload + 4, instruction->detection.center);
+		put32(payload + 8, instruction->detection.right);
+		put32(payload + 12, instruction->detection.ageUs);
+
+	} else if (instruction->type == KOBUKI_INSTRUCTION_HELLO) {
+		payload[0] = instruction->hello.role;
+
+	} else if (instruction->type == KOBUKI_INSTRUCTION_TELEMETRY) {
+		put32(payload, instruction->telemetry.timeMs);
+		payload[4] = instruction->telemetry.state;
+		payload[5] = instruction->telemetry.bumpers;
+		put16(payload + 6, 0);
+		put_float(payload + 8, instruction->telemetry.x);
+		put_float(payload + 12, instruction->telemetry.y);
+		put_float(payload + 16, instruction->telemetry.theta);
+		put32(payload + 20, instruction->telemetry.left);
+		put32(payload + 24, instruction->telemetry.center);
+		put32(payload + 28, instruction->telemetry.right);
+
+	} else if (instruction->type == KOBUKI_INSTRUCTION_ROUTE) {
+		int count = (length - 2) / 8;
+		put16(payload, count);
+		for (int i = 0; i < count; i++) {
+			put_float(payload + 2 + 8 * i, instruction->route.steps[i].angle);
+			put_float(payload + 6 + 8 * i, instruction->route.steps[i].distance);
+		}
+	}
+
+	return KOBUKI_INSTRUCTION_HEADER_SIZE + length;
+}
+
+bool kobukiDetectionPost(KobukiDetectionMailbox_t * mailbox, const KobukiInstruction_t * instruction, uint32_t source) {
+	uint64_t now = kobukiClockNowUs();
+	uint64_t captured = now > instruction->detection.ageUs ? now - instruction->detection.ageUs : 0;
+	mailbox->received++;
+
+	// another detector already saw a newer frame
+	if (captured < mailbox->latest.capturedUs) {
+		mailbox->stale++;
+		kobukiStatsCount(KOBUKI_COUNTER_STALE_DETECTIONS);
+		return false;
+	}
+
+	if (mailbox->unread) {
+		mailbox->stale++;
+		kobukiStatsCount(KOBUKI_COUNTER_STALE_DETECTIONS);
+	}
+
+	mailbox->latest.sequence = instruction->sequence;
+	mailbox->latest.source = source;
+	mailbox->latest.left = instruction->detection.left;
+	mailbox->latest.center = instruction->detection.center;
+	mailbox->latest.right = instruction->detection.right;
+	mailbox->latest.receivedUs = now;
+	mailbox->latest.capturedUs = captured;
+	mailbox->unread = true;
+	return true;
+}
+
+bool kobukiDetectionTake(KobukiDetectionMailbox_t * mailbox, KobukiDetection_t * detection, uint64_t maxAgeUs) {
+	if (!mailbox->unread) {
+		return false;
+	}
+	mailbox->unread = false;
+
+	if (kobukiClockNowUs() - mailbox->latest.receivedUs > maxAgeUs) {
+		mailbox->stale++;
+		kobukiStatsCount(KOBUKI_COUNTER_STALE_DETECTIONS);
+		return false;
+	}
+
+	*detection = mailbox->latest;
+	return true;
+}
@@ -0,0 +1,142 @@
+#ifndef _KOBUKIINSTRUCTION_H
+#define _KOBUKIINSTRUCTION_H
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "kobukiPath.h"
+
+/* Messages between explore and its clients over TCP: detectors / route planners
+   (send_instruction.py) and telemetry viewers (test_code/telemetry_view).
+
+   Every message is an 8 byte header followed by its payload, all little endian:
+     uint8  magic     KOBUKI_INSTRUCTION_MAGIC
+     uint8  version   KOBUKI_INSTRUCTION_VERSION
+     uint8  type      KobukiInstructionType_t
+     uint8  reserved  0
+     uint16 length    bytes of payload
+     uint16 sequence  counted up by the sender
+   Payloads:
+     DETECTION      int32 left, int32 center, int32 right, optionally uint32 age in us:
+                    how long before sending the camera frame was taken
+     ROUTE_REQUEST  nothing, explore asks for the way back
+     ROUTE          uint16 count, then count times (float32 angle in degrees, float32 distance in m)
+     HELLO          uint8 KobukiClientRole_t, sent first by a client. Without it a client is a detector.
+     TELEMETRY      uint32 time in ms, uint8 state, uint8 bumpers pressed, uint16 reserved,
+                    float32 x, y in m and theta in rad, int32 left, center, right of the last detection
+
+   TCP delivers a byte stream, so the decoder collects bytes in a buffer and hands out
+   messages once they are complete, however they were split up or bunched together. */
+
+#define KOBUKI_INSTRUCTION_MAGIC 0xB5
+#define KOBUKI_INSTRUCTION_VERSION 1
+#define KOBUKI_INSTRUCTION_HEADER_SIZE 8
+#define KOBUKI_INSTRUCTION_MAX_STEPS KOBUKI_PATH_MAX_WAYPOINTS
+#define KOBUKI_INSTRUCTION_MAX_PAYLOAD (2 + 8 * KOBUKI_INSTRUCTION_MAX_STEPS)
+#define KOBUKI_INSTRUCTION_BUFFER_SIZE 4096
+#define KOBUKI_INSTRUCTION_TELEMETRY_SIZE 32
+
+typedef enum {
+    KOBUKI_INSTRUCTION_DETECTION = 1,
+    KOBUKI_INSTRUCTION_ROUTE_REQUEST = 2,
+    KOBUKI_INSTRUCTION_ROUTE = 3,
+    KOBUKI_INSTRUCTION_HELLO = 4,
+    KOBUKI_INSTRUCTION_TELEMETRY = 5
+} KobukiInstructionType_t;
+
+typedef enum {
+    KOBUKI_ROLE_DETECTOR = 1,  // sends detections and routes, gets route requests
+    KOBUKI_ROLE_VIEWER = 2     // only gets telemetry
+} KobukiClientRole_t;
+
+typedef struct {
+    float angle;     // degrees to turn before the step, negative is right
+    float distance;  // m to drive straight after turning
+} KobukiRouteStep_t;
+
+typedef struct {
+    KobukiInstructionType_t type;
+    uint16_t sequence;
+    union {
+        struct {
+            int32_t left;
+            int32_t center;
+            int32_t right;
+            uint32_t ageUs;
+        } detection;
+        struct {
+            uint16_t count;
+            KobukiRouteStep_t steps[KOBUKI_INSTRUCTION_MAX_STEPS];
+        } route;
+        struct {
+            uint8_t role;
+        } hello;
+        struct {
+            uint32_t timeMs;
+            uint8_t state;
+            uint8_t bumpers;
+            float x;
+            float y;
+            float theta;
+            int32_t left;
+            int32_t center;
+            int32_t right;
+        } telemetry;
+    };
+} KobukiInstruction_t;
+
+typedef struct {
+    uint8_t data[KOBUKI_INSTRUCTION_BUFFER_SIZE];
+    int head;                // next byte to decode
+    int tail;                // end of the bytes received
+    bool error;              // the stream is not in this protocol, drop the connection
+    uint32_t messages;
+    uint32_t unknown;        // messages of a type we do not know, skipped
+    uint32_t malformed;      // messages of a known type with too short a payload, skipped
+} KobukiInstructionDecoder_t;
+
+/* A detection as explore keeps it. */
+typedef struct {
+    uint16_t sequence;       // the sender's
+    uint32_t source;         // which detector, for several of them
+    int32_t left;
+    int32_t center;
+    int32_t right;
+    uint64_t receivedUs;     // kobukiClockNowUs when it arrived
+    uint64_t capturedUs;     // when its camera frame was taken, on the same clock
+} KobukiDetection_t;
+
+/* Only the newest detection matters: each one says where the duck is now, so one that arrives
+   before the last was looked at replaces it, and the replaced one is counted as stale.
+   With several detectors, newest means taken from the newest camera frame: a detection
+   of a frame older than the one in the mailbox is stale on arrival. */
+typedef struct {
+    KobukiDetection_t latest;
+    bool unread;             // latest has not been taken yet
+    uint32_t received;
+    uint32_t stale;          // replaced before they were taken, or taken too old
+} KobukiDetectionMailbox_t;
+
+void kobukiInstructionDecoderInit(KobukiInstructionDecoder_t * decoder);
+
+/* Reads whatever the non-blocking socket has queued into the decoder, with one recv.
+   Returns number of bytes read, 0 if there was nothing, or < 0 if the connection was closed or failed. */
+int kobukiInstructionRead(KobukiInstructionDecoder_t * decoder, int fd);
+
+/* Takes the next complete message out of the decoder. Returns false if there is none yet;
+   the bytes of a partial message stay for the next read. Returns false and sets decoder->error
+   if the stream cannot be decoded. Routes longer than KOBUKI_INSTRUCTION_MAX_STEPS are cut off. */
+bool kobukiInstructionNext(KobukiInstructionDecoder_t * decoder, KobukiInstruction_t * instruction);
+
+/* Writes the message into buffer. Returns its length, or 0 if the buffer is too small.
+   Routes longer than KOBUKI_INSTRUCTION_MAX_STEPS are cut off. */
+int kobukiInstructionEncode(const KobukiInstruction_t * instruction, uint8_t * buffer, int size);
+
+/* Puts a DETECTION message from source into the mailbox, replacing what is there unless that is newer.
+   Returns false if the detection was stale already. */
+bool kobukiDetectionPost(KobukiDetectionMailbox_t * mailbox, const KobukiInstruction_t * instruction, uint32_t source);
+
+/* Takes the newest detection if there is one that was not taken yet and that arrived at most
+   maxAgeUs ago. An older one is dropped and counted as stale. Returns false if there is none. */
+bool kobukiDetectionTake(KobukiDetectionMailbox_t * mailbox, KobukiDetection_t * detection, uint64_t maxAgeUs);
+
+#endif
@@ -0,0 +1,209 @@
+#include "kobukiOdometry.h"
+#include "kobukiSensor.h"
+
+#include <math.h>
+#include <stdatomic.h>
+#include <string.h>
+
+/*
+	Differential drive odometry.
+
+	Each packet the wheels moved dl and dr since the last one, so the robot moved
+	ds = (dl + dr) / 2 along its heading and turned by (dr - dl) / wheel base.
+	Encoders turn that much even if a wheel slips, so the turn from the gyro
+	(the inertial angle) is much better and is weighted in by its variance.
+
+	The pose is published like the sensor snapshot in kobuki_library.c: the sequence is odd
+	while the pose is being written, and readers copy again if it was odd or changed.
+*/
+
+#define ANGLE_UNIT (M_PI / 18000.0) // inertial angle and angleRate are in 0.01 degrees
+
+// Standard deviations of the errors
+#define DISTANCE_NOISE 0.02 // per m driven
+#define ENCODER_TURN_NOISE 0.05 // rad per m driven, from wheel slip
+#define ENCODER_TURN_NOISE_MIN 0.0005 // rad per packet
+// rad per packet: one step of the 0.01 degree resolution (0.000175 rad). Rounding alone would be
+// 0.01 / sqrt(6) degrees for the difference of two readings, a full step also covers gyro drift.
+#define GYRO_TURN_NOISE ANGLE_UNIT
+
+typedef struct {
+	bool initialized;
+	uint16_t leftEncoder;
+	uint16_t rightEncoder;
+	bool haveAngle;
+	int16_t angle;
+	uint64_t deviceTimeMs;
+} odometry_input_t;
+
+typedef struct {
+	atomic_uint sequence;
+	KobukiPose_t pose;
+} pose_snapshot_t;
+
+// Only the thread that parses packets writes these
+static odometry_input_t last_input = {0};
+static KobukiPose_t pose = {0};
+
+static pose_snapshot_t published = {0};
+static atomic_bool reset_requested = false;
+
+static void publish_pose(void) {
+	unsigned int sequence = atomic_load_explicit(&published.sequence, memory_order_relaxed);
+
+	atomic_store_explicit(&published.sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	memcpy(&published.pose, &pose, sizeof(KobukiPose_t));
+
+	atomic_store_explicit(&published.sequence, sequence + 2, memory_order_release);
+}
+
+/* P = F P F' + G diag(ds_var, turn_var) G', F and G being the motion model linearized at the step's heading. */
+static void propagate_covariance(double heading, double ds, double ds_var, double turn_var) {
+	double c = cos(heading), s = sin(heading);
+	double F[3][3] = {
+		{1, 0, -ds * s},
+		{0, 1, ds * c},
+		{0, 0, 1},
+	};
+	double FP[3][3] = {{0}};
+	double P[3][3] = {{0}};
+
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			for (int k = 0; k < 3; k++) {
+				FP[i][j] += F[i][k] * pose.covariance[k][j];
+			}
+		}
+	}
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			for (int k = 0; k < 3; k++) {
+				P[i][j] += FP[i][k] * F[j][k];
+			}
+		}
+	}
+
+	double G[3][2] = {
+		{c, -ds * s},
+		{s, ds * c},
+		{0, 1},
+	};
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			P[i][j] += G[i][0] * G[j][0] * ds_var + G[i][1] * G[j][1] * turn_var;
+		}
+	}
+
+	memcpy(pose.covariance, P, sizeof(P));
+}
+
+void kobukiOdometryUpdate(const KobukiSensors_t * sensors, uint32_t decoded) {
+	odometry_input_t* last = &last_input;
+
+	if (atomic_exchange(&reset_requested, false)) {
+		memset(last, 0, sizeof(odometry_input_t));
+		memset(&pose, 0, sizeof(KobukiPose_t));
+	}
+
+	// without the encoders there is nothing to integrate
+	if (!(decoded & KOBUKI_SENSOR_BASIC)) {
+		return;
+	}
+
+	bool haveAngle = decoded & KOBUKI_SENSOR_INERTIAL;
+
+	if (!last->initialized) {
+		last->initialized = true;
+		last->leftEncoder = sensors->leftWheelEncoder;
+		last->rightEncoder = sensors->rightWheelEncoder;
+		last->haveAngle = haveAngle;
+		last->angle = sensors->angle;
+		last->deviceTimeMs = sensors->deviceTimeMs;
+
+		pose.deviceTimeMs = sensors->deviceTimeMs;
+		pose.gyro = haveAngle;
+		publish_pose();
+		return;
+	}
+
+	// signed 16 bit differences handle the roll over in both directions
+	int16_t leftTicks = (int16_t) (sensors->leftWheelEncoder - last->leftEncoder);
+	int16_t rightTicks = (int16_t) (sensors->rightWheelEncoder - last->rightEncoder);
+	double dl = leftTicks * KOBUKI_METERS_PER_TICK;
+	double dr = rightTicks * KOBUKI_METERS_PER_TICK;
+	double ds = (dl + dr) / 2;
+
+	// turn from the encoders, and from the gyro if we have two angles in a row
+	double turn = (dr - dl) / KOBUKI_WHEEL_BASE;
+	double turn_var = pow(ENCODER_TURN_NOISE * fabs(ds) + ENCODER_TURN_NOISE_MIN, 2);
+	if (haveAngle && last->haveAngle) {
+		// the angle is -180 to 180 degrees, the short way round is the turn
+		int32_t angleStep = sensors->angle - last->angle;
+		if (angleStep > 18000) angleStep -= 36000;
+		if (angleStep < -18000) angleStep += 36000;
+		double gyroTurn = angleStep * ANGLE_UNIT;
+		double gyro_var = GYRO_TURN_NOISE * GYRO_TURN_NOISE;
+
+		// inverse variance weighting
+		turn = (turn * gyro_var + gyroTurn * turn_var) / (gyro_var + turn_var);
+		turn_var = gyro_var * turn_var / (gyro_var + turn_var);
+	}
+
+	double heading = pose.theta;
+	double ds_var = pow(DISTANCE_NOISE * ds, 2);
+
+	// integrate along the average heading of the step
+	pose.x += ds * cos(heading + turn / 2);
+	pose.y += ds * sin(heading + turn / 2);
+	pose.theta += turn;
+	pose.distance += ds;
+	propagate_covariance(heading + turn / 2, ds, ds_var, turn_var);
+
+	pose.leftTicks += leftTicks;
+	pose.rightTicks += rightTicks;
+
+	uint64_t dt_ms = sensors->deviceTimeMs - last->deviceTimeMs;
+	if (dt_ms > 0) {
+		pose.linearVelocity = ds * 1000.0 / dt_ms;
+		pose.angularVelocity = turn * 1000.0 / dt_ms;
+	}
+	if (haveAngle) {
+		pose.angularVelocity = sensors->angleRate * ANGLE_UNIT;
+	}
+
+	pose.deviceTimeMs = sensors->deviceTimeMs;
+	pose.gyro = haveAngle;
+	pose.updates++;
+
+	last->leftEncoder = sensors->leftWheelEncoder;
+	last->rightEncoder = sensors->rightWheelEncoder;
+	last->haveAngle = haveAngle;
+	last->angle = sensors->angle;
+	last->deviceTimeMs = sensors->deviceTimeMs;
+
+	publish_pose();
+}
+
+uint32_t kobukiOdometryGetPose(KobukiPose_t * copy) {
+	unsigned int before, after;
+
+	do {
+		before = atomic_load_explicit(&published.sequence, memory_order_acquire);
+		if (before & 1) {
+			continue;
+		}
+
+		memcpy(copy, &published.pose, sizeof(KobukiPose_t));
+
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(&published.sequence, memory_order_relaxed);
+	} while ((before & 1) || before != after);
+
+	return copy->updates;
+}
+
+void kobukiOdometryReset(void) {
+	atomic_store(&reset_requested, true);
+}
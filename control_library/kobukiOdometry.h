@@ -0,0 +1,54 @@
+#ifndef _KOBUKIODOMETRY_H
+#define _KOBUKIODOMETRY_H
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "kobukiSensorTypes.h"
+
+/* Kobuki geometry */
+#define KOBUKI_METERS_PER_TICK 0.000085292 // 70 mm wheel, 2578.33 encoder ticks per wheel turn
+#define KOBUKI_WHEEL_BASE 0.230 // m between the wheels
+
+typedef struct {
+    // position in m and heading in rad since the last reset; x is forward at the reset,
+    // theta is counter clockwise positive and keeps counting past +-pi
+    double x;
+    double y;
+    double theta;
+
+    // uncertainty of (x, y, theta), row major
+    double covariance[3][3];
+
+    // signed distance driven along the heading in m, forward positive, like an odometer
+    double distance;
+
+    // m/s and rad/s
+    double linearVelocity;
+    double angularVelocity;
+
+    // encoder counts unwrapped so they never roll over
+    int64_t leftTicks;
+    int64_t rightTicks;
+
+    // unwrapped robot time of the last packet used
+    uint64_t deviceTimeMs;
+    uint32_t updates;
+    // whether the heading comes from the gyro or only from the encoders
+    bool gyro;
+} KobukiPose_t;
+
+/* Advances the pose by one parsed packet. decoded are the KOBUKI_SENSOR_* bits
+   kobukiParseSensorPacketMasked returned for it: the encoders come from basic sensor data,
+   the heading from the inertial data if there is any. Packets may be skipped as long as the
+   wheels turn less than half an encoder roll over (2.8 m) in between.
+   The library calls this for every packet it parses. */
+void kobukiOdometryUpdate(const KobukiSensors_t * sensors, uint32_t decoded);
+
+/* Copies the current pose. Never blocks and never waits for the writer.
+   Returns the number of updates the pose includes. */
+uint32_t kobukiOdometryGetPose(KobukiPose_t * pose);
+
+/* Starts again at (0, 0, 0) with the next packet. */
+void kobukiOdometryReset(void);
+
+#endif
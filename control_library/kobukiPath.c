@@ -0,0 +1,238 @@
+#include "kobukiPath.h"
+#include "kobuki_library.h"
+#include "kobukiClock.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+	Pure pursuit.
+
+	Every packet we look for the point LOOKAHEAD m further along the path than the robot is
+	and drive the circle arc that passes through it: curvature 2 sin(alpha) / distance, alpha
+	being the angle between the heading and that point. The speed is limited by how fast the
+	robot can turn on that arc, how fast it can stop at the end of the path and how fast
+	it may speed up, so corners are rounded instead of stopped at.
+	If the point is far off to the side or behind, the robot first turns in place towards it.
+
+	Like the turn controller, time is robot time from the packets. Only when the packets stop
+	coming, the robot clock stops too, so that is timed on the host clock.
+*/
+
+#define LOOKAHEAD 0.25 // m, larger cuts corners more but steers more smoothly
+#define MAX_SPEED 0.30 // m/s
+#define MIN_SPEED 0.03 // m/s
+#define ACCEL 0.5 // m/s^2
+#define DECEL 0.4 // m/s^2
+#define MAX_RATE 1.2 // rad/s on the arc
+#define MAX_CURVATURE 10.0 // 1/m, tighter than a 10 cm radius is turning in place
+#define SPIN_ANGLE (60.0 * M_PI / 180.0) // turn in place if the lookahead point is further off
+#define SPIN_GAIN 2.0 // rad/s per rad off
+#define GOAL_TOLERANCE 0.03 // m
+#define PACKET_PERIOD 0.02 // s
+#define FEEDBACK_TIMEOUT_MS 100 // host time without a new packet before giving up, 5 packets
+
+typedef struct {
+	KobukiPathStatus_t status;
+	bool started;
+	// waypoints[0] is where the robot started
+	KobukiWaypoint_t waypoints[KOBUKI_PATH_MAX_WAYPOINTS + 1];
+	int count;
+	int segment; // waypoints[segment] to waypoints[segment + 1]
+	double remaining;
+	double speed; // last commanded, m/s
+	int16_t command_radius;
+	int16_t command_speed;
+	uint64_t last_ms;
+	uint64_t last_host_us; // kobukiClockNowUs when last_ms changed
+	uint64_t deadline_ms;
+} path_follower_t;
+
+static path_follower_t path = {0};
+
+static double segment_length(int segment) {
+	const KobukiWaypoint_t* a = &path.waypoints[segment];
+	const KobukiWaypoint_t* b = &path.waypoints[segment + 1];
+	return hypot(b->x - a->x, b->y - a->y);
+}
+
+/* Where the robot is along the segment, 0 at its start and 1 at its end. */
+static double project(int segment, double x, double y) {
+	const KobukiWaypoint_t* a = &path.waypoints[segment];
+	const KobukiWaypoint_t* b = &path.waypoints[segment + 1];
+	double dx = b->x - a->x, dy = b->y - a->y;
+	double length2 = dx * dx + dy * dy;
+
+	if (length2 == 0) {
+		return 1;
+	}
+	double t = ((x - a->x) * dx + (y - a->y) * dy) / length2;
+	return fmax(0, fmin(1, t));
+}
+
+/* The point distance m along the path from t on the segment, or the end of the path. */
+static KobukiWaypoint_t point_ahead(int segment, double t, double distance) {
+	while (segment < path.count - 1) {
+		double length = segment_length(segment);
+		double left = (1 - t) * length;
+
+		if (distance <= left && length > 0) {
+			const KobukiWaypoint_t* a = &path.waypoints[segment];
+			const KobukiWaypoint_t* b = &path.waypoints[segment + 1];
+			double s = t + distance / length;
+			KobukiWaypoint_t point = { a->x + s * (b->x - a->x), a->y + s * (b->y - a->y) };
+			return point;
+		}
+
+		distance -= left;
+		segment++;
+		t = 0;
+	}
+
+	return path.waypoints[path.count - 1];
+}
+
+static void drive(int16_t radius, int16_t speed) {
+	path.command_radius = radius;
+	path.command_speed = speed;
+	kobukiDriveRadius(radius, speed);
+}
+
+static void stop(KobukiPathStatus_t status) {
+	path.status = status;
+	path.speed = 0;
+	drive(0, 0);
+}
+
+bool kobukiPathStart(const KobukiWaypoint_t * waypoints, int count) {
+	if (count <= 0) {
+		return false;
+	}
+	if (count > KOBUKI_PATH_MAX_WAYPOINTS) {
+		printf("ERROR - path has %d waypoints, following the first %d\n", count, KOBUKI_PATH_MAX_WAYPOINTS);
+		count = KOBUKI_PATH_MAX_WAYPOINTS;
+	}
+
+	memcpy(&path.waypoints[1], waypoints, count * sizeof(KobukiWaypoint_t));
+	path.count = count + 1;
+	path.segment = 0;
+	path.speed = 0;
+	path.started = false;
+	path.status = KOBUKI_PATH_RUNNING;
+
+	return true;
+}
+
+KobukiPathStatus_t kobukiPathUpdate(void) {
+	KobukiPose_t pose;
+
+	if (path.status != KOBUKI_PATH_RUNNING) {
+		return path.status;
+	}
+
+	kobukiOdometryGetPose(&pose);
+
+	if (!path.started) {
+		path.started = true;
+		path.waypoints[0].x = pose.x;
+		path.waypoints[0].y = pose.y;
+		path.last_ms = pose.deviceTimeMs;
+		path.last_host_us = kobukiClockNowUs();
+
+		double length = 0;
+		for (int i = 0; i < path.count - 1; i++) {
+			length += segment_length(i);
+		}
+		// generous: the whole path at a crawl, plus turning around a few times
+		path.deadline_ms = pose.deviceTimeMs + (uint64_t) (length / MIN_SPEED * 1000) + 10000;
+
+	} else if (pose.deviceTimeMs == path.last_ms) {
+		// the robot went quiet, e.g. the cable came off: do not drive on blind
+		if (kobukiClockNowUs() - path.last_host_us > FEEDBACK_TIMEOUT_MS * 1000) {
+			printf("ERROR - no sensor packets for %dms, stopping the path\n", FEEDBACK_TIMEOUT_MS);
+			stop(KOBUKI_PATH_TIMEOUT);
+			return path.status;
+		}
+
+		// nothing new from the robot since the last pass, keep going
+		drive(path.command_radius, path.command_speed);
+		return path.status;
+	}
+
+	double dt = fmax((pose.deviceTimeMs - path.last_ms) / 1000.0, PACKET_PERIOD);
+	path.last_ms = pose.deviceTimeMs;
+	path.last_host_us = kobukiClockNowUs();
+
+	if (pose.deviceTimeMs > path.deadline_ms) {
+		printf("ERROR - path not finished in time, %.2fm left\n", path.remaining);
+		stop(KOBUKI_PATH_TIMEOUT);
+		return path.status;
+	}
+
+	// move on to the segment the robot is on
+	double t = project(path.segment, pose.x, pose.y);
+	while (t >= 1 && path.segment < path.count - 2) {
+		path.segment++;
+		t = project(path.segment, pose.x, pose.y);
+	}
+
+	path.remaining = (1 - t) * segment_length(path.segment);
+	for (int i = path.segment + 1; i < path.count - 1; i++) {
+		path.remaining += segment_length(i);
+	}
+
+	const KobukiWaypoint_t* goal = &path.waypoints[path.count - 1];
+	if (path.remaining < GOAL_TOLERANCE || hypot(goal->x - pose.x, goal->y - pose.y) < GOAL_TOLERANCE) {
+		stop(KOBUKI_PATH_DONE);
+		return path.status;
+	}
+
+	// the lookahead point in robot coordinates
+	KobukiWaypoint_t target = point_ahead(path.segment, t, LOOKAHEAD);
+	double dx = target.x - pose.x, dy = target.y - pose.y;
+	double ahead = cos(pose.theta) * dx + sin(pose.theta) * dy;
+	double left = -sin(pose.theta) * dx + cos(pose.theta) * dy;
+	double distance = hypot(ahead, left);
+	double alpha = atan2(left, ahead);
+
+	if (fabs(alpha) > SPIN_ANGLE) {
+		// turn in place towards it, radius 1 turns in place, positive speed counter clockwise
+		double rate = fmax(-MAX_RATE, fmin(MAX_RATE, SPIN_GAIN * alpha));
+		path.speed = 0;
+		drive(1, (int16_t) lround(rate * KOBUKI_WHEEL_BASE / 2 * 1000));
+		return path.status;
+	}
+
+	double curvature = (distance > 0) ? 2 * sin(alpha) / distance : 0;
+	curvature = fmax(-MAX_CURVATURE, fmin(MAX_CURVATURE, curvature));
+
+	double speed = MAX_SPEED;
+	if (fabs(curvature) > 0) {
+		speed = fmin(speed, MAX_RATE / fabs(curvature));
+	}
+	speed = fmin(speed, sqrt(2 * DECEL * path.remaining));
+	speed = fmin(speed, path.speed + ACCEL * dt);
+	speed = fmax(speed, MIN_SPEED);
+	path.speed = speed;
+
+	// the Kobuki takes the radius in mm, 0 meaning straight
+	int16_t radius = 0;
+	if (fabs(curvature) * 32767 > 1000) {
+		radius = (int16_t) lround(1000 / curvature);
+	}
+	drive(radius, (int16_t) lround(speed * 1000));
+
+	return path.status;
+}
+
+void kobukiPathCancel(void) {
+	if (path.status == KOBUKI_PATH_RUNNING) {
+		stop(KOBUKI_PATH_IDLE);
+	}
+	path.status = KOBUKI_PATH_IDLE;
+}
+
+double kobukiPathRemaining(void) {
+	return path.remaining;
+}
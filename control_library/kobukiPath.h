@@ -0,0 +1,40 @@
+#ifndef _KOBUKIPATH_H
+#define _KOBUKIPATH_H
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Path follower: drives through a list of waypoints in one continuous motion
+   (pure pursuit), steering with kobukiDriveRadius and the odometry pose. */
+
+#define KOBUKI_PATH_MAX_WAYPOINTS 128
+
+/* A point in the odometry frame (see kobukiOdometry.h), in m. */
+typedef struct {
+    double x;
+    double y;
+} KobukiWaypoint_t;
+
+typedef enum {
+    KOBUKI_PATH_IDLE,       // no path started or it was cancelled
+    KOBUKI_PATH_RUNNING,
+    KOBUKI_PATH_DONE,       // stopped at the last waypoint
+    KOBUKI_PATH_TIMEOUT     // gave up, e.g. the robot is stuck or sends no packets; the wheels are stopped
+} KobukiPathStatus_t;
+
+/* Starts following the waypoints, beginning from wherever the robot is.
+   At most KOBUKI_PATH_MAX_WAYPOINTS are used. Replaces a path that is still running.
+   Returns false if there are no waypoints. Does not block. */
+bool kobukiPathStart(const KobukiWaypoint_t * waypoints, int count);
+
+/* Sends the drive command for the path, from the odometry pose of the latest parsed packet.
+   Call once per control loop pass after polling the sensors, until it stops returning
+   KOBUKI_PATH_RUNNING. */
+KobukiPathStatus_t kobukiPathUpdate(void);
+
+/* Stops a running path. */
+void kobukiPathCancel(void);
+
+/* Distance left to the end of the path in m. */
+double kobukiPathRemaining(void);
+
+#endif
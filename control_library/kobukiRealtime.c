@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include "kobukiRealtime.h"
+#include "kobukiStats.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define PREFAULT_STACK (256 * 1024)
+#define PREFAULT_HEAP (4 * 1024 * 1024)
+
+static int env_int(const char* name, int fallback) {
+	const char* value = getenv(name);
+	return (value && *value) ? atoi(value) : fallback;
+}
+
+void kobukiRealtimeConfigFromEnv(KobukiRealtimeConfig_t * config) {
+	config->enabled = env_int("KOBUKI_RT", 0) != 0;
+	config->priority = env_int("KOBUKI_RT_PRIORITY", 0);
+	config->cpu = env_int("KOBUKI_RT_CPU", -1);
+	config->lockMemory = env_int("KOBUKI_RT_NOLOCK", 0) == 0;
+}
+
+/* Touches the stack the loop will use, so it is mapped (and locked) now. */
+static void __attribute__((noinline)) prefault_stack(void) {
+	uint8_t stack[PREFAULT_STACK];
+	memset(stack, 0, sizeof(stack));
+	// keep the compiler from dropping the memset
+	__asm__ volatile("" : : "r"(stack) : "memory");
+}
+
+static bool lock_memory(void) {
+	// keep freed memory in the heap and never hand out fresh mmaps, so malloc stays in locked pages
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		fprintf(stderr, "ERROR - cannot lock memory\n\t%s\n", strerror(errno));
+		return false;
+	}
+
+	prefault_stack();
+
+	uint8_t* heap = malloc(PREFAULT_HEAP);
+	if (heap) {
+		memset(heap, 0, PREFAULT_HEAP);
+		free(heap);
+	}
+
+	return true;
+}
+
+bool kobukiRealtimeEnter(const KobukiRealtimeConfig_t * config) {
+	bool ok = true;
+
+	if (!config->enabled) {
+		return true;
+	}
+
+	if (config->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(config->cpu, &cpus);
+		// this thread only, the sensor reader is not held up by the loop on the same core
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+			fprintf(stderr, "ERROR - cannot pin to cpu %d\n\t%s\n", config->cpu, strerror(errno));
+			ok = false;
+		}
+	}
+
+	if (config->lockMemory && !lock_memory()) {
+		ok = false;
+	}
+
+	if (config->priority > 0) {
+		struct sched_param param = { .sched_priority = config->priority };
+		int status = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (status != 0) {
+			fprintf(stderr, "ERROR - cannot switch to SCHED_FIFO priority %d\n\t%s\n", config->priority, strerror(status));
+			ok = false;
+		}
+	}
+
+	// on stderr, like the errors above, so apps printing results on stdout (kobuki_bench) keep them clean
+	fprintf(stderr, "Real-time mode: priority %d, cpu %d, memory %slocked\n", config->priority, config->cpu,
+			config->lockMemory ? "" : "not ");
+	return ok;
+}
+
+bool kobukiTickerStart(KobukiTicker_t * ticker, uint32_t periodUs) {
+	memset(ticker, 0, sizeof(KobukiTicker_t));
+	ticker->periodNs = (uint64_t) periodUs * 1000;
+
+	ticker->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ticker->fd == -1) {
+		printf("ERROR - cannot create tick timer\n\t%s\n", strerror(errno));
+		return false;
+	}
+
+	// kobukiStatsNowNs reads CLOCK_MONOTONIC too, so deadlines and wakeups compare directly
+	ticker->startNs = kobukiStatsNowNs();
+	uint64_t first = ticker->startNs + ticker->periodNs;
+
+	struct itimerspec timeout = {0};
+	timeout.it_value.tv_sec = first / 1000000000;
+	timeout.it_value.tv_nsec = first % 1000000000;
+	timeout.it_interval.tv_sec = ticker->periodNs / 1000000000;
+	timeout.it_interval.tv_nsec = ticker->periodNs % 1000000000;
+
+	if (timerfd_settime(ticker->fd, TFD_TIMER_ABSTIME, &timeout, NULL) == -1) {
+		printf("ERROR - cannot start tick timer\n\t%s\n", strerror(errno));
+		close(ticker->fd);
+		ticker->fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+int kobukiTickerAcknowledge(KobukiTicker_t * ticker) {
+	uint64_t expirations;
+
+	if (read(ticker->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+		return (errno == EAGAIN) ? 0 : -1;
+	}
+
+	uint64_t now = kobukiStatsNowNs();
+	ticker->ticks += expirations;
+	ticker->wakeups++;
+	ticker->overruns += expirations - 1;
+
+	// how late we are for the latest deadline
+	int64_t jitter = (int64_t) (now - (ticker->startNs + ticker->ticks * ticker->periodNs));
+	if (ticker->wakeups == 1 || jitter < ticker->jitterMinNs) {
+		ticker->jitterMinNs = jitter;
+	}
+	if (ticker->wakeups == 1 || jitter > ticker->jitterMaxNs) {
+		ticker->jitterMaxNs = jitter;
+	}
+	ticker->jitterSumNs += jitter;
+	ticker->jitterSumSquaresNs += (double) jitter * jitter;
+
+	kobukiStatsRecord(KOBUKI_STAGE_WAKEUP, jitter > 0 ? jitter : 0);
+	for (uint64_t i = 1; i < expirations; i++) {
+		kobukiStatsCount(KOBUKI_COUNTER_MISSED_TICKS);
+	}
+
+	return expirations;
+}
+
+int kobukiTickerWait(KobukiTicker_t * ticker) {
+	struct pollfd poll_fd = { .fd = ticker->fd, .events = POLLIN };
+	int status;
+
+	do {
+		status = poll(&poll_fd, 1, -1);
+		if (status == -1 && errno != EINTR) {
+			return -1;
+		}
+	} while (status <= 0 || (status = kobukiTickerAcknowledge(ticker)) == 0);
+
+	return status;
+}
+
+void kobukiTickerPrint(const KobukiTicker_t * ticker) {
+	if (ticker->wakeups == 0) {
+		return;
+	}
+
+	double mean = ticker->jitterSumNs / ticker->wakeups;
+	double variance = ticker->jitterSumSquaresNs / ticker->wakeups - mean * mean;
+
+	printf("Ticks: %lu every %.1fms, overruns: %lu, jitter us: min %.1f mean %.1f max %.1f stddev %.1f\n",
+			(unsigned long) ticker->ticks, ticker->periodNs / 1e6, (unsigned long) ticker->overruns,
+			ticker->jitterMinNs / 1000.0, mean / 1000.0, ticker->jitterMaxNs / 1000.0,
+			sqrt(variance > 0 ? variance : 0) / 1000.0);
+}
+
+void kobukiTickerStop(KobukiTicker_t * ticker) {
+	if (ticker->fd != -1) {
+		close(ticker->fd);
+		ticker->fd = -1;
+	}
+}
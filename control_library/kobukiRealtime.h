@@ -0,0 +1,65 @@
+#ifndef _KOBUKIREALTIME_H
+#define _KOBUKIREALTIME_H
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Opt-in real-time mode for control loops: a fixed rate tick from an absolute deadline timer,
+   the loop thread on SCHED_FIFO and pinned to a core, memory locked and prefaulted.
+
+   Configured from the environment so every app takes the same settings:
+     KOBUKI_RT=1             turns it on
+     KOBUKI_RT_PRIORITY=n    SCHED_FIFO priority 1-99, 0 (default) keeps the normal scheduler
+     KOBUKI_RT_CPU=n         core to run the loop thread on, default any
+     KOBUKI_RT_NOLOCK=1      do not lock memory
+   SCHED_FIFO and locking memory need root or CAP_SYS_NICE / CAP_IPC_LOCK. */
+
+typedef struct {
+    bool enabled;
+    int priority;
+    int cpu;          // -1 for any
+    bool lockMemory;
+} KobukiRealtimeConfig_t;
+
+/* Fills in the configuration from the KOBUKI_RT* environment variables. */
+void kobukiRealtimeConfigFromEnv(KobukiRealtimeConfig_t * config);
+
+/* Pins the calling thread and switches it to SCHED_FIFO, and locks and prefaults the process's
+   memory so the heap and stack never page fault or go back to the kernel. Threads started
+   later inherit the pinning and the scheduler, threads already running (e.g. the sensor reader)
+   keep theirs. Call once at startup, after the threads that should not inherit it are started.
+   Reports what it did and what failed on stderr.
+   Returns false if any part failed; the rest is still applied. */
+bool kobukiRealtimeEnter(const KobukiRealtimeConfig_t * config);
+
+/* Fixed rate tick: deadlines are start + n * period on CLOCK_MONOTONIC, so the rate does not
+   drift with how long each pass takes. */
+typedef struct {
+    int fd;                 // readable when a tick is due, for epoll
+    uint64_t periodNs;
+    uint64_t startNs;
+    uint64_t ticks;         // deadlines passed
+    uint64_t wakeups;
+    uint64_t overruns;      // deadlines missed because the previous pass was too slow
+    int64_t jitterMinNs;    // wakeup time minus deadline
+    int64_t jitterMaxNs;
+    double jitterSumNs;
+    double jitterSumSquaresNs;
+} KobukiTicker_t;
+
+/* Starts ticking every periodUs. Returns false on error. */
+bool kobukiTickerStart(KobukiTicker_t * ticker, uint32_t periodUs);
+
+/* Blocks until the next deadline. Returns the number of deadlines passed since the last call,
+   more than 1 after an overrun, or < 0 on error. */
+int kobukiTickerWait(KobukiTicker_t * ticker);
+
+/* Same as kobukiTickerWait once the fd is known to be readable, e.g. from epoll.
+   Returns 0 if no deadline has passed after all. */
+int kobukiTickerAcknowledge(KobukiTicker_t * ticker);
+
+/* Prints the tick count, overruns and jitter. */
+void kobukiTickerPrint(const KobukiTicker_t * ticker);
+
+void kobukiTickerStop(KobukiTicker_t * ticker);
+
+#endif
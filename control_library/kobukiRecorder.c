@@ -0,0 +1,257 @@
+#include "kobukiRecorder.h"
+#include "kobukiClock.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+	int fd;
+	uint8_t* map;
+	size_t map_size;
+	KobukiRecordFileHeader_t* header;
+	uint8_t* ring;
+	uint64_t capacity;
+} recorder_t;
+
+static recorder_t recorder = { .fd = -1 };
+// uncontended almost always, so taking it stays in user space
+static pthread_mutex_t recorder_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t padded(uint32_t length) {
+	return (length + 3) & ~3u;
+}
+
+/* Bytes from position to the end of the ring. */
+static uint64_t room_to_end(uint64_t position) {
+	return recorder.capacity - position % recorder.capacity;
+}
+
+/* Drops the oldest records until there are needed free bytes in front of head. */
+static void make_room(uint64_t head, uint64_t needed) {
+	KobukiRecordFileHeader_t* header = recorder.header;
+	uint64_t tail = header->tail;
+
+	while (head + needed - tail > recorder.capacity) {
+		uint64_t rest = room_to_end(tail);
+
+		if (rest < KOBUKI_RECORD_HEADER_SIZE) {
+			tail += rest;
+			continue;
+		}
+
+		uint16_t length;
+		memcpy(&length, recorder.ring + tail % recorder.capacity + 8, 2);
+		tail += KOBUKI_RECORD_HEADER_SIZE + padded(length);
+	}
+
+	__atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+}
+
+static void write_record(uint64_t position, KobukiRecordType_t type, const void* data, uint16_t length, uint64_t hostUs) {
+	uint8_t* record = recorder.ring + position % recorder.capacity;
+
+	memcpy(record, &hostUs, 8);
+	memcpy(record + 8, &length, 2);
+	record[10] = type;
+	record[11] = 0;
+	if (data) {
+		memcpy(record + KOBUKI_RECORD_HEADER_SIZE, data, length);
+	}
+}
+
+void kobukiRecordAt(KobukiRecordType_t type, const void * data, uint16_t length, uint64_t hostUs) {
+	if (!recorder.header) {
+		return;
+	}
+
+	pthread_mutex_lock(&recorder_lock);
+
+	KobukiRecordFileHeader_t* header = recorder.header;
+	uint64_t head = header->head;
+	uint64_t size = KOBUKI_RECORD_HEADER_SIZE + padded(length);
+
+	if (size > recorder.capacity / 2) {
+		pthread_mutex_unlock(&recorder_lock);
+		return;
+	}
+
+	// records do not wrap: pad out the end of the ring first
+	uint64_t rest = room_to_end(head);
+	if (rest < size) {
+		make_room(head, rest);
+		if (rest >= KOBUKI_RECORD_HEADER_SIZE) {
+			write_record(head, KOBUKI_RECORD_PAD, NULL, rest - KOBUKI_RECORD_HEADER_SIZE, hostUs);
+		}
+		head += rest;
+	}
+
+	make_room(head, size);
+	write_record(head, type, data, length, hostUs);
+
+	header->records++;
+	__atomic_store_n(&header->head, head + size, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&recorder_lock);
+}
+
+void kobukiRecord(KobukiRecordType_t type, const void * data, uint16_t length) {
+	if (!recorder.header) {
+		return;
+	}
+	kobukiRecordAt(type, data, length, kobukiClockNowUs());
+}
+
+bool kobukiRecorderOpen(const char * path, uint32_t size) {
+	kobukiRecorderClose();
+
+	// the last run's recording is often the one that matters, keep it as path.1
+	char previous[PATH_MAX];
+	snprintf(previous, sizeof(previous), "%s.1", path);
+	if (rename(path, previous) == -1 && errno != ENOENT) {
+		printf("ERROR - cannot keep the previous recording as %s\n\t%s\n", previous, strerror(errno));
+		return false;
+	}
+
+	size_t map_size = sizeof(KobukiRecordFileHeader_t) + padded(size);
+	int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+
+	if (fd == -1) {
+		printf("ERROR - cannot create recorder file %s\n\t%s\n", path, strerror(errno));
+		return false;
+	}
+
+	// allocate the blocks now, so a full disk shows up here and not as a crash while recording
+	int status = posix_fallocate(fd, 0, map_size);
+	if (status != 0) {
+		printf("ERROR - cannot allocate recorder file %s\n\t%s\n", path, strerror(status));
+		close(fd);
+		return false;
+	}
+
+	// populate up front so recording never waits for a page fault
+	uint8_t* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (map == MAP_FAILED) {
+		printf("ERROR - cannot map recorder file %s\n\t%s\n", path, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	KobukiRecordFileHeader_t* header = (KobukiRecordFileHeader_t*) map;
+	memset(header, 0, sizeof(KobukiRecordFileHeader_t));
+	memcpy(header->magic, KOBUKI_RECORD_MAGIC, sizeof(header->magic));
+	header->version = KOBUKI_RECORD_VERSION;
+	header->headerSize = sizeof(KobukiRecordFileHeader_t);
+	header->capacity = padded(size);
+
+	pthread_mutex_lock(&recorder_lock);
+	recorder.fd = fd;
+	recorder.map = map;
+	recorder.map_size = map_size;
+	recorder.ring = map + sizeof(KobukiRecordFileHeader_t);
+	recorder.capacity = header->capacity;
+	recorder.header = header;
+	pthread_mutex_unlock(&recorder_lock);
+
+	return true;
+}
+
+void kobukiRecorderClose(void) {
+	pthread_mutex_lock(&recorder_lock);
+
+	if (recorder.header) {
+		msync(recorder.map, recorder.map_size, MS_SYNC);
+		munmap(recorder.map, recorder.map_size);
+		close(recorder.fd);
+	}
+	recorder.header = NULL;
+	recorder.map = NULL;
+	recorder.fd = -1;
+
+	pthread_mutex_unlock(&recorder_lock);
+}
+
+bool kobukiRecordingOpen(KobukiRecording_t * recording, const char * path) {
+	memset(recording, 0, sizeof(KobukiRecording_t));
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		printf("ERROR - cannot open recording %s\n\t%s\n", path, strerror(errno));
+		return false;
+	}
+
+	struct stat info;
+	KobukiRecordFileHeader_t* header = NULL;
+	void* map = MAP_FAILED;
+
+	if (fstat(fd, &info) == 0 && (size_t) info.st_size >= sizeof(KobukiRecordFileHeader_t)) {
+		map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+
+	if (map != MAP_FAILED) {
+		header = (KobukiRecordFileHeader_t*) map;
+	}
+	if (!header || memcmp(header->magic, KOBUKI_RECORD_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version != KOBUKI_RECORD_VERSION ||
+			header->headerSize + header->capacity > (uint64_t) info.st_size) {
+		printf("ERROR - %s is not a flight recorder file\n", path);
+		if (map != MAP_FAILED) {
+			munmap(map, info.st_size);
+		}
+		return false;
+	}
+
+	memcpy(&recording->header, header, sizeof(KobukiRecordFileHeader_t));
+	recording->map = map;
+	recording->mapSize = info.st_size;
+	recording->ring = (const uint8_t*) map + header->headerSize;
+	recording->position = header->tail;
+	return true;
+}
+
+bool kobukiRecordingNext(KobukiRecording_t * recording, KobukiRecord_t * record) {
+	uint64_t capacity = recording->header.capacity;
+
+	while (recording->position < recording->header.head) {
+		uint64_t offset = recording->position % capacity;
+
+		if (capacity - offset < KOBUKI_RECORD_HEADER_SIZE) {
+			recording->position += capacity - offset;
+			continue;
+		}
+
+		const uint8_t* data = recording->ring + offset;
+		memcpy(&record->hostUs, data, 8);
+		memcpy(&record->length, data + 8, 2);
+		record->type = data[10];
+		record->data = data + KOBUKI_RECORD_HEADER_SIZE;
+
+		// records never wrap, one that would was torn, e.g. by a power loss
+		if (KOBUKI_RECORD_HEADER_SIZE + (uint64_t) record->length > capacity - offset) {
+			printf("ERROR - recording is damaged at byte %lu of the ring, stopping there\n", (unsigned long) recording->position);
+			recording->position = recording->header.head;
+			return false;
+		}
+		recording->position += KOBUKI_RECORD_HEADER_SIZE + padded(record->length);
+
+		if (record->type != KOBUKI_RECORD_PAD) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void kobukiRecordingClose(KobukiRecording_t * recording) {
+	if (recording->map) {
+		munmap(recording->map, recording->mapSize);
+	}
+	memset(recording, 0, sizeof(KobukiRecording_t));
+}
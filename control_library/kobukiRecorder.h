@@ -0,0 +1,89 @@
+#ifndef _KOBUKIRECORDER_H
+#define _KOBUKIRECORDER_H
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Flight recorder: keeps the last few MB of everything that went over the uart and the
+   instruction socket in a file, to look at after a run went wrong.
+
+   The file is allocated once and memory mapped, so recording is a memcpy into the page cache:
+   no system calls and no allocation per record. The kernel writes it back in the background,
+   and it survives the process crashing.
+
+   File layout, all little endian:
+     KobukiRecordFileHeader_t
+     ring of capacity bytes holding records, oldest at tail % capacity, next one at head % capacity
+   Record:
+     uint64 hostUs   when it happened, CLOCK_MONOTONIC in us (kobukiClockNowUs)
+     uint16 length   bytes of data
+     uint8  type     KobukiRecordType_t
+     uint8  reserved
+     data, padded to a multiple of 4 bytes
+   A record never wraps around the end of the ring. If it does not fit, the rest of the ring is
+   filled with a KOBUKI_RECORD_PAD record, or skipped if even that does not fit. */
+
+#define KOBUKI_RECORD_MAGIC "KOBUKREC"
+#define KOBUKI_RECORD_VERSION 1
+#define KOBUKI_RECORD_HEADER_SIZE 12
+#define KOBUKI_RECORD_DEFAULT_SIZE (8 * 1024 * 1024)
+
+typedef enum {
+    KOBUKI_RECORD_PAD = 0,        // filler up to the end of the ring
+    KOBUKI_RECORD_RX_FRAME = 1,   // complete frame from the robot, header to checksum
+    KOBUKI_RECORD_TX_FRAME = 2,   // frame of commands sent to the robot, header to checksum
+    KOBUKI_RECORD_DETECTION = 3,  // detection message from the instruction socket
+    KOBUKI_RECORD_ROUTE = 4,      // return route, (angle, distance) float pairs
+    KOBUKI_RECORD_MARK = 5        // free text, e.g. state changes
+} KobukiRecordType_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize; // offset of the ring in the file
+    uint64_t capacity;   // bytes in the ring
+    uint64_t head;       // bytes ever written to the ring
+    uint64_t tail;       // position of the oldest record that is still complete, in the same count
+    uint64_t records;    // records ever written
+} KobukiRecordFileHeader_t;
+
+/* A recording opened for reading, see kobukiRecordingOpen. */
+typedef struct {
+    KobukiRecordFileHeader_t header;
+    const uint8_t* ring;
+    void* map;
+    uint64_t mapSize;
+    uint64_t position; // next record to read, counted like header.head
+} KobukiRecording_t;
+
+/* One record of a recording. data points into the recording and is valid until it is closed. */
+typedef struct {
+    uint64_t hostUs;
+    KobukiRecordType_t type;
+    uint16_t length;
+    const uint8_t* data;
+} KobukiRecord_t;
+
+/* Creates the recorder file with room for size bytes of records and starts recording.
+   An existing file is kept as path.1, replacing the one before it.
+   Returns false on error, in which case nothing is recorded. */
+bool kobukiRecorderOpen(const char * path, uint32_t size);
+
+/* Stops recording and flushes the file. */
+void kobukiRecorderClose(void);
+
+/* Appends a record stamped with the current host time. Does nothing if the recorder is not open.
+   Safe to call from the sensor reader thread and the control loop at the same time. */
+void kobukiRecord(KobukiRecordType_t type, const void * data, uint16_t length);
+
+/* Same with a given host time, e.g. when the frame arrived rather than when it was parsed. */
+void kobukiRecordAt(KobukiRecordType_t type, const void * data, uint16_t length, uint64_t hostUs);
+
+/* Opens a recorder file for reading, positioned at its oldest record. Returns false on error. */
+bool kobukiRecordingOpen(KobukiRecording_t * recording, const char * path);
+
+/* Reads the next record, oldest first, skipping padding. Returns false at the end, or at a damaged record. */
+bool kobukiRecordingNext(KobukiRecording_t * recording, KobukiRecord_t * record);
+
+void kobukiRecordingClose(KobukiRecording_t * recording);
+
+#endif
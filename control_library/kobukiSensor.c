@@ -13,19 +13,48 @@ static uint16_t to_uint16( uint8_t d1, uint16_t d2){
     return ( (uint16_t) d2 << 8) | d1 ;
 }
 
+/* Stores value in field, converted to the field's type, and records a change in the changed mask. */
+#define SET_FIELD(field, value, flag) do { \
+		__typeof__(field) _value = (value); \
+		if ((field) != _value) { \
+			(field) = _value; \
+			changed |= (flag); \
+		} \
+	} while (0)
+
 void kobukiParseSensorPacket(const uint8_t * packet, KobukiSensors_t * sensors) {
+	kobukiParseSensorPacketMasked(packet, sensors, KOBUKI_SENSOR_ALL);
+}
 
+uint32_t kobukiParseSensorPacketMasked(const uint8_t * packet, KobukiSensors_t * sensors, uint32_t mask) {
+
+	// The frame decoder has checked that all payloadLength bytes (and the checksum) are there,
+	// every sub-payload is checked against that before any of its bytes are read.
 	uint8_t payloadLength = packet[2];
-	uint8_t i = 3;
+	uint16_t end = payloadLength + 3;
+	uint16_t i = 3;
 	uint8_t subPayloadLength = 0;
+	uint32_t decoded = 0;
+	uint32_t changed = 0;
 
 
-	while( i < payloadLength + 3) {
+	while( i + 2 <= end) {
 
 		uint8_t idField = packet[i];
 
 		subPayloadLength = packet[i+1];
 
+		if (i + 2 + subPayloadLength > end) {
+			// truncated sub-payload, nothing after it can be trusted either
+			break;
+		}
+
+		if (idField >= 32 || !(mask & KOBUKI_SENSOR_ID(idField))) {
+			// not subscribed, skip it by its length
+			i += subPayloadLength + 2;
+			continue;
+		}
+
 		switch(idField) {
 			case 0x01 :
 				//There's an ambiguity in the documentation where
@@ -35,179 +64,245 @@ void kobukiParseSensorPacket(const uint8_t * packet, KobukiSensors_t * sensors)
 				// so we'll just check here to make sure it's the right length
 
 				if( subPayloadLength == 0x0F){
+					decoded |= KOBUKI_SENSOR_ID(idField);
 					sensors->timeStamp = to_uint16( packet[i+2], packet[i+3]);
 
 
-					sensors->bumps_wheelDrops.bumpRight		=	packet[i+4] & 0x01;
-					sensors->bumps_wheelDrops.bumpCenter	=	(packet[i+4] & 0x02);
-					sensors->bumps_wheelDrops.bumpLeft		=	(packet[i+4] & 0x04);
+					SET_FIELD(sensors->bumps_wheelDrops.bumpRight,	packet[i+4] & 0x01, KOBUKI_CHANGED_BUMPS);
+					SET_FIELD(sensors->bumps_wheelDrops.bumpCenter,	packet[i+4] & 0x02, KOBUKI_CHANGED_BUMPS);
+					SET_FIELD(sensors->bumps_wheelDrops.bumpLeft,	packet[i+4] & 0x04, KOBUKI_CHANGED_BUMPS);
 
-					sensors->bumps_wheelDrops.wheeldropRight	= packet[i+5] & 0x01;
-					sensors->bumps_wheelDrops.wheeldropLeft		=(packet[i+5] & 0x02);
+					SET_FIELD(sensors->bumps_wheelDrops.wheeldropRight,	packet[i+5] & 0x01, KOBUKI_CHANGED_WHEEL_DROPS);
+					SET_FIELD(sensors->bumps_wheelDrops.wheeldropLeft,	packet[i+5] & 0x02, KOBUKI_CHANGED_WHEEL_DROPS);
 
-					sensors->cliffRight		=	(packet[i+6] & 0x01);
-					sensors->cliffCenter	=	(packet[i+6] & 0x02);
-					sensors->cliffLeft		=	(packet[i+6] & 0x04);
+					SET_FIELD(sensors->cliffRight,	packet[i+6] & 0x01, KOBUKI_CHANGED_CLIFFS);
+					SET_FIELD(sensors->cliffCenter,	packet[i+6] & 0x02, KOBUKI_CHANGED_CLIFFS);
+					SET_FIELD(sensors->cliffLeft,	packet[i+6] & 0x04, KOBUKI_CHANGED_CLIFFS);
 
-					sensors->leftWheelEncoder	= to_uint16(packet[i+7], packet[i+8]);
-					sensors->rightWheelEncoder = to_uint16(packet[i+9], packet[i+10]);
+					SET_FIELD(sensors->leftWheelEncoder,	to_uint16(packet[i+7], packet[i+8]), KOBUKI_CHANGED_ENCODERS);
+					SET_FIELD(sensors->rightWheelEncoder,	to_uint16(packet[i+9], packet[i+10]), KOBUKI_CHANGED_ENCODERS);
 
-					sensors->leftWheelPWM		=	(int8_t) packet[i+11];
-					sensors->rightWheelPWM 		=	(int8_t) packet[i+12];
-					sensors->buttons.B0		=	(bool)(packet[i+13] & 0x01);
-					sensors->buttons.B1		=	(bool)(packet[i+13] & 0x02);
-					sensors->buttons.B2		=	(bool)(packet[i+13] & 0x04);
+					SET_FIELD(sensors->leftWheelPWM,	(int8_t) packet[i+11], KOBUKI_CHANGED_PWM);
+					SET_FIELD(sensors->rightWheelPWM,	(int8_t) packet[i+12], KOBUKI_CHANGED_PWM);
+					SET_FIELD(sensors->buttons.B0,	packet[i+13] & 0x01, KOBUKI_CHANGED_BUTTONS);
+					SET_FIELD(sensors->buttons.B1,	packet[i+13] & 0x02, KOBUKI_CHANGED_BUTTONS);
+					SET_FIELD(sensors->buttons.B2,	packet[i+13] & 0x04, KOBUKI_CHANGED_BUTTONS);
 
 					// Charger state
 					switch(packet[i+14]){
 						case 0:
-							sensors->chargingState = DISCHARGING;
+							SET_FIELD(sensors->chargingState, DISCHARGING, KOBUKI_CHANGED_CHARGER);
 							break;
 						case 2:
-							sensors->chargingState =  DOCKING_CHARGED;
+							SET_FIELD(sensors->chargingState, DOCKING_CHARGED, KOBUKI_CHANGED_CHARGER);
 							break;
 						case 6:
-							sensors->chargingState =  DOCKING_CHARGING;
+							SET_FIELD(sensors->chargingState, DOCKING_CHARGING, KOBUKI_CHANGED_CHARGER);
 							break;
 						case 18:
-							sensors->chargingState =  ADAPTER_CHARGED;
+							SET_FIELD(sensors->chargingState, ADAPTER_CHARGED, KOBUKI_CHANGED_CHARGER);
 							break;
 						case 22:
-							sensors->chargingState =  ADAPTER_CHARGING;
+							SET_FIELD(sensors->chargingState, ADAPTER_CHARGING, KOBUKI_CHANGED_CHARGER);
 							break;
 					}
 
-					sensors->batteryVoltage = packet[i+15];
+					SET_FIELD(sensors->batteryVoltage, packet[i+15], KOBUKI_CHANGED_BATTERY);
 
-					sensors->leftWheelOverCurrent = packet[i+16] & 0x01;
-					sensors->rightWheelOverCurrent = packet[i+16] & 0x02;
+					SET_FIELD(sensors->leftWheelOverCurrent, packet[i+16] & 0x01, KOBUKI_CHANGED_OVER_CURRENT);
+					SET_FIELD(sensors->rightWheelOverCurrent, packet[i+16] & 0x02, KOBUKI_CHANGED_OVER_CURRENT);
 
-					i += subPayloadLength + 2; // + 2 for header and length
-				} else {
-					i += payloadLength + 3; // add enough to terminate the outer while loop
 				}
 
 				break;
 
 			case 0x03 :
 				if (subPayloadLength == 0x03){
-                    sensors->docking.dockingRight = packet[i+2];
-                    sensors->docking.dockingCenter = packet[i+3];
-                    sensors->docking.dockingLeft = packet[i+4];
-					i += subPayloadLength + 2; // + 2 for header and length
-				} else {
-					i += payloadLength + 3; // add enough to terminate the outer while loop
+                    decoded |= KOBUKI_SENSOR_ID(idField);
+                    SET_FIELD(sensors->docking.dockingRight, packet[i+2], KOBUKI_CHANGED_DOCKING);
+                    SET_FIELD(sensors->docking.dockingCenter, packet[i+3], KOBUKI_CHANGED_DOCKING);
+                    SET_FIELD(sensors->docking.dockingLeft, packet[i+4], KOBUKI_CHANGED_DOCKING);
 				}
 
 				break;
 
 			case 0x04 : // inertial sensor data
 				if (subPayloadLength == 0x07){
-                    sensors->angle = to_uint16(packet[i+2], packet[i+3]);
-                    sensors->angleRate = to_uint16(packet[i+4], packet[i+5]);
-					i += subPayloadLength + 2; // + 2 for header and length
-				} else {
-					i += payloadLength + 3; // add enough to terminate the outer while loop
+                    decoded |= KOBUKI_SENSOR_ID(idField);
+                    SET_FIELD(sensors->angle, to_uint16(packet[i+2], packet[i+3]), KOBUKI_CHANGED_INERTIAL);
+                    SET_FIELD(sensors->angleRate, to_uint16(packet[i+4], packet[i+5]), KOBUKI_CHANGED_INERTIAL);
 				}
 				break;
 
 			case 0x05 : // cliff sensor data
 				if (subPayloadLength == 0x06){
-					sensors->cliffRightSignal=to_uint16(packet[i+2],packet[i+3]);
-					sensors->cliffCenterSignal=to_uint16(packet[i+4],packet[i+5]);
-					sensors->cliffLeftSignal=to_uint16(packet[i+6],packet[i+7]);
-					i += subPayloadLength + 2; // + 2 for header and length
-				} else {
-					i += payloadLength + 3; // add enough to terminate the outer while loop
+					decoded |= KOBUKI_SENSOR_ID(idField);
+					SET_FIELD(sensors->cliffRightSignal, to_uint16(packet[i+2],packet[i+3]), KOBUKI_CHANGED_CLIFF_SIGNALS);
+					SET_FIELD(sensors->cliffCenterSignal, to_uint16(packet[i+4],packet[i+5]), KOBUKI_CHANGED_CLIFF_SIGNALS);
+					SET_FIELD(sensors->cliffLeftSignal, to_uint16(packet[i+6],packet[i+7]), KOBUKI_CHANGED_CLIFF_SIGNALS);
 				}
 				break;
 
 			case 0x06 :
 				if (subPayloadLength == 0x02){
-                    sensors->leftWheelCurrent = to_uint16(packet[i+2], packet[i+3]);
-                    sensors->rightWheelCurrent = to_uint16(packet[i+4], packet[i+5]);
-					i += subPayloadLength + 2; // + 2 for header and length
-				} else {
-					i += payloadLength + 3; // add enough to terminate the outer while loop
+                    decoded |= KOBUKI_SENSOR_ID(idField);
+                    // one byte per motor - reading two would run past the sub-payload
+                    SET_FIELD(sensors->leftWheelCurrent, packet[i+2], KOBUKI_CHANGED_CURRENT);
+                    SET_FIELD(sensors->rightWheelCurrent, packet[i+3], KOBUKI_CHANGED_CURRENT);
 				}
 				break;
 
 			case 0x0A :
 				if (subPayloadLength == 0x04){
-                    sensors->hardwareVersion.patch = packet[i+2];
-                    sensors->hardwareVersion.minor = packet[i+3];
-                    sensors->hardwareVersion.major = packet[i+4];
-					i += subPayloadLength + 2; // + 2 for header and length
-				} else {
-					i += payloadLength + 3; // add enough to terminate the outer while loop
+                    decoded |= KOBUKI_SENSOR_ID(idField);
+                    SET_FIELD(sensors->hardwareVersion.patch, packet[i+2], KOBUKI_CHANGED_VERSIONS);
+                    SET_FIELD(sensors->hardwareVersion.minor, packet[i+3], KOBUKI_CHANGED_VERSIONS);
+                    SET_FIELD(sensors->hardwareVersion.major, packet[i+4], KOBUKI_CHANGED_VERSIONS);
 				}
 				break;
 
 			case 0x0B : // Firmware Version
 				if (subPayloadLength == 0x04){
-                    sensors->firmwareVersion.patch = packet[i+2];
-                    sensors->firmwareVersion.minor = packet[i+3];
-                    sensors->firmwareVersion.major = packet[i+4];
-					i += subPayloadLength + 2; // + 2 for header and length
-				} else {
-					i += payloadLength + 3; // add enough to terminate the outer while loop
+                    decoded |= KOBUKI_SENSOR_ID(idField);
+                    SET_FIELD(sensors->firmwareVersion.patch, packet[i+2], KOBUKI_CHANGED_VERSIONS);
+                    SET_FIELD(sensors->firmwareVersion.minor, packet[i+3], KOBUKI_CHANGED_VERSIONS);
+                    SET_FIELD(sensors->firmwareVersion.major, packet[i+4], KOBUKI_CHANGED_VERSIONS);
 				}
 				break;
 
 			case 0x0D : // Raw 3d Gyro DAta
-				if (subPayloadLength % 6 == 2){ // variable length packet. See documentation
-                    sensors->xAxisRate = to_uint16(packet[i+5], packet[i+6]);
-                    sensors->yAxisRate = to_uint16(packet[i+7], packet[i+8]);
-                    sensors->zAxisRate = to_uint16(packet[i+9], packet[i+10]);
-					i += subPayloadLength + 2; // + 2 for header and length
-				} else {
-					i += payloadLength + 3; // add enough to terminate the outer while loop
+				if (subPayloadLength % 6 == 2 && subPayloadLength >= 8){ // variable length packet. See documentation
+                    decoded |= KOBUKI_SENSOR_ID(idField);
+                    // frame id of the first sample and data length come first, then x/y/z samples
+                    SET_FIELD(sensors->xAxisRate, to_uint16(packet[i+4], packet[i+5]), KOBUKI_CHANGED_GYRO);
+                    SET_FIELD(sensors->yAxisRate, to_uint16(packet[i+6], packet[i+7]), KOBUKI_CHANGED_GYRO);
+                    SET_FIELD(sensors->zAxisRate, to_uint16(packet[i+8], packet[i+9]), KOBUKI_CHANGED_GYRO);
+
+                    KobukiGyroBatch_t* gyro = &sensors->gyro;
+                    uint8_t numSamples = (subPayloadLength - 2) / 6;
+                    gyro->truncated = numSamples > KOBUKI_GYRO_MAX_SAMPLES;
+                    if (gyro->truncated) {
+                        numSamples = KOBUKI_GYRO_MAX_SAMPLES;
+                    }
+                    gyro->numSamples = numSamples;
+
+                    // every packet with new samples has a new frame id
+                    SET_FIELD(gyro->samples[0].frameId, packet[i+2], KOBUKI_CHANGED_GYRO);
+                    for (uint8_t k = 0; k < numSamples; k++) {
+                        const uint8_t* sample = &packet[i+4 + 6*k];
+                        gyro->samples[k].frameId = packet[i+2] + k;
+                        gyro->samples[k].x = (int16_t) to_uint16(sample[0], sample[1]);
+                        gyro->samples[k].y = (int16_t) to_uint16(sample[2], sample[3]);
+                        gyro->samples[k].z = (int16_t) to_uint16(sample[4], sample[5]);
+                    }
 				}
 				break;
 
 			case 0x10 : //General purpose input
 				if (subPayloadLength == 0x10){
-                    sensors->generalInput.D0 = packet[i+2] & 0x01;
-                    sensors->generalInput.D0 = packet[i+2] & 0x02;
-                    sensors->generalInput.D0 = packet[i+2] & 0x04;
-                    sensors->generalInput.D0 = packet[i+2] & 0x08;
-                    sensors->generalInput.A0 = to_uint16(packet[i+4], packet[i+5]);
-                    sensors->generalInput.A1 = to_uint16(packet[i+6], packet[i+7]);
-                    sensors->generalInput.A2 = to_uint16(packet[i+8], packet[i+9]);
-                    sensors->generalInput.A3 = to_uint16(packet[i+10], packet[i+11]);
-					i += subPayloadLength + 2;	// + 2 for header and length
-				} else {
-					i += payloadLength + 3; // add enough to terminate the outer while loop
+                    decoded |= KOBUKI_SENSOR_ID(idField);
+                    SET_FIELD(sensors->generalInput.D0, packet[i+2] & 0x01, KOBUKI_CHANGED_INPUT);
+                    SET_FIELD(sensors->generalInput.D1, packet[i+2] & 0x02, KOBUKI_CHANGED_INPUT);
+                    SET_FIELD(sensors->generalInput.D2, packet[i+2] & 0x04, KOBUKI_CHANGED_INPUT);
+                    SET_FIELD(sensors->generalInput.D3, packet[i+2] & 0x08, KOBUKI_CHANGED_INPUT);
+                    SET_FIELD(sensors->generalInput.A0, to_uint16(packet[i+4], packet[i+5]), KOBUKI_CHANGED_INPUT);
+                    SET_FIELD(sensors->generalInput.A1, to_uint16(packet[i+6], packet[i+7]), KOBUKI_CHANGED_INPUT);
+                    SET_FIELD(sensors->generalInput.A2, to_uint16(packet[i+8], packet[i+9]), KOBUKI_CHANGED_INPUT);
+                    SET_FIELD(sensors->generalInput.A3, to_uint16(packet[i+10], packet[i+11]), KOBUKI_CHANGED_INPUT);
 				}
 				break;
 
 			case 0x13 : // UID
 				if (subPayloadLength == 0x0C){
-                    memcpy(&sensors->UID[0], &packet[i+2], 4);
-                    memcpy(&sensors->UID[1], &packet[i+6], 4);
-                    memcpy(&sensors->UID[2], &packet[i+10], 4);
-					i += subPayloadLength + 2;	// + 2 for header and length
-				} else {
-					i += payloadLength + 3; // add enough to terminate the outer while loop
+                    decoded |= KOBUKI_SENSOR_ID(idField);
+                    if (memcmp(sensors->UID, &packet[i+2], 12) != 0) {
+                        memcpy(&sensors->UID[0], &packet[i+2], 4);
+                        memcpy(&sensors->UID[1], &packet[i+6], 4);
+                        memcpy(&sensors->UID[2], &packet[i+10], 4);
+                        changed |= KOBUKI_CHANGED_UID;
+                    }
 				}
 				break;
 
 			case 0x15 :
 				if (subPayloadLength == 0x0D){
-                    sensors->controllerGain.userConfigured = packet[i+2] == 0x01;
-                    memcpy(&sensors->controllerGain.Kp, &packet[i+3], 4);
-                    memcpy(&sensors->controllerGain.Ki, &packet[i+7], 4);
-                    memcpy(&sensors->controllerGain.Kd, &packet[i+11], 4);
-					i += subPayloadLength + 2;	// + 2 for header and length
-				} else {
-					i += payloadLength + 3; // add enough to terminate the outer while loop
+                    decoded |= KOBUKI_SENSOR_ID(idField);
+                    KobukiGain_t gain;
+                    gain.userConfigured = packet[i+2] == 0x01;
+                    memcpy(&gain.Kp, &packet[i+3], 4);
+                    memcpy(&gain.Ki, &packet[i+7], 4);
+                    memcpy(&gain.Kd, &packet[i+11], 4);
+                    SET_FIELD(sensors->controllerGain.userConfigured, gain.userConfigured, KOBUKI_CHANGED_GAINS);
+                    SET_FIELD(sensors->controllerGain.Kp, gain.Kp, KOBUKI_CHANGED_GAINS);
+                    SET_FIELD(sensors->controllerGain.Ki, gain.Ki, KOBUKI_CHANGED_GAINS);
+                    SET_FIELD(sensors->controllerGain.Kd, gain.Kd, KOBUKI_CHANGED_GAINS);
 				}
 				break;
 
+			default:
+				// unknown sub-payload, skip it by its length
+				break;
 		}
+
+		i += subPayloadLength + 2; // + 2 for header and length
 	}
 
+	sensors->changedFields = changed;
+
 	//Checksum has already been checked.
-	return;
+	return decoded;
+}
+
+
+uint8_t kobukiGyroBatch(const KobukiSensors_t * sensors, const KobukiGyroSample_t ** samples) {
+	*samples = sensors->gyro.samples;
+	return sensors->gyro.numSamples;
 }
 
+
+bool kobukiPacketTimeStamp(const uint8_t * packet, uint16_t * timeStamp) {
+	uint16_t end = packet[2] + 3;
+	uint16_t i = 3;
+
+	while (i + 2 <= end && i + 2 + packet[i+1] <= end) {
+		if (packet[i] == 0x01 && packet[i+1] == 0x0F) {
+			*timeStamp = to_uint16(packet[i+2], packet[i+3]);
+			return true;
+		}
+		i += packet[i+1] + 2; // + 2 for header and length
+	}
+
+	return false;
+}
+
+
+bool kobukiPacketDigitalState(const uint8_t * packet, uint16_t * timeStamp, uint16_t * state) {
+	uint16_t end = packet[2] + 3;
+	uint16_t i = 3;
+
+	while (i + 2 <= end && i + 2 + packet[i+1] <= end) {
+		if (packet[i] == 0x01 && packet[i+1] == 0x0F) {
+			uint8_t bumps = packet[i+4];
+			uint8_t wheelDrops = packet[i+5];
+			uint8_t cliffs = packet[i+6];
+			uint8_t buttons = packet[i+13];
+
+			*timeStamp = to_uint16(packet[i+2], packet[i+3]);
+			*state = ((bumps & 0x04) ? 1 << KOBUKI_EVENT_BUMP_LEFT : 0) |
+					((bumps & 0x02) ? 1 << KOBUKI_EVENT_BUMP_CENTER : 0) |
+					((bumps & 0x01) ? 1 << KOBUKI_EVENT_BUMP_RIGHT : 0) |
+					((wheelDrops & 0x02) ? 1 << KOBUKI_EVENT_WHEEL_DROP_LEFT : 0) |
+					((wheelDrops & 0x01) ? 1 << KOBUKI_EVENT_WHEEL_DROP_RIGHT : 0) |
+					((cliffs & 0x04) ? 1 << KOBUKI_EVENT_CLIFF_LEFT : 0) |
+					((cliffs & 0x02) ? 1 << KOBUKI_EVENT_CLIFF_CENTER : 0) |
+					((cliffs & 0x01) ? 1 << KOBUKI_EVENT_CLIFF_RIGHT : 0) |
+					((buttons & 0x01) ? 1 << KOBUKI_EVENT_BUTTON_0 : 0) |
+					((buttons & 0x02) ? 1 << KOBUKI_EVENT_BUTTON_1 : 0) |
+					((buttons & 0x04) ? 1 << KOBUKI_EVENT_BUTTON_2 : 0);
+			return true;
+		}
+		i += packet[i+1] + 2; // + 2 for header and length
+	}
+
+	return false;
+}
@@ -4,9 +4,59 @@
 #include <stdint.h>
 
 #include "kobukiSensorTypes.h"
+
+/* Sub-payloads of a feedback packet, one bit per sub-payload ID, for kobukiParseSensorPacketMasked. */
+#define KOBUKI_SENSOR_ID(id)		(1u << (id))
+#define KOBUKI_SENSOR_BASIC			KOBUKI_SENSOR_ID(0x01) // time stamp, bumpers, wheel drops, cliffs, encoders, PWM, buttons, charger, battery
+#define KOBUKI_SENSOR_DOCKING_IR	KOBUKI_SENSOR_ID(0x03)
+#define KOBUKI_SENSOR_INERTIAL		KOBUKI_SENSOR_ID(0x04) // angle and angleRate
+#define KOBUKI_SENSOR_CLIFF			KOBUKI_SENSOR_ID(0x05) // raw cliff signals
+#define KOBUKI_SENSOR_CURRENT		KOBUKI_SENSOR_ID(0x06)
+#define KOBUKI_SENSOR_HW_VERSION	KOBUKI_SENSOR_ID(0x0A)
+#define KOBUKI_SENSOR_FW_VERSION	KOBUKI_SENSOR_ID(0x0B)
+#define KOBUKI_SENSOR_GYRO			KOBUKI_SENSOR_ID(0x0D)
+#define KOBUKI_SENSOR_INPUT			KOBUKI_SENSOR_ID(0x10) // general purpose input
+#define KOBUKI_SENSOR_UID			KOBUKI_SENSOR_ID(0x13)
+#define KOBUKI_SENSOR_GAINS			KOBUKI_SENSOR_ID(0x15)
+#define KOBUKI_SENSOR_ALL			0xFFFFFFFFu
+// sent once, in reply to kobukiRequestInformation or a gains request, instead of in every packet
+#define KOBUKI_SENSOR_REPLIES		(KOBUKI_SENSOR_HW_VERSION | KOBUKI_SENSOR_FW_VERSION | KOBUKI_SENSOR_UID | KOBUKI_SENSOR_GAINS)
+
 void kobukiParseSensorPacket(
 	const uint8_t * packet,
 	KobukiSensors_t * sensors
 );
 
+/* Like kobukiParseSensorPacket, but only decodes the sub-payloads in mask (KOBUKI_SENSOR_* bits).
+   The others are skipped by their length and their fields in sensors are left untouched.
+   Returns the KOBUKI_SENSOR_* bits of the sub-payloads that were decoded. */
+uint32_t kobukiParseSensorPacketMasked(
+	const uint8_t * packet,
+	KobukiSensors_t * sensors,
+	uint32_t mask
+);
+
+/* Every raw gyro sample of the last parsed packet, oldest first. Points into sensors,
+so nothing is copied; valid until sensors is parsed into again. Returns the number of samples. */
+uint8_t kobukiGyroBatch(
+	const KobukiSensors_t * sensors,
+	const KobukiGyroSample_t ** samples
+);
+
+/* Reads just the 16 bit timeStamp out of a packet's basic sensor data,
+without parsing the rest. Returns false if the packet has no basic sensor data. */
+bool kobukiPacketTimeStamp(
+	const uint8_t * packet,
+	uint16_t * timeStamp
+);
+
+/* Reads the timeStamp and the state of the bumpers, wheel drops, cliff sensors and buttons
+out of a packet's basic sensor data without parsing the rest. Bit n of state is set while
+the sensor KobukiEventSource_t n is down. Returns false if the packet has no basic sensor data. */
+bool kobukiPacketDigitalState(
+	const uint8_t * packet,
+	uint16_t * timeStamp,
+	uint16_t * state
+);
+
 #endif
@@ -68,6 +68,74 @@ typedef struct {
     uint32_t Kd;
 } KobukiGain_t;
 
+/* Bits of KobukiSensors_t.changedFields, one per group of fields. */
+#define KOBUKI_CHANGED_BUMPS			(1u << 0)
+#define KOBUKI_CHANGED_WHEEL_DROPS		(1u << 1)
+#define KOBUKI_CHANGED_CLIFFS			(1u << 2)
+#define KOBUKI_CHANGED_BUTTONS			(1u << 3)
+#define KOBUKI_CHANGED_ENCODERS			(1u << 4)
+#define KOBUKI_CHANGED_PWM				(1u << 5)
+#define KOBUKI_CHANGED_OVER_CURRENT		(1u << 6)
+#define KOBUKI_CHANGED_CHARGER			(1u << 7)
+#define KOBUKI_CHANGED_BATTERY			(1u << 8)
+#define KOBUKI_CHANGED_DOCKING			(1u << 9)
+#define KOBUKI_CHANGED_INERTIAL			(1u << 10)
+#define KOBUKI_CHANGED_CLIFF_SIGNALS	(1u << 11)
+#define KOBUKI_CHANGED_CURRENT			(1u << 12)
+#define KOBUKI_CHANGED_GYRO				(1u << 13)
+#define KOBUKI_CHANGED_VERSIONS			(1u << 14)
+#define KOBUKI_CHANGED_UID				(1u << 15)
+#define KOBUKI_CHANGED_INPUT			(1u << 16)
+#define KOBUKI_CHANGED_GAINS			(1u << 17)
+
+/* Digital sensors that produce edge events. */
+typedef enum {
+    KOBUKI_EVENT_BUMP_LEFT,
+    KOBUKI_EVENT_BUMP_CENTER,
+    KOBUKI_EVENT_BUMP_RIGHT,
+    KOBUKI_EVENT_WHEEL_DROP_LEFT,
+    KOBUKI_EVENT_WHEEL_DROP_RIGHT,
+    KOBUKI_EVENT_CLIFF_LEFT,
+    KOBUKI_EVENT_CLIFF_CENTER,
+    KOBUKI_EVENT_CLIFF_RIGHT,
+    KOBUKI_EVENT_BUTTON_0,
+    KOBUKI_EVENT_BUTTON_1,
+    KOBUKI_EVENT_BUTTON_2,
+    KOBUKI_EVENT_NUM_SOURCES
+} KobukiEventSource_t;
+
+/* One digital sensor going up or down. */
+typedef struct {
+    KobukiEventSource_t source;
+    // true when the bumper is pressed, the wheel dropped, a cliff appeared or the button went down
+    bool down;
+    // unwrapped robot time of the first packet showing the new state, see deviceTimeMs below
+    uint64_t deviceTimeMs;
+    // when that packet arrived at the host, CLOCK_MONOTONIC in us
+    uint64_t hostReceiveTimeUs;
+} KobukiSensorEvent_t;
+
+/* Raw 3D gyro samples. The robot reads the gyro more often than it sends packets,
+   so every packet carries the few samples taken since the last one. */
+#define KOBUKI_GYRO_MAX_SAMPLES 8
+
+typedef struct {
+    // increases by one per sample and rolls over at 255, so a gap shows lost samples
+    uint8_t frameId;
+    // signed, in 0.00875 deg/s increments
+    int16_t x;
+    int16_t y;
+    int16_t z;
+} KobukiGyroSample_t;
+
+typedef struct {
+    uint8_t numSamples;
+    // the packet had more than KOBUKI_GYRO_MAX_SAMPLES samples and the newest were left out
+    bool truncated;
+    // oldest first
+    KobukiGyroSample_t samples[KOBUKI_GYRO_MAX_SAMPLES];
+} KobukiGyroBatch_t;
+
 typedef struct{
 	//  bump and wheel-drop sensors.
 	KobukiBumps_WheelDrops_t bumps_wheelDrops;
@@ -105,6 +173,14 @@ typedef struct{
 	//TimeStamp, 16 bit unsigned in ms, rolls on overflow
 	uint16_t	timeStamp;
 
+	// Filled in by the library, not part of the packet:
+	// timeStamp unwrapped so it never rolls over, in ms
+	uint64_t	deviceTimeMs;
+	// when the packet arrived at the host, CLOCK_MONOTONIC in us (see kobukiClock.h)
+	uint64_t	hostReceiveTimeUs;
+	// KOBUKI_CHANGED_* bits of the fields the last parse changed from what the struct held before
+	uint32_t	changedFields;
+
 	//Battery voltage and charging state
 	uint8_t		batteryVoltage;
 	chargerState_t chargingState;
@@ -113,11 +189,14 @@ typedef struct{
 	int16_t angle;
 	int16_t angleRate;
 
-    // Raw values from the gyro in 0.00875 deg/s increments
+    // Raw values from the gyro in 0.00875 deg/s increments, first sample of the packet
     uint16_t xAxisRate;
     uint16_t yAxisRate;
     uint16_t zAxisRate;
 
+    // Every raw gyro sample of the packet
+    KobukiGyroBatch_t gyro;
+
     //Docking Position Feedback for the three IR docking sensors
     KobukiDocking_t docking;
 
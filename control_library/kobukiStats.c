@@ -0,0 +1,158 @@
+#include "kobukiStats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static KobukiStatsShared_t local_stats = {
+	.magic = KOBUKI_STATS_MAGIC,
+	.version = KOBUKI_STATS_VERSION,
+	.numStages = KOBUKI_NUM_STAGES,
+};
+static KobukiStatsShared_t* stats = &local_stats;
+
+static const char* stage_names[KOBUKI_NUM_STAGES] = {
+	"wakeup", "recv", "parse", "instruction", "state", "send", "pass"
+};
+
+static const char* counter_names[KOBUKI_NUM_COUNTERS] = {
+	"checksum failures", "missed ticks", "stale detections"
+};
+
+static int bucket_index(uint64_t ns) {
+	if (ns < 2 * KOBUKI_STATS_SUB_BUCKETS) {
+		return ns;
+	}
+
+	// keep the top 5 bits: the leading one picks the power of two, the next 4 the sub-bucket
+	int shift = 63 - __builtin_clzll(ns) - 4;
+	if (shift > KOBUKI_STATS_MAX_SHIFT) {
+		return KOBUKI_STATS_BUCKETS - 1;
+	}
+	return shift * KOBUKI_STATS_SUB_BUCKETS + (ns >> shift);
+}
+
+/* Largest duration that falls into the bucket. */
+static uint64_t bucket_limit(int index) {
+	if (index < 2 * KOBUKI_STATS_SUB_BUCKETS) {
+		return index;
+	}
+
+	int shift = index / KOBUKI_STATS_SUB_BUCKETS - 1;
+	uint64_t mantissa = index % KOBUKI_STATS_SUB_BUCKETS + KOBUKI_STATS_SUB_BUCKETS;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void kobukiHistogramRecord(KobukiHistogram_t * histogram, uint64_t durationNs) {
+	__atomic_fetch_add(&histogram->buckets[bucket_index(durationNs)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->sumNs, durationNs, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&histogram->maxNs, __ATOMIC_RELAXED);
+	while (durationNs > max &&
+			!__atomic_compare_exchange_n(&histogram->maxNs, &max, durationNs, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+void kobukiStatsRecord(KobukiStage_t stage, uint64_t durationNs) {
+	kobukiHistogramRecord(&stats->stages[stage], durationNs);
+}
+
+uint64_t kobukiStatsLap(KobukiStage_t stage, uint64_t startNs) {
+	uint64_t now = kobukiStatsNowNs();
+	kobukiStatsRecord(stage, now - startNs);
+	return now;
+}
+
+void kobukiStatsCount(KobukiCounter_t counter) {
+	__atomic_fetch_add(&stats->counters[counter], 1, __ATOMIC_RELAXED);
+}
+
+bool kobukiStatsShare(const char * name) {
+	char path[128];
+	snprintf(path, sizeof(path), "/dev/shm/%s", name);
+
+	// what shm_open does, without needing librt on older systems
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		printf("ERROR - cannot create %s\n\t%s\n", path, strerror(errno));
+		return false;
+	}
+
+	if (ftruncate(fd, sizeof(KobukiStatsShared_t)) == -1) {
+		printf("ERROR - cannot size %s\n\t%s\n", path, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	KobukiStatsShared_t* shared = mmap(NULL, sizeof(KobukiStatsShared_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shared == MAP_FAILED) {
+		printf("ERROR - cannot map %s\n\t%s\n", path, strerror(errno));
+		return false;
+	}
+
+	memcpy(shared, stats, sizeof(KobukiStatsShared_t));
+	__atomic_store_n(&stats, shared, __ATOMIC_RELEASE);
+	return true;
+}
+
+void kobukiStatsReset(void) {
+	memset(stats->counters, 0, sizeof(stats->counters));
+	memset(stats->stages, 0, sizeof(stats->stages));
+}
+
+uint64_t kobukiStatsPercentile(const KobukiHistogram_t * histogram, double fraction) {
+	uint64_t count = histogram->count;
+	if (count == 0) {
+		return 0;
+	}
+
+	uint64_t wanted = (uint64_t) (fraction * count + 0.5);
+	if (wanted < 1) {
+		wanted = 1;
+	}
+
+	uint64_t seen = 0;
+	for (int i = 0; i < KOBUKI_STATS_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= wanted) {
+			uint64_t limit = bucket_limit(i);
+			return limit < histogram->maxNs ? limit : histogram->maxNs;
+		}
+	}
+
+	return histogram->maxNs;
+}
+
+const char* kobukiStatsStageName(KobukiStage_t stage) {
+	return stage < KOBUKI_NUM_STAGES ? stage_names[stage] : "?";
+}
+
+void kobukiStatsPrint(const KobukiStatsShared_t * shared) {
+	printf("%-12s %10s %10s %10s %10s %10s\n", "stage", "count", "mean us", "p50 us", "p99 us", "max us");
+
+	for (int stage = 0; stage < KOBUKI_NUM_STAGES; stage++) {
+		const KobukiHistogram_t* histogram = &shared->stages[stage];
+		if (histogram->count == 0) {
+			continue;
+		}
+
+		printf("%-12s %10lu %10.2f %10.2f %10.2f %10.2f\n", stage_names[stage], (unsigned long) histogram->count,
+				histogram->sumNs / 1000.0 / histogram->count,
+				kobukiStatsPercentile(histogram, 0.5) / 1000.0,
+				kobukiStatsPercentile(histogram, 0.99) / 1000.0,
+				histogram->maxNs / 1000.0);
+	}
+
+	for (int counter = 0; counter < KOBUKI_NUM_COUNTERS; counter++) {
+		printf("%s: %lu\n", counter_names[counter], (unsigned long) shared->counters[counter]);
+	}
+}
+
+const KobukiStatsShared_t* kobukiStatsGet(void) {
+	return stats;
+}
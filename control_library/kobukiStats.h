@@ -0,0 +1,94 @@
+#ifndef _KOBUKISTATS_H
+#define _KOBUKISTATS_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Latency histograms of the stages of the control loop, and a few counters.
+
+   Each stage keeps an HDR style histogram of its durations in ns: values below 32 ns get a
+   bucket each, above that every power of two is split into 16 buckets, so a percentile is
+   within ~6% of the true value at any scale. Recording is a few adds, no locks and no system calls.
+
+   The histograms can live in a file in /dev/shm (kobukiStatsShare), where another process
+   (test_code/stats_view) reads them while the loop runs. */
+
+#define KOBUKI_STATS_MAGIC "KOBSTATS"
+#define KOBUKI_STATS_VERSION 2
+#define KOBUKI_STATS_DEFAULT_NAME "kobuki_stats"
+#define KOBUKI_STATS_SUB_BUCKETS 16
+#define KOBUKI_STATS_MAX_SHIFT 36 // durations are capped at ~2^40 ns, 18 minutes
+#define KOBUKI_STATS_BUCKETS (2 * KOBUKI_STATS_SUB_BUCKETS + KOBUKI_STATS_MAX_SHIFT * KOBUKI_STATS_SUB_BUCKETS)
+
+typedef enum {
+    KOBUKI_STAGE_WAKEUP,      // how late the loop woke up for a tick
+    KOBUKI_STAGE_RECV,        // reading and framing the packets that arrived
+    KOBUKI_STAGE_PARSE,       // decoding one packet
+    KOBUKI_STAGE_INSTRUCTION, // reading the instruction socket
+    KOBUKI_STAGE_STATE,       // the state machine, including building the commands
+    KOBUKI_STAGE_SEND,        // writing a command frame to the uart
+    KOBUKI_STAGE_PASS,        // one whole pass of the loop, not counting the wait
+    KOBUKI_NUM_STAGES
+} KobukiStage_t;
+
+typedef enum {
+    KOBUKI_COUNTER_CHECKSUM_FAILURES,
+    KOBUKI_COUNTER_MISSED_TICKS,      // the loop woke up a whole tick late or more
+    KOBUKI_COUNTER_STALE_DETECTIONS,  // detections dropped unused, a newer one came first or they got too old
+    KOBUKI_NUM_COUNTERS
+} KobukiCounter_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t sumNs;
+    uint64_t maxNs;
+    uint32_t buckets[KOBUKI_STATS_BUCKETS];
+} KobukiHistogram_t;
+
+/* Everything, as laid out in the shared file. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t numStages;
+    uint64_t counters[KOBUKI_NUM_COUNTERS];
+    KobukiHistogram_t stages[KOBUKI_NUM_STAGES];
+} KobukiStatsShared_t;
+
+/* Timestamp for measuring stages. Real time even while kobukiClockNowUs runs a virtual clock,
+   so replays measure the CPU cost. */
+static inline uint64_t kobukiStatsNowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Adds a value to any histogram, e.g. one of a benchmark's own. Safe from any thread. */
+void kobukiHistogramRecord(KobukiHistogram_t * histogram, uint64_t durationNs);
+
+/* Adds a duration to the stage's histogram. Safe from any thread. */
+void kobukiStatsRecord(KobukiStage_t stage, uint64_t durationNs);
+
+/* Adds the time since startNs and returns now, to time the next stage from. */
+uint64_t kobukiStatsLap(KobukiStage_t stage, uint64_t startNs);
+
+void kobukiStatsCount(KobukiCounter_t counter);
+
+/* Moves the statistics into /dev/shm/name so they can be watched live, keeping what was
+   recorded so far. Returns false on error, in which case they stay in this process. */
+bool kobukiStatsShare(const char * name);
+
+/* Forgets everything recorded. */
+void kobukiStatsReset(void);
+
+/* Smallest duration that fraction (0 to 1) of the recorded durations are at or below, in ns. */
+uint64_t kobukiStatsPercentile(const KobukiHistogram_t * histogram, double fraction);
+
+const char* kobukiStatsStageName(KobukiStage_t stage);
+
+/* Prints count, mean, p50, p99 and max of every stage and the counters. */
+void kobukiStatsPrint(const KobukiStatsShared_t * stats);
+
+/* The statistics of this process, for kobukiStatsPrint. */
+const KobukiStatsShared_t* kobukiStatsGet(void);
+
+#endif
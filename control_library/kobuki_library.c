@@ -1,12 +1,18 @@
 #include "kobuki_library.h"
 #include "kobuki_uart.h"
+#include "kobukiClock.h"
+#include "kobukiOdometry.h"
 #include "kobukiSensor.h"
 #include "kobukiSensorTypes.h"
+#include "kobukiStats.h"
 
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /*
 	Kobuki User Guide:
@@ -16,32 +22,457 @@ const int16_t FIX_ADD = 0;
 const int16_t FIXED_RADIUS_FOR_TURN = 10; // in mm
 const int16_t FIXED_SPEED_FOR_TURN = 35; // in mm/s
 
+/* Latest packet published by the sensor reader thread.
+	Protected by a seqlock: the sequence is odd while the reader thread is writing the snapshot,
+	so a consumer that sees it odd or changed across its copy simply copies again.
+	Writes take well under a microsecond once per packet, so consumers practically never retry. */
+typedef struct {
+	atomic_uint sequence;
+	KobukiSensors_t sensors;
+	int32_t length; // bytes in the packet
+} sensor_snapshot_t;
+
+#define READER_TIMEOUT_MS 50
+
+static sensor_snapshot_t latest_snapshot = {0};
+static pthread_t reader_thread;
+static atomic_bool reader_running = false;
+// sequence of the snapshot kobukiSensorTryPoll or kobukiSensorPollLatest handed out last
+static uint32_t snapshot_taken = 0;
+
+/* Shadow of the last drive command actually sent to the base.
+	Identical drive commands are suppressed until the keep-alive interval passes,
+	so the base's command watchdog still sees a command regularly. */
+typedef struct {
+	bool valid;
+	int16_t radius;
+	int16_t speed;
+	uint64_t sent_ms;
+} drive_shadow_t;
+
+/* Sub-payloads parse_packet decodes (KOBUKI_SENSOR_* bits), read by the reader thread as well. */
+static atomic_uint sensor_mask = KOBUKI_SENSOR_ALL;
+
+static drive_shadow_t drive_shadow = {0};
+static uint32_t keep_alive_ms = KOBUKI_DEFAULT_KEEP_ALIVE_MS;
+static KobukiCommandStats_t command_stats = {0};
+
+/* Sends a command payload and keeps count. */
+static int32_t send_command(uint8_t* payload, uint8_t len) {
+	int32_t status = kobuki_uart_send(payload, len);
+
+	if (status >= 0) {
+		command_stats.sent++;
+		command_stats.bytesSent += len;
+	}
+
+	return status;
+}
+
+/* Edge events of the digital sensors, from the thread that receives packets to the one that
+	calls kobukiSensorNextEvent. Single producer, single consumer, so head and tail need no lock. */
+#define EVENT_QUEUE_SIZE 64
+
+typedef struct {
+	KobukiSensorEvent_t events[EVENT_QUEUE_SIZE];
+	atomic_uint head; // total events taken out
+	atomic_uint tail; // total events put in
+	atomic_uint dropped;
+	// state of the digital sensors in the last packet, one bit per KobukiEventSource_t
+	uint16_t state;
+	bool have_state;
+	// down edges of the buttons not yet reported by kobukiButtonPressed
+	atomic_uint buttons_pressed;
+	// kobukiButtonPressed was called since the last reset, presses before that are dropped
+	atomic_bool buttons_polled;
+} event_queue_t;
+
+static event_queue_t event_queue = {0};
+
+static void push_event(KobukiEventSource_t source, bool down, uint64_t device_ms, uint64_t host_us) {
+	event_queue_t* queue = &event_queue;
+	unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+	if (tail - atomic_load_explicit(&queue->head, memory_order_acquire) == EVENT_QUEUE_SIZE) {
+		// nobody is reading events, keep the older ones
+		atomic_fetch_add_explicit(&queue->dropped, 1, memory_order_relaxed);
+		return;
+	}
+
+	KobukiSensorEvent_t* event = &queue->events[tail % EVENT_QUEUE_SIZE];
+	event->source = source;
+	event->down = down;
+	event->deviceTimeMs = device_ms;
+	event->hostReceiveTimeUs = host_us;
+
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+}
+
+static void reset_events(void) {
+	event_queue_t* queue = &event_queue;
+
+	atomic_store(&queue->head, atomic_load(&queue->tail));
+	atomic_store(&queue->dropped, 0);
+	atomic_store(&queue->buttons_pressed, 0);
+	atomic_store(&queue->buttons_polled, false);
+	queue->have_state = false;
+}
+
+/* What is known about a packet before parsing it. */
+typedef struct {
+	bool has_time_stamp;
+	uint16_t time_stamp;
+	uint64_t device_ms;
+	uint64_t host_us;
+} packet_info_t;
+
+static void record_edges(uint16_t state, const packet_info_t* info) {
+	event_queue_t* queue = &event_queue;
+
+	// the first packet only tells us where we start from
+	uint16_t changed = queue->have_state ? state ^ queue->state : 0;
+	queue->state = state;
+	queue->have_state = true;
+
+	for (int source = 0; changed; source++, changed >>= 1) {
+		if (changed & 1) {
+			bool down = state & (1 << source);
+			push_event(source, down, info->device_ms, info->host_us);
+
+			if (down && source >= KOBUKI_EVENT_BUTTON_0) {
+				atomic_fetch_or_explicit(&queue->buttons_pressed, 1 << source, memory_order_relaxed);
+			}
+		}
+	}
+}
+
+/* Done for every packet that arrives, including the ones kobukiSensorPollLatest skips:
+	feeds the clock and turns changes of the digital sensors into edge events. */
+static void track_packet(const uint8_t* packet, packet_info_t* info) {
+	uint16_t state;
+
+	info->host_us = kobuki_uart_frame_time_us();
+	info->has_time_stamp = kobukiPacketDigitalState(packet, &info->time_stamp, &state);
+	if (!info->has_time_stamp) {
+		return;
+	}
+
+	info->device_ms = kobukiClockObserve(info->time_stamp, info->host_us);
+	record_edges(state, info);
+}
+
+/* Parses the subscribed part of a tracked packet, adds the host arrival time and unwrapped robot time
+	and advances the odometry. */
+static void parse_packet(const uint8_t* packet, const packet_info_t* info, KobukiSensors_t* sensors) {
+	uint64_t start_ns = kobukiStatsNowNs();
+	uint32_t decoded = kobukiParseSensorPacketMasked(packet, sensors,
+			atomic_load_explicit(&sensor_mask, memory_order_relaxed));
+
+	sensors->hostReceiveTimeUs = info->host_us;
+	if (info->has_time_stamp) {
+		// filled in even if basic sensor data is not subscribed
+		sensors->timeStamp = info->time_stamp;
+		sensors->deviceTimeMs = info->device_ms;
+	}
+
+	kobukiOdometryUpdate(sensors, decoded);
+	kobukiStatsLap(KOBUKI_STAGE_PARSE, start_ns);
+}
+
 /* Initializes Kobuki Library. Called before library functions. */
 bool kobukiLibraryInit(void) {
+	drive_shadow.valid = false;
+	kobukiClockReset();
+	kobukiOdometryReset();
+	reset_events();
 	return (kobuki_uart_init() >= 0);
 }
 
+/* Initializes Kobuki Library on the given transport. */
+bool kobukiLibraryInitTransport(kobuki_transport_t* transport) {
+	// a new connection knows nothing about what the base was last told
+	drive_shadow.valid = false;
+	kobukiClockReset();
+	kobukiOdometryReset();
+	reset_events();
+	return (kobuki_uart_init_transport(transport) >= 0);
+}
+
+/* Selects the sub-payloads that get decoded into KobukiSensors_t. */
+void kobukiSensorSubscribe(uint32_t mask) {
+	atomic_store(&sensor_mask, mask);
+}
+
 /* Request sensor data and wait for response. */
 int32_t kobukiSensorPoll(KobukiSensors_t* const	sensors){
 
-	int32_t status = 0;
+	if (atomic_load(&reader_running)) {
+		kobukiSensorGetLatest(sensors);
+		return 0;
+	}
 
-	// initialize communications buffer
-    // We know that the maximum size of the packet is less than 140 based on documentation
-	uint8_t packet[140] = {0};
+	const uint8_t* packet;
+	packet_info_t packet_info;
 
-	status = kobuki_uart_recv(&packet[0]);
+	// the frame points into the uart receive buffer, so there is nothing to copy
+	int32_t status = kobuki_uart_recv_frame(&packet);
 
-    if (status < 0) {
-        return status;
-    }
+	if (status < 0) {
+		return status;
+	}
 
 	// parse response
-	kobukiParseSensorPacket(packet, sensors);
+	track_packet(packet, &packet_info);
+	parse_packet(packet, &packet_info, sensors);
+
+	return status;
+}
+
+/* Copies the reader thread's snapshot, if it is newer than the one taken last. Returns the bytes
+	in its packet or 0, and the number of packets the reader parsed in between in skipped. */
+static int32_t take_snapshot(KobukiSensors_t* sensors, uint32_t* skipped);
+
+/* Parse sensor data that has already arrived without waiting. */
+int32_t kobukiSensorTryPoll(KobukiSensors_t* const sensors) {
+	const uint8_t* packet;
+	packet_info_t packet_info;
+
+	// the reader thread owns the receive buffer
+	if (atomic_load(&reader_running)) {
+		return take_snapshot(sensors, NULL);
+	}
+
+	int32_t status = kobuki_uart_recv_frame_timeout(&packet, 0);
+
+	if (status <= 0) {
+		return status;
+	}
+
+	track_packet(packet, &packet_info);
+	parse_packet(packet, &packet_info, sensors);
 
 	return status;
 }
 
+/* Skip to the newest packet that has arrived. */
+int32_t kobukiSensorPollLatest(KobukiSensors_t* const sensors, KobukiPollInfo_t* info, int timeout_ms) {
+	// the receive buffer may be compacted while we look for newer frames, so keep our own copy
+	static uint8_t latest[3 + 255 + 1];
+
+	const uint8_t* packet;
+	packet_info_t packet_info;
+	int32_t status;
+	int32_t latest_size = 0;
+	uint32_t frames = 0;
+	uint16_t oldest_time_stamp = 0;
+	bool have_oldest = false;
+	uint32_t reply_changes = 0;
+	uint64_t start_ns = kobukiStatsNowNs();
+
+	// the reader thread owns the receive buffer and parses every packet, take its newest
+	if (atomic_load(&reader_running)) {
+		uint64_t give_up_ns = start_ns + (uint64_t) timeout_ms * 1000000;
+		uint32_t skipped = 0;
+		while ((status = take_snapshot(sensors, &skipped)) == 0 && kobukiStatsNowNs() < give_up_ns) {
+			struct timespec pause = { .tv_nsec = 1000000 };
+			nanosleep(&pause, NULL);
+		}
+		if (status > 0 && info) {
+			uint64_t now = kobukiClockNowUs();
+			info->framesDiscarded = skipped;
+			info->receivedUs = sensors->hostReceiveTimeUs;
+			info->ageUs = now - info->receivedUs;
+			uint64_t device_now = kobukiClockHostToDeviceMs(now);
+			info->deviceAgeMs = device_now > sensors->deviceTimeMs ? device_now - sensors->deviceTimeMs : 0;
+			info->skippedMs = 0;
+		}
+		return status;
+	}
+
+	while ((status = kobuki_uart_recv_frame_timeout(&packet, 0)) > 0) {
+		// skipped packets still count for the clock and edge events, and may hold the
+		// only copy of a reply, which the newest packet would not repeat
+		track_packet(packet, &packet_info);
+		kobukiParseSensorPacketMasked(packet, sensors,
+				atomic_load_explicit(&sensor_mask, memory_order_relaxed) & KOBUKI_SENSOR_REPLIES);
+		reply_changes |= sensors->changedFields;
+		if (!have_oldest) {
+			have_oldest = packet_info.has_time_stamp;
+			oldest_time_stamp = packet_info.time_stamp;
+		}
+		memcpy(latest, packet, status + 1);
+		latest_size = status;
+		frames++;
+	}
+
+	if (status < 0) {
+		return status;
+	}
+
+	if (frames == 0) {
+		// nothing waiting, so the next packet to arrive is the newest
+		status = kobuki_uart_recv_frame_timeout(&packet, timeout_ms);
+		if (status <= 0) {
+			return status;
+		}
+		track_packet(packet, &packet_info);
+		memcpy(latest, packet, status + 1);
+		latest_size = status;
+		frames = 1;
+	}
+
+	// time spent waiting is not receiving
+	if (timeout_ms == 0) {
+		kobukiStatsLap(KOBUKI_STAGE_RECV, start_ns);
+	}
+
+	parse_packet(latest, &packet_info, sensors);
+	sensors->changedFields |= reply_changes;
+
+	if (info) {
+		info->framesDiscarded = frames - 1;
+		uint64_t now = kobukiClockNowUs();
+
+		info->receivedUs = sensors->hostReceiveTimeUs;
+		info->ageUs = now - info->receivedUs;
+		uint64_t device_now = kobukiClockHostToDeviceMs(now);
+		info->deviceAgeMs = device_now > sensors->deviceTimeMs ? device_now - sensors->deviceTimeMs : 0;
+		info->skippedMs = 0;
+		if (frames > 1 && have_oldest && packet_info.has_time_stamp) {
+			info->skippedMs = packet_info.time_stamp - oldest_time_stamp;
+		}
+	}
+
+	return latest_size;
+}
+
+static void publish_snapshot(const KobukiSensors_t* sensors, int32_t length) {
+	sensor_snapshot_t* snapshot = &latest_snapshot;
+	unsigned int sequence = atomic_load_explicit(&snapshot->sequence, memory_order_relaxed);
+
+	atomic_store_explicit(&snapshot->sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	memcpy(&snapshot->sensors, sensors, sizeof(KobukiSensors_t));
+	snapshot->length = length;
+
+	atomic_store_explicit(&snapshot->sequence, sequence + 2, memory_order_release);
+}
+
+static void* sensor_reader_main(void* arg) {
+	(void) arg;
+
+	// Sub-payloads that are not in every packet keep their previous values, like in kobukiSensorPoll
+	KobukiSensors_t sensors = {0};
+	const uint8_t* packet;
+	packet_info_t packet_info;
+
+	while (atomic_load(&reader_running)) {
+		// times out regularly, so a stop request is noticed even if the line is idle
+		int32_t length = kobuki_uart_recv_frame_timeout(&packet, READER_TIMEOUT_MS);
+		if (length < 0) {
+			// e.g. the USB serial adapter was unplugged: the error comes back right away,
+			// so wait as long as a timeout before trying again instead of spinning
+			struct timespec pause = { .tv_nsec = READER_TIMEOUT_MS * 1000000L };
+			nanosleep(&pause, NULL);
+			continue;
+		}
+		if (length == 0) {
+			continue;
+		}
+
+		track_packet(packet, &packet_info);
+		parse_packet(packet, &packet_info, &sensors);
+		publish_snapshot(&sensors, length);
+	}
+
+	return NULL;
+}
+
+/* Starts the sensor reader thread. Returns true on success. */
+bool kobukiSensorReaderStart(void) {
+	if (atomic_exchange(&reader_running, true)) {
+		return true;
+	}
+
+	if (pthread_create(&reader_thread, NULL, sensor_reader_main, NULL) != 0) {
+		printf("ERROR - could not start sensor reader thread\n");
+		atomic_store(&reader_running, false);
+		return false;
+	}
+
+	return true;
+}
+
+/* Stops the sensor reader thread. */
+void kobukiSensorReaderStop(void) {
+	if (atomic_exchange(&reader_running, false)) {
+		pthread_join(reader_thread, NULL);
+	}
+}
+
+static uint32_t read_snapshot(KobukiSensors_t* sensors, int32_t* length) {
+	sensor_snapshot_t* snapshot = &latest_snapshot;
+	unsigned int before, after;
+
+	do {
+		before = atomic_load_explicit(&snapshot->sequence, memory_order_acquire);
+		if (before & 1) {
+			continue;
+		}
+
+		memcpy(sensors, &snapshot->sensors, sizeof(KobukiSensors_t));
+		*length = snapshot->length;
+
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(&snapshot->sequence, memory_order_relaxed);
+	} while ((before & 1) || before != after);
+
+	return before / 2;
+}
+
+/* Returns the sequence number of the copied packet or 0 if there is none yet. */
+uint32_t kobukiSensorGetLatest(KobukiSensors_t* const sensors) {
+	int32_t length;
+	return read_snapshot(sensors, &length);
+}
+
+static int32_t take_snapshot(KobukiSensors_t* sensors, uint32_t* skipped) {
+	// the caller's sensors stay as they were if there is nothing new
+	KobukiSensors_t latest;
+	int32_t length;
+	uint32_t sequence = read_snapshot(&latest, &length);
+
+	if (sequence == 0 || sequence == snapshot_taken) {
+		return 0;
+	}
+
+	if (skipped) {
+		*skipped = snapshot_taken != 0 ? sequence - snapshot_taken - 1 : 0;
+	}
+	snapshot_taken = sequence;
+	memcpy(sensors, &latest, sizeof(KobukiSensors_t));
+	return length;
+}
+
+/* Takes the oldest edge event. */
+bool kobukiSensorNextEvent(KobukiSensorEvent_t* event) {
+	event_queue_t* queue = &event_queue;
+	unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+	if (head == atomic_load_explicit(&queue->tail, memory_order_acquire)) {
+		return false;
+	}
+
+	*event = queue->events[head % EVENT_QUEUE_SIZE];
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return true;
+}
+
+uint32_t kobukiSensorEventsDropped(void) {
+	return atomic_load(&event_queue.dropped);
+}
+
 /* Checks for the state change of a button press on any of the Kobuki buttons. */
 bool isButtonPressed(KobukiSensors_t* sensors) {
   // save previous states of buttons
@@ -75,6 +506,20 @@ bool isButtonPressed(KobukiSensors_t* sensors) {
   return result;
 }
 
+/* The press is latched when the packet showing it arrives, so a press shorter than the time
+	between two calls is not lost. */
+bool kobukiButtonPressed(void) {
+	event_queue_t* queue = &event_queue;
+	bool pressed = atomic_exchange(&queue->buttons_pressed, 0) != 0;
+
+	// a press while the caller was still starting up was not meant for its loop
+	if (!atomic_exchange(&queue->buttons_polled, true)) {
+		return false;
+	}
+
+	return pressed;
+}
+
 /*
    Returned time is in ms
    Desired Angle is defined in degrees and is positive <= 180
@@ -99,6 +544,18 @@ float kobukiTimeToReachAngle(float desiredAngle) {
 
 }
 
+void kobukiCommandBatchBegin(void) {
+	kobuki_uart_batch_begin();
+}
+
+int32_t kobukiCommandBatchFlush(void) {
+	return kobuki_uart_batch_flush();
+}
+
+int32_t kobukiCommandDrain(void) {
+	return kobuki_uart_drain();
+}
+
 /* Turns at fixed speed. */
 int32_t kobukiTurnRightFixed(void) {
 	return kobukiDriveRadius(FIXED_RADIUS_FOR_TURN, -(FIXED_SPEED_FOR_TURN + FIX_ADD));
@@ -110,6 +567,143 @@ int32_t kobukiTurnLeftFixed(void) {
 }
 
 
+/* Turn to heading controller.
+	Closes the loop on the odometry heading, which follows the gyro (inertial angle).
+	The commanded turn rate is the fastest one from which the robot can still stop at the target
+	with TURN_DECEL, capped at TURN_MAX_RATE and ramped up with TURN_ACCEL, so the robot turns
+	fast and slows down into the target instead of turning slowly for a fixed time.
+	Time is robot time from the packets, so the controller behaves the same on a replay.
+	Only when the packets stop coming, the robot clock stops too, so that is timed on the host clock. */
+#define TURN_MAX_RATE 1.2 // rad/s
+#define TURN_MIN_RATE 0.15 // rad/s, slower than this the wheels stall
+#define TURN_ACCEL 3.0 // rad/s^2
+#define TURN_DECEL 1.5 // rad/s^2, planned lower than the base can do to absorb the sensor delay
+#define TURN_TOLERANCE (1.0 * M_PI / 180.0) // rad
+#define TURN_SETTLED_RATE 0.05 // rad/s
+#define TURN_PACKET_PERIOD 0.02 // s, the Kobuki sends 50 packets a second
+#define TURN_FEEDBACK_TIMEOUT_MS 100 // host time without a new packet before giving up, 5 packets
+
+typedef struct {
+	KobukiTurnStatus_t status;
+	bool started;
+	double target; // odometry heading to reach
+	double angle; // requested turn, for the timeout
+	double rate; // last commanded rate, rad/s
+	uint64_t last_ms; // robot time of the last pose used
+	uint64_t last_host_us; // kobukiClockNowUs when last_ms changed
+	uint64_t deadline_ms;
+} turn_controller_t;
+
+static turn_controller_t turn_controller = {0};
+
+/* Spins in place at rate rad/s, counter clockwise positive. */
+static int32_t spin(double rate) {
+	int16_t speed = (int16_t) lround(rate * KOBUKI_WHEEL_BASE / 2 * 1000.0);
+
+	if (speed == 0) {
+		return kobukiDriveRadius(0, 0);
+	}
+	// radius 1 turns in place, positive speed counter clockwise
+	return kobukiDriveRadius(1, speed);
+}
+
+void kobukiTurnStart(float degrees) {
+	turn_controller_t* turn = &turn_controller;
+
+	turn->status = KOBUKI_TURN_RUNNING;
+	turn->started = false;
+	turn->angle = degrees * M_PI / 180.0;
+	turn->rate = 0;
+}
+
+KobukiTurnStatus_t kobukiTurnUpdate(void) {
+	turn_controller_t* turn = &turn_controller;
+	KobukiPose_t pose;
+
+	if (turn->status != KOBUKI_TURN_RUNNING) {
+		return turn->status;
+	}
+
+	kobukiOdometryGetPose(&pose);
+
+	if (!turn->started) {
+		// the target is relative to where we are when the first pose comes in
+		turn->started = true;
+		turn->target = pose.theta + turn->angle;
+		turn->last_ms = pose.deviceTimeMs;
+		turn->last_host_us = kobukiClockNowUs();
+		double expected_s = fabs(turn->angle) / TURN_MAX_RATE + TURN_MAX_RATE / TURN_ACCEL + TURN_MAX_RATE / TURN_DECEL;
+		turn->deadline_ms = pose.deviceTimeMs + (uint64_t) (3000 * expected_s) + 1000;
+	}
+
+	double error = turn->target - pose.theta;
+
+	if (fabs(error) < TURN_TOLERANCE && fabs(pose.angularVelocity) < TURN_SETTLED_RATE) {
+		turn->status = KOBUKI_TURN_DONE;
+		turn->rate = 0;
+		spin(0);
+		return turn->status;
+	}
+
+	if (pose.deviceTimeMs > turn->deadline_ms) {
+		printf("ERROR - turn did not reach its target, %.1f degrees left\n", error * 180.0 / M_PI);
+		turn->status = KOBUKI_TURN_TIMEOUT;
+		turn->rate = 0;
+		spin(0);
+		return turn->status;
+	}
+
+	// the robot went quiet, e.g. the cable came off: do not spin on blind
+	if (pose.deviceTimeMs == turn->last_ms && kobukiClockNowUs() - turn->last_host_us > TURN_FEEDBACK_TIMEOUT_MS * 1000) {
+		printf("ERROR - no sensor packets for %dms, stopping the turn\n", TURN_FEEDBACK_TIMEOUT_MS);
+		turn->status = KOBUKI_TURN_TIMEOUT;
+		turn->rate = 0;
+		spin(0);
+		return turn->status;
+	}
+
+	// nothing new from the robot since the last pass, keep going
+	if (pose.deviceTimeMs == turn->last_ms && turn->rate != 0) {
+		spin(turn->rate);
+		return turn->status;
+	}
+
+	// the fastest rate we can still stop from at the target
+	double rate = 0;
+	if (fabs(error) >= TURN_TOLERANCE) {
+		rate = fmin(TURN_MAX_RATE, sqrt(2 * TURN_DECEL * fabs(error)));
+		rate = fmax(rate, TURN_MIN_RATE);
+		rate = copysign(rate, error);
+	}
+
+	// speeding up is limited per packet (the first one counts as one), slowing down is not
+	double dt = fmax((pose.deviceTimeMs - turn->last_ms) / 1000.0, TURN_PACKET_PERIOD);
+	if (pose.deviceTimeMs != turn->last_ms) {
+		turn->last_host_us = kobukiClockNowUs();
+	}
+	turn->last_ms = pose.deviceTimeMs;
+	if (fabs(rate) > fabs(turn->rate) || rate * turn->rate < 0) {
+		double step = TURN_ACCEL * dt;
+		rate = fmax(turn->rate - step, fmin(turn->rate + step, rate));
+	}
+
+	turn->rate = rate;
+	spin(rate);
+
+	return turn->status;
+}
+
+void kobukiTurnCancel(void) {
+	turn_controller_t* turn = &turn_controller;
+
+	if (turn->status == KOBUKI_TURN_RUNNING) {
+		spin(0);
+	}
+	turn->status = KOBUKI_TURN_IDLE;
+	turn->rate = 0;
+}
+
+
 int32_t kobukiDriveDirect(int16_t leftWheelSpeed, int16_t rightWheelSpeed){
 	int32_t CmdSpeed;
 	int32_t CmdRadius;
@@ -144,12 +738,39 @@ int32_t kobukiDriveDirect(int16_t leftWheelSpeed, int16_t rightWheelSpeed){
 int32_t kobukiDriveRadius(int16_t radius, int16_t speed){
     uint8_t payload[6];
 
+    drive_shadow_t* shadow = &drive_shadow;
+    uint64_t now = kobukiClockNowUs() / 1000;
+
+    if (keep_alive_ms > 0 && shadow->valid && shadow->radius == radius && shadow->speed == speed &&
+            now - shadow->sent_ms < keep_alive_ms) {
+        command_stats.suppressed++;
+        command_stats.bytesSuppressed += sizeof(payload);
+        return 0;
+    }
+
     payload[0] = 0x01;
     payload[1] = 0x04;
     memcpy(payload+2, &speed, 2);
     memcpy(payload+4, &radius, 2);
 
-    return kobuki_uart_send(payload, 6);
+    int32_t status = send_command(payload, 6);
+
+    if (status >= 0) {
+        shadow->valid = true;
+        shadow->radius = radius;
+        shadow->speed = speed;
+        shadow->sent_ms = now;
+    }
+
+    return status;
+}
+
+void kobukiSetCommandKeepAlive(uint32_t interval_ms) {
+    keep_alive_ms = interval_ms;
+}
+
+void kobukiGetCommandStats(KobukiCommandStats_t* stats) {
+    *stats = command_stats;
 }
 
 int32_t kobukiSetControllerDefault(void) {
@@ -159,7 +780,7 @@ int32_t kobukiSetControllerDefault(void) {
     payload[1] = 0x0D; // 13 byte PID length
     payload[2] = 0x00; // Default gain
 
-    return kobuki_uart_send(payload, 15);
+    return send_command(payload, 15);
 }
 
 int32_t kobukiSetControllerUser(uint32_t Kp, uint32_t Ki, uint32_t Kd){
@@ -177,7 +798,7 @@ int32_t kobukiSetControllerUser(uint32_t Kp, uint32_t Ki, uint32_t Kd){
     memcpy(payload + 7, &Ki, 4);
     memcpy(payload + 11, &Kd, 4);
 
-    return kobuki_uart_send(payload, 15);
+    return send_command(payload, 15);
 }
 
 // Play a sound of f = 1/(frequency * 0.00000275) with duration
@@ -188,7 +809,7 @@ int32_t kobukiSetControllerUser(uint32_t Kp, uint32_t Ki, uint32_t Kd){
     payload[1] = 0x03;
     memcpy(payload + 2, &use_f, 2);
     payload[4] = duration_ms;
-    return kobuki_uart_send(payload, 5);
+    return send_command(payload, 5);
 }*/
 
 // Play a predefined sound from the above sound types
@@ -199,7 +820,7 @@ int32_t kobukiPlaySoundSequence(KobukiSound_t sound) {
     payload[1] = 0x01;
     payload[2] = (uint8_t)sound;
 
-    return kobuki_uart_send(payload, 3);
+    return send_command(payload, 3);
 }
 
 // Request hardware version, firmware version and unique ID on the next data packet
@@ -211,7 +832,7 @@ int32_t kobukiRequestInformation(void) {
     payload[2] = 0x08 | 0x02 | 0x01;
     payload[3] = 0x00;
 
-    return kobuki_uart_send(payload, 4);
+    return send_command(payload, 4);
 }
 // Control Output and LEDs on the Robot
 // The four least significant bits of outputs controls outputs 0-3
@@ -225,5 +846,5 @@ int32_t kobukiRequestInformation(void) {
     payload[0] = 0x0C;
     payload[1] = 0x02;
     memcpy(payload + 2, &general_output, 2);
-    return kobuki_uart_send(payload, 4);
+    return send_command(payload, 4);
 }*/
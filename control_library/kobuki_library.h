@@ -4,18 +4,95 @@
 #include <stdint.h>
 
 #include "kobuki_uart.h"
+#include "kobukiChannel.h"
+#include "kobukiClock.h"
+#include "kobukiInstruction.h"
+#include "kobukiOdometry.h"
+#include "kobukiPath.h"
+#include "kobukiRealtime.h"
+#include "kobukiRecorder.h"
+#include "kobukiStats.h"
 #include "kobukiSensorTypes.h"
 #include "kobukiSensor.h"
 
 /* Must call before using Kobuki Library functions. Returns true on success. */
 bool kobukiLibraryInit(void);
 
-/* Request sensor packet from kobuki and wait for response */
+/* Same as kobukiLibraryInit but talks to the robot through the given transport,
+   e.g. a serial port at another path, a pty or in-memory simulator, or a recording.
+   The transport must stay valid while the library is used. Returns true on success. */
+bool kobukiLibraryInitTransport(kobuki_transport_t* transport);
+
+/* Only decode the sub-payloads in mask (KOBUKI_SENSOR_* bits from kobukiSensor.h) from now on,
+   e.g. KOBUKI_SENSOR_BASIC for a loop that only needs bumpers, buttons and encoders.
+   The odometry needs KOBUKI_SENSOR_BASIC, and KOBUKI_SENSOR_INERTIAL for the gyro heading.
+   The others are skipped and their fields keep whatever they held before.
+   timeStamp, deviceTimeMs and hostReceiveTimeUs are always filled in. Defaults to KOBUKI_SENSOR_ALL. */
+void kobukiSensorSubscribe(uint32_t mask);
+
+/* Request sensor packet from kobuki and wait for response.
+   While the sensor reader thread is running this copies the latest packet instead. */
 int32_t kobukiSensorPoll(KobukiSensors_t * const	sensors);
 
-/* Checks for the state change of a button press on any of the Kobuki buttons */
+/* Parses a sensor packet only if one has already arrived. Never blocks, so it can be called
+   whenever the uart file descriptor (kobuki_uart_fd) becomes readable.
+   While the sensor reader thread is running this copies its latest packet, if it is a new one.
+   Returns number of bytes in the packet, 0 if no complete packet is available or < 0 on error. */
+int32_t kobukiSensorTryPoll(KobukiSensors_t * const sensors);
+
+typedef struct {
+    // complete packets that were already waiting and got skipped for a newer one
+    uint32_t framesDiscarded;
+    // when the returned packet arrived at the host (CLOCK_MONOTONIC, microseconds) and how long ago that was
+    uint64_t receivedUs;
+    uint32_t ageUs;
+    // robot time (timeStamp) between the oldest skipped packet and the returned one, 0 if nothing was skipped
+    uint16_t skippedMs;
+    // robot time passed since the robot produced the returned packet, from the host/robot clock estimate
+    uint32_t deviceAgeMs;
+} KobukiPollInfo_t;
+
+/* Freshest-packet poll: takes every packet that has already arrived and parses only the newest,
+   so a loop that fell behind acts on the current state instead of working through the backlog.
+   Replies that come once (KOBUKI_SENSOR_REPLIES) are still decoded from the skipped packets.
+   Waits up to timeout_ms only if no complete packet is waiting. info may be NULL.
+   While the sensor reader thread is running this copies its latest packet, if it is a new one;
+   the packets it parsed in between count as discarded, and skippedMs stays 0.
+   Returns number of bytes in the parsed packet, 0 if none arrived in time or < 0 on error. */
+int32_t kobukiSensorPollLatest(KobukiSensors_t * const sensors, KobukiPollInfo_t * info, int timeout_ms);
+
+/* Starts a background thread that owns the uart receive side, parses every packet
+   and publishes it for kobukiSensorGetLatest. Commands can still be sent from the caller's thread.
+   Returns true on success. */
+bool kobukiSensorReaderStart(void);
+
+/* Stops the sensor reader thread and waits for it to exit. */
+void kobukiSensorReaderStop(void);
+
+/* Copies the most recently parsed packet from the sensor reader thread. Never waits on I/O.
+   Returns the packet's sequence number, which increases by one per packet, or 0 if no packet has arrived yet.
+   Getting the same sequence number twice means no new packet arrived in between. */
+uint32_t kobukiSensorGetLatest(KobukiSensors_t * const sensors);
+
+/* Takes the oldest edge event of a bumper, wheel drop, cliff sensor or button. Events are recorded
+   for every packet that arrives, including those kobukiSensorPollLatest skips, so a pulse shorter
+   than the poll interval still shows up as a down and an up event. The last 64 events are kept
+   until taken; newer ones are dropped and counted while the queue is full.
+   Returns false if there is none. */
+bool kobukiSensorNextEvent(KobukiSensorEvent_t * event);
+
+/* Number of edge events dropped because the queue was full. */
+uint32_t kobukiSensorEventsDropped(void);
+
+/* Checks for the state change of a button press on any of the Kobuki buttons, from sensors
+   compared to the sensors of the last call. Misses a press that starts and ends between two calls. */
 bool isButtonPressed(KobukiSensors_t* sensors);
 
+/* Checks for a button press on any of the Kobuki buttons in every packet that arrived:
+   true once for every batch of presses since the last call, however short they were.
+   The first call only clears the presses made before it, e.g. during startup, and returns false. */
+bool kobukiButtonPressed(void);
+
 
 /* =============================================
                  ACTUATOR API
@@ -29,6 +106,36 @@ float kobukiTimeToReachAngle(
 		float desiredAngle
 );
 
+typedef enum {
+    KOBUKI_TURN_IDLE,       // no turn started or it was cancelled
+    KOBUKI_TURN_RUNNING,
+    KOBUKI_TURN_DONE,       // stopped within a degree of the target
+    KOBUKI_TURN_TIMEOUT     // gave up, e.g. the robot is stuck or sends no packets; the wheels are stopped
+} KobukiTurnStatus_t;
+
+/* Starts turning in place by degrees, counter clockwise (left) positive, from the heading
+   at the next kobukiTurnUpdate. Replaces a turn that is still running. Does not block. */
+void kobukiTurnStart(float degrees);
+
+/* Sends the wheel command for the turn, from the odometry heading of the latest parsed packet.
+   Call once per control loop pass after polling the sensors, until it stops returning
+   KOBUKI_TURN_RUNNING. Needs KOBUKI_SENSOR_INERTIAL subscribed for the gyro heading. */
+KobukiTurnStatus_t kobukiTurnUpdate(void);
+
+/* Stops a running turn. */
+void kobukiTurnCancel(void);
+
+/* Collects every command issued until kobukiCommandBatchFlush into a single frame,
+   e.g. all commands of one control loop pass, so they cost one write and one header on the uart. */
+void kobukiCommandBatchBegin(void);
+
+/* Sends the commands collected since kobukiCommandBatchBegin.
+   Returns number of bytes sent or < 0 on error. */
+int32_t kobukiCommandBatchFlush(void);
+
+/* Waits until all sent commands have left the uart. Only needed before e.g. closing the port. */
+int32_t kobukiCommandDrain(void);
+
 /* Turns at fixed speed. */
 int32_t kobukiTurnRightFixed(void);
 
@@ -50,6 +157,22 @@ int32_t kobukiDriveRadius(
 		int16_t speed
 );
 
+/* Drive commands (kobukiDriveRadius and everything built on it) identical to the last one sent
+   are suppressed until interval_ms has passed since it was sent, then repeated to keep the
+   base's command watchdog satisfied. 0 sends every command. Defaults to KOBUKI_DEFAULT_KEEP_ALIVE_MS. */
+#define KOBUKI_DEFAULT_KEEP_ALIVE_MS 200
+void kobukiSetCommandKeepAlive(uint32_t interval_ms);
+
+typedef struct {
+    uint32_t sent;            // commands written to the uart (or queued in a batch)
+    uint32_t suppressed;      // drive commands skipped because the base already had them
+    uint32_t bytesSent;       // payload bytes of the sent commands
+    uint32_t bytesSuppressed; // payload bytes saved by suppressing
+} KobukiCommandStats_t;
+
+/* Copies the counters of sent and suppressed commands. */
+void kobukiGetCommandStats(KobukiCommandStats_t* stats);
+
 /* Sets the PID gains on the robot wheel control to the defaults. */
 int32_t kobukiSetControllerDefault(void);
 
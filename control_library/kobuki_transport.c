@@ -0,0 +1,365 @@
+#define _GNU_SOURCE
+#include "kobuki_transport.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <errno.h>
+#include <poll.h>
+
+/*
+https://www.raspberrypi.org/documentation/hardware/raspberrypi/schematics/rpi_SCH_3b_1p2_reduced.pdf
+https://www.jameco.com/Jameco/workshop/circuitnotes/raspberry-pi-circuit-note.html
+
+Pin 8 (GPIO14) is set to UART0_TXD - Transmit line
+Pin 10 (GPIO15) is set to UART0_RXD - Receive line
+
+*/
+
+
+/* =============================================
+          FILE DESCRIPTOR BASED TRANSPORTS
+  ============================================== */
+
+/* Returns B0 for a rate the Kobuki's serial port cannot be set to. */
+static speed_t baud_to_speed(int baud) {
+	switch (baud) {
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+		case 460800: return B460800;
+		case 921600: return B921600;
+		default: return B0;
+	}
+}
+
+/* Configures a serial or pty file descriptor for the Kobuki. Returns < 0 on error. */
+static int configure_serial(int fd, int baud) {
+
+	/* CONFIGURE THE UART
+	The flags (defined in /usr/include/termios.h - see http://pubs.opengroup.org/onlinepubs/007908799/xsh/termios.h.html):
+		Baud rate:- B1200, B2400, B4800, B9600, B19200, B38400, B57600, B115200, B230400, B460800, B500000, B576000, B921600, B1000000, B1152000, B1500000, B2000000, B2500000, B3000000, B3500000, B4000000
+		CSIZE:- CS5, CS6, CS7, CS8
+		CLOCAL - Ignore modem status lines
+		CREAD - Enable receiver
+		IGNPAR = Ignore characters with parity errors
+		ICRNL - Map CR to NL on input (Use for ASCII comms where you want to auto correct end of line characters - don't use for bianry comms!)
+		PARENB - Parity enable
+		PARODD - Odd parity (else even)
+	*/
+
+
+	/* For Kobuki - Baud rate: 115200 BPS, Data bit: 8 bit, Stop bit: 1 bit, No Parity. */
+	speed_t speed = baud_to_speed(baud);
+	if (speed == B0) {
+		printf("ERROR - unsupported baud rate %d\n", baud);
+		return -1;
+	}
+
+	struct termios options;
+	if (tcgetattr(fd, &options) < 0) {
+		printf("ERROR - cannot read serial port settings\n\t%s\n", strerror(errno));
+		return -1;
+	}
+	options.c_cflag = speed | CS8 | CLOCAL | CREAD;
+	options.c_iflag = IGNPAR;
+	options.c_oflag = 0;
+	options.c_lflag = 0;
+	// Reads never block; waiting for data is done with poll() in fd_wait
+	options.c_cc[VMIN] = 0;
+	options.c_cc[VTIME] = 0;
+	cfsetispeed(&options, speed);
+	cfsetospeed(&options, speed);
+	tcflush(fd, TCIFLUSH);
+	tcsetattr(fd, TCSANOW, &options);
+
+	return 1;
+}
+
+static int fd_read(kobuki_transport_t* transport, uint8_t* buffer, int len) {
+	int status = read(transport->fd, buffer, len);
+	if (status < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return 0;
+	}
+	return status;
+}
+
+static int fd_write(kobuki_transport_t* transport, const uint8_t* data, int len) {
+	return write(transport->fd, data, len);
+}
+
+static int fd_drain(kobuki_transport_t* transport) {
+	return tcdrain(transport->fd);
+}
+
+static int fd_wait(kobuki_transport_t* transport, int timeout_ms) {
+	struct pollfd pfd = { .fd = transport->fd, .events = POLLIN };
+
+	int status = poll(&pfd, 1, timeout_ms);
+	if (status < 0 && errno == EINTR) {
+		return 0;
+	}
+	return status;
+}
+
+static void fd_close(kobuki_transport_t* transport) {
+	if (transport->fd != -1) {
+		close(transport->fd);
+		transport->fd = -1;
+	}
+}
+
+
+/* Serial port. */
+static int serial_open(kobuki_transport_t* transport) {
+
+	/*
+	O_RDWR - Open for reading and writing.
+	O_NOCTTY - When set and path identifies a terminal device, open() shall not cause the terminal device to become the controlling terminal for the process.
+	O_NDELAY - Enables nonblocking mode. When set, read or write requests on the file can return immediately with a failure status instead of blocking.
+	*/
+	transport->fd = open(transport->serial.path, O_RDWR | O_NOCTTY); // | O_NDELAY);
+
+	if (transport->fd == -1) {
+		printf("ERROR - cannot open serial port\n\t%s\n", strerror(errno));
+		return -1;
+	}
+
+	if (configure_serial(transport->fd, transport->serial.baud) < 0) {
+		fd_close(transport);
+		return -1;
+	}
+
+	return 1;
+}
+
+void kobuki_transport_serial(kobuki_transport_t* transport, const char* path, int baud) {
+	memset(transport, 0, sizeof(kobuki_transport_t));
+
+	transport->open = serial_open;
+	transport->close = fd_close;
+	transport->read = fd_read;
+	transport->write = fd_write;
+	transport->drain = fd_drain;
+	transport->wait = fd_wait;
+	transport->fd = -1;
+
+	snprintf(transport->serial.path, KOBUKI_TRANSPORT_PATH_LEN, "%s", path);
+	transport->serial.baud = baud;
+}
+
+
+/* Pseudo-terminal pair. The host gets the slave side so it behaves like a tty. */
+static int pty_open(kobuki_transport_t* transport) {
+	int peer_fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (peer_fd == -1 || grantpt(peer_fd) < 0 || unlockpt(peer_fd) < 0 ||
+			ptsname_r(peer_fd, transport->pty.peer_path, KOBUKI_TRANSPORT_PATH_LEN) != 0) {
+		printf("ERROR - cannot create pseudo-terminal\n\t%s\n", strerror(errno));
+		if (peer_fd != -1) {
+			close(peer_fd);
+		}
+		return -1;
+	}
+
+	transport->fd = open(transport->pty.peer_path, O_RDWR | O_NOCTTY);
+	if (transport->fd == -1 || configure_serial(transport->fd, KOBUKI_DEFAULT_BAUD) < 0) {
+		printf("ERROR - cannot open pseudo-terminal\n\t%s\n", strerror(errno));
+		fd_close(transport);
+		close(peer_fd);
+		return -1;
+	}
+
+	// the robot side is raw as well, so packets pass through unchanged
+	struct termios options;
+	tcgetattr(peer_fd, &options);
+	cfmakeraw(&options);
+	tcsetattr(peer_fd, TCSANOW, &options);
+
+	transport->pty.peer_fd = peer_fd;
+	return 1;
+}
+
+static void pty_close(kobuki_transport_t* transport) {
+	fd_close(transport);
+	if (transport->pty.peer_fd != -1) {
+		close(transport->pty.peer_fd);
+		transport->pty.peer_fd = -1;
+	}
+}
+
+void kobuki_transport_pty(kobuki_transport_t* transport) {
+	memset(transport, 0, sizeof(kobuki_transport_t));
+
+	transport->open = pty_open;
+	transport->close = pty_close;
+	transport->read = fd_read;
+	transport->write = fd_write;
+	transport->drain = fd_drain;
+	transport->wait = fd_wait;
+	transport->fd = -1;
+	transport->pty.peer_fd = -1;
+}
+
+
+/* =============================================
+                IN-MEMORY LOOPBACK
+  ============================================== */
+
+static int queue_put(kobuki_loopback_queue_t* queue, const uint8_t* data, int len) {
+	int space = KOBUKI_LOOPBACK_SIZE - (queue->tail - queue->head);
+	if (len > space) {
+		len = space;
+	}
+
+	// copy in at most two pieces, wrapping around the end of the queue
+	int start = queue->tail % KOBUKI_LOOPBACK_SIZE;
+	int first = (len < KOBUKI_LOOPBACK_SIZE - start) ? len : KOBUKI_LOOPBACK_SIZE - start;
+	memcpy(queue->data + start, data, first);
+	memcpy(queue->data, data + first, len - first);
+	queue->tail += len;
+
+	return len;
+}
+
+static int queue_take(kobuki_loopback_queue_t* queue, uint8_t* buffer, int len) {
+	int available = queue->tail - queue->head;
+	if (len > available) {
+		len = available;
+	}
+
+	int start = queue->head % KOBUKI_LOOPBACK_SIZE;
+	int first = (len < KOBUKI_LOOPBACK_SIZE - start) ? len : KOBUKI_LOOPBACK_SIZE - start;
+	memcpy(buffer, queue->data + start, first);
+	memcpy(buffer + first, queue->data, len - first);
+	queue->head += len;
+
+	return len;
+}
+
+static int loopback_open(kobuki_transport_t* transport) {
+	transport->loopback.to_host.head = transport->loopback.to_host.tail = 0;
+	transport->loopback.to_robot.head = transport->loopback.to_robot.tail = 0;
+	return 1;
+}
+
+static void loopback_close(kobuki_transport_t* transport) {
+	(void) transport;
+}
+
+/* Memory and files have nothing in flight. */
+static int nothing_to_drain(kobuki_transport_t* transport) {
+	(void) transport;
+	return 0;
+}
+
+static int loopback_read(kobuki_transport_t* transport, uint8_t* buffer, int len) {
+	return queue_take(&transport->loopback.to_host, buffer, len);
+}
+
+static int loopback_write(kobuki_transport_t* transport, const uint8_t* data, int len) {
+	return queue_put(&transport->loopback.to_robot, data, len);
+}
+
+/* Nothing can arrive while we wait, so instead give the simulator a chance to produce data. */
+static int loopback_wait(kobuki_transport_t* transport, int timeout_ms) {
+	(void) timeout_ms;
+	kobuki_loopback_queue_t* queue = &transport->loopback.to_host;
+
+	if (queue->tail == queue->head && transport->loopback.refill) {
+		transport->loopback.refill(transport, transport->loopback.context);
+	}
+
+	return queue->tail != queue->head;
+}
+
+void kobuki_transport_loopback(kobuki_transport_t* transport) {
+	memset(transport, 0, sizeof(kobuki_transport_t));
+
+	transport->open = loopback_open;
+	transport->close = loopback_close;
+	transport->read = loopback_read;
+	transport->write = loopback_write;
+	transport->drain = nothing_to_drain;
+	transport->wait = loopback_wait;
+	transport->fd = -1;
+}
+
+int kobuki_loopback_inject(kobuki_transport_t* transport, const uint8_t* data, int len) {
+	return queue_put(&transport->loopback.to_host, data, len);
+}
+
+int kobuki_loopback_take(kobuki_transport_t* transport, uint8_t* buffer, int len) {
+	return queue_take(&transport->loopback.to_robot, buffer, len);
+}
+
+
+/* =============================================
+                   FILE REPLAY
+  ============================================== */
+
+static int replay_open(kobuki_transport_t* transport) {
+	transport->replay.file_fd = open(transport->replay.path, O_RDONLY);
+
+	if (transport->replay.file_fd == -1) {
+		printf("ERROR - cannot open replay file\n\t%s\n", strerror(errno));
+		return -1;
+	}
+
+	transport->replay.bytes_written = 0;
+	return 1;
+}
+
+static void replay_close(kobuki_transport_t* transport) {
+	if (transport->replay.file_fd != -1) {
+		close(transport->replay.file_fd);
+		transport->replay.file_fd = -1;
+	}
+}
+
+static int replay_read(kobuki_transport_t* transport, uint8_t* buffer, int len) {
+	int status = read(transport->replay.file_fd, buffer, len);
+
+	if (status == 0 && transport->replay.loop) {
+		lseek(transport->replay.file_fd, 0, SEEK_SET);
+		status = read(transport->replay.file_fd, buffer, len);
+	}
+
+	return status;
+}
+
+static int replay_write(kobuki_transport_t* transport, const uint8_t* data, int len) {
+	(void) data;
+	transport->replay.bytes_written += len;
+	return len;
+}
+
+/* A file is always ready; replay_read reports the end of it. */
+static int replay_wait(kobuki_transport_t* transport, int timeout_ms) {
+	(void) transport;
+	(void) timeout_ms;
+	return 1;
+}
+
+void kobuki_transport_replay(kobuki_transport_t* transport, const char* path, int loop) {
+	memset(transport, 0, sizeof(kobuki_transport_t));
+
+	transport->open = replay_open;
+	transport->close = replay_close;
+	transport->read = replay_read;
+	transport->write = replay_write;
+	transport->drain = nothing_to_drain;
+	transport->wait = replay_wait;
+	transport->fd = -1;
+
+	snprintf(transport->replay.path, KOBUKI_TRANSPORT_PATH_LEN, "%s", path);
+	transport->replay.loop = loop;
+	transport->replay.file_fd = -1;
+}
@@ -0,0 +1,99 @@
+#ifndef _KOBUKI_TRANSPORT_H
+#define _KOBUKI_TRANSPORT_H
+
+#include <stdint.h>
+
+/* Byte transport underneath kobuki_uart.
+Fill one in with one of the kobuki_transport_* functions below and pass it to kobuki_uart_init_transport.
+The transport must stay valid until kobuki_uart_close. */
+
+#define KOBUKI_TRANSPORT_PATH_LEN 64
+#define KOBUKI_LOOPBACK_SIZE 4096
+
+/* Serial file on Raspberry Pi Model 3. */
+#define KOBUKI_DEFAULT_SERIAL "/dev/serial0"
+#define KOBUKI_DEFAULT_BAUD 115200
+
+/* One direction of the in-memory loopback. */
+typedef struct {
+	uint8_t data[KOBUKI_LOOPBACK_SIZE];
+	uint32_t head; // total bytes taken out
+	uint32_t tail; // total bytes put in
+} kobuki_loopback_queue_t;
+
+typedef struct kobuki_transport {
+	/* Returns < 0 on error. */
+	int (*open)(struct kobuki_transport* transport);
+
+	void (*close)(struct kobuki_transport* transport);
+
+	/* Reads up to len bytes that have already arrived. Never blocks.
+	Returns number of bytes read, 0 if there are none or < 0 on error. */
+	int (*read)(struct kobuki_transport* transport, uint8_t* buffer, int len);
+
+	/* Returns number of bytes written or < 0 on error. */
+	int (*write)(struct kobuki_transport* transport, const uint8_t* data, int len);
+
+	/* Blocks until all written bytes have been transmitted. Returns < 0 on error. */
+	int (*drain)(struct kobuki_transport* transport);
+
+	/* Waits up to timeout_ms until there is something to read.
+	Returns > 0 if there is, 0 on timeout or < 0 on error. */
+	int (*wait)(struct kobuki_transport* transport, int timeout_ms);
+
+	/* File descriptor that becomes readable with data, or -1 if the transport has none
+	(in that case callers poll with kobuki_uart_recv_frame_timeout instead). */
+	int fd;
+
+	union {
+		struct {
+			char path[KOBUKI_TRANSPORT_PATH_LEN];
+			int baud;
+		} serial;
+
+		struct {
+			// the robot's end of the pair, for a simulator to read commands from and write packets to
+			int peer_fd;
+			char peer_path[KOBUKI_TRANSPORT_PATH_LEN];
+		} pty;
+
+		struct {
+			kobuki_loopback_queue_t to_host; // filled by kobuki_loopback_inject
+			kobuki_loopback_queue_t to_robot; // drained by kobuki_loopback_take
+			// Called when the host waits for data and nothing is queued, so a simulator can produce more. Optional.
+			void (*refill)(struct kobuki_transport* transport, void* context);
+			void* context;
+		} loopback;
+
+		struct {
+			char path[KOBUKI_TRANSPORT_PATH_LEN];
+			// start over at the end of the file instead of running dry
+			int loop;
+			int file_fd;
+			uint32_t bytes_written;
+		} replay;
+	};
+} kobuki_transport_t;
+
+/* Real serial port configured for the Kobuki (8 data bits, 1 stop bit, no parity) at the given baud rate.
+   Opening it fails unless the rate is a standard one from 9600 to 921600. */
+void kobuki_transport_serial(kobuki_transport_t* transport, const char* path, int baud);
+
+/* Pseudo-terminal pair. The host side is configured like the serial port;
+after opening, pty.peer_fd / pty.peer_path are the robot side. */
+void kobuki_transport_pty(kobuki_transport_t* transport);
+
+/* In-memory queues in both directions. No system calls and no file descriptor. */
+void kobuki_transport_loopback(kobuki_transport_t* transport);
+
+/* Queues bytes for the host to receive, as if the robot sent them. Returns number of bytes queued. */
+int kobuki_loopback_inject(kobuki_transport_t* transport, const uint8_t* data, int len);
+
+/* Takes up to len bytes the host sent to the robot. Returns number of bytes taken. */
+int kobuki_loopback_take(kobuki_transport_t* transport, uint8_t* buffer, int len);
+
+/* Plays back a file containing raw bytes received from a Kobuki, as fast as they are read.
+Written commands are counted and dropped. */
+void kobuki_transport_replay(kobuki_transport_t* transport, const char* path, int loop);
+
+#endif
@@ -1,76 +1,111 @@
 #include "kobuki_uart.h"
+#include "kobukiClock.h"
+#include "kobukiRecorder.h"
+#include "kobukiStats.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <termios.h>
 #include <errno.h>
+#include <time.h>
 
-/* 
-https://www.raspberrypi.org/documentation/hardware/raspberrypi/schematics/rpi_SCH_3b_1p2_reduced.pdf
-https://www.jameco.com/Jameco/workshop/circuitnotes/raspberry-pi-circuit-note.html
+/* Transport the uart talks through. Defaults to the Raspberry Pi serial port. */
+static kobuki_transport_t default_transport;
+static kobuki_transport_t* transport = NULL;
 
-Pin 8 (GPIO14) is set to UART0_TXD - Transmit line
-Pin 10 (GPIO15) is set to UART0_RXD - Receive line
+/* Receive buffer.
+Bytes are pulled from the uart in bulk (as many as are available per read) and complete
+frames are handed out as pointers into this buffer, so no copy is needed to parse them.
+Consumed bytes are compacted to the front only when the free space at the end runs low,
+which keeps every frame contiguous. */
+#define RX_BUFFER_SIZE 1024
+#define RX_TIMEOUT_MS 25
 
-*/
+#define RX_READ_MARKS 8
 
-/* Serial file on Raspberry Pi Model 3. */
-const char serial_filepath[] = "/dev/serial0";
-int uart_fd = -1;
+typedef struct {
+	uint8_t data[RX_BUFFER_SIZE];
+	uint16_t head; // first byte not yet consumed
+	uint16_t tail; // one past the last byte read
+
+	// When the most recent reads happened, to tell when a frame's last byte arrived.
+	// end is the total number of bytes received once that read finished.
+	uint64_t received;
+	struct {
+		uint64_t end;
+		uint64_t time_us;
+	} reads[RX_READ_MARKS];
+	uint8_t next_read;
+
+	uint64_t frame_time_us; // arrival time of the frame handed out last
+} rx_buffer_t;
+
+static rx_buffer_t rx_buffer = {0};
+
+/* Outgoing frame. Sub-payloads of every command sent while a batch is open are
+collected here and go out as one frame with one write. */
+typedef struct {
+	uint8_t data[3 + 255 + 1]; // header, length, payload, checksum
+	uint8_t payloadSize;
+	bool batching;
+} tx_frame_t;
+
+static tx_frame_t tx_frame = {0};
+
+static kobuki_uart_stats_t uart_stats = {0};
 
 /* Returns < 0 on error. */
 int kobuki_uart_init(void) {
+	kobuki_transport_serial(&default_transport, KOBUKI_DEFAULT_SERIAL, KOBUKI_DEFAULT_BAUD);
+	return kobuki_uart_init_transport(&default_transport);
+}
 
-	/*
-	O_RDWR - Open for reading and writing.
-	O_NOCTTY - When set and path identifies a terminal device, open() shall not cause the terminal device to become the controlling terminal for the process.
-	O_NDELAY - Enables nonblocking mode. When set, read or write requests on the file can return immediately with a failure status instead of blocking.
-	*/
-	uart_fd = open(serial_filepath, O_RDWR | O_NOCTTY); // | O_NDELAY);
-
-	if (uart_fd == -1) {
-		printf("ERROR - cannot open serial port\n\t%s\n", strerror(errno));
+/* Returns < 0 on error. */
+int kobuki_uart_init_transport(kobuki_transport_t* new_transport) {
+	if (new_transport->open(new_transport) < 0) {
 		return -1;
 	}
 
-	/* CONFIGURE THE UART
-	The flags (defined in /usr/include/termios.h - see http://pubs.opengroup.org/onlinepubs/007908799/xsh/termios.h.html):
-		Baud rate:- B1200, B2400, B4800, B9600, B19200, B38400, B57600, B115200, B230400, B460800, B500000, B576000, B921600, B1000000, B1152000, B1500000, B2000000, B2500000, B3000000, B3500000, B4000000
-		CSIZE:- CS5, CS6, CS7, CS8
-		CLOCAL - Ignore modem status lines
-		CREAD - Enable receiver
-		IGNPAR = Ignore characters with parity errors
-		ICRNL - Map CR to NL on input (Use for ASCII comms where you want to auto correct end of line characters - don't use for bianry comms!)
-		PARENB - Parity enable
-		PARODD - Odd parity (else even)	
-	*/
-
-
-	/* For Kobuki - Baud rate: 115200 BPS, Data bit: 8 bit, Stop bit: 1 bit, No Parity. */	
-	struct termios options;
-	tcgetattr(uart_fd, &options);
-	options.c_cflag = B115200 | CS8 | CLOCAL | CREAD;
-	options.c_iflag = IGNPAR;
-	options.c_oflag = 0;
-	options.c_lflag = 0;
-	tcflush(uart_fd, TCIFLUSH);
-	tcsetattr(uart_fd, TCSANOW, &options);
+	transport = new_transport;
+	rx_buffer.head = rx_buffer.tail = 0;
+	tx_frame.payloadSize = 0;
+	tx_frame.batching = false;
 
 	return 1;
 }
 
+int kobuki_uart_fd(void) {
+	return transport ? transport->fd : -1;
+}
+
 void kobuki_uart_close(void) {
-	close(uart_fd);
+	if (transport) {
+		transport->close(transport);
+		transport = NULL;
+	}
+	rx_buffer.head = rx_buffer.tail = 0;
 }
 
 
-static uint8_t checksum_create(uint8_t* data, uint8_t len) {
-	uint8_t cs = 0;
+/* XOR of len bytes, computed 8 bytes at a time. */
+static uint8_t checksum_create(const uint8_t* data, int len) {
+	uint64_t wide = 0;
+	int i = 0;
 
-	for (int i = 0; i < len; i++) {
+	for (; i + 8 <= len; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		wide ^= word;
+	}
+
+	wide ^= wide >> 32;
+	wide ^= wide >> 16;
+	wide ^= wide >> 8;
+
+	uint8_t cs = (uint8_t) wide;
+	for (; i < len; i++) {
 		cs ^= data[i];
 	}
 	
@@ -78,131 +113,255 @@ static uint8_t checksum_create(uint8_t* data, uint8_t len) {
 }
 
 
-/* Returns number of bytes sent or < 0 on error. */
+/* Writes out the pending command frame. Returns number of bytes sent or < 0 on error. */
+static int tx_write(void) {
+	tx_frame_t* tx = &tx_frame;
+
+	if (tx->payloadSize == 0) {
+		return 0;
+	}
+
+	tx->data[0] = 0xAA;
+	tx->data[1] = 0x55;
+	tx->data[2] = tx->payloadSize;
+	tx->data[3 + tx->payloadSize] = checksum_create(tx->data + 2, tx->payloadSize + 1);
+
+	int len = tx->payloadSize + 4;
+	tx->payloadSize = 0;
+
+	kobukiRecord(KOBUKI_RECORD_TX_FRAME, tx->data, len);
+
+	if (!transport) {
+		return -1;
+	}
+
+	uint64_t start_ns = kobukiStatsNowNs();
+	int count = transport->write(transport, tx->data, len);
+	kobukiStatsLap(KOBUKI_STAGE_SEND, start_ns);
+	if (count < 0) {
+		printf("ERROR - failed to transmit on uart\n\t%s\n", strerror(errno));
+	}
+
+	return count;
+}
+
+/* Returns number of bytes sent (or queued in a batch) or < 0 on error. */
 int kobuki_uart_send(uint8_t* payload, uint8_t len) {
-	uint8_t writeData[256] = {0};
-
-	writeData[0] = 0xAA;
-	writeData[1] = 0x55;
-	writeData[2] = len;
-	memcpy(writeData + 3, payload, len);
-	writeData[3+len] = checksum_create(writeData + 2, len + 1);
-
-	if (uart_fd != -1) {
-		int count = write(uart_fd, writeData, len+4);
-		if (count < 0) {
-			printf("ERROR - failed to transmit on uart\n\t%s\n", strerror(errno));
+	tx_frame_t* tx = &tx_frame;
+
+	if (!transport) {
+		return -1;
+	}
+
+	// a frame holds at most 255 payload bytes, so send what is queued and start a new one
+	if (tx->payloadSize + len > 255) {
+		tx_write();
+	}
+
+	memcpy(tx->data + 3 + tx->payloadSize, payload, len);
+	tx->payloadSize += len;
+
+	if (tx->batching) {
+		return len;
+	}
+
+	return tx_write();
+}
+
+void kobuki_uart_batch_begin(void) {
+	tx_frame.batching = true;
+}
+
+/* Returns number of bytes sent or < 0 on error. */
+int kobuki_uart_batch_flush(void) {
+	tx_frame.batching = false;
+	return tx_write();
+}
+
+/* Returns < 0 on error. */
+int kobuki_uart_drain(void) {
+	if (!transport) {
+		return -1;
+	}
+
+	return transport->drain(transport);
+}
+
+
+/* Arrival time of the read that brought in the byte just before the buffer position. */
+static uint64_t rx_arrival_time(uint16_t position) {
+	rx_buffer_t* rx = &rx_buffer;
+	uint64_t end = rx->received - (rx->tail - position);
+	uint64_t best_end = UINT64_MAX;
+	uint64_t time_us = 0;
+
+	for (int i = 0; i < RX_READ_MARKS; i++) {
+		if (rx->reads[i].end >= end && rx->reads[i].end <= best_end) {
+			best_end = rx->reads[i].end;
+			time_us = rx->reads[i].time_us;
 		}
+	}
+
+	return time_us;
+}
+
+static long elapsed_ms(const struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
 
-		fsync(uart_fd);
-		return count;
+/* Waits up to timeout_ms for data and reads everything available into the receive buffer.
+Returns number of bytes read, 0 on timeout or < 0 on error. */
+static int rx_fill(int timeout_ms) {
+	rx_buffer_t* rx = &rx_buffer;
+
+	if (rx->head == rx->tail) {
+		rx->head = rx->tail = 0;
+	} else if (rx->head > RX_BUFFER_SIZE / 2 || rx->tail == RX_BUFFER_SIZE) {
+		memmove(rx->data, rx->data + rx->head, rx->tail - rx->head);
+		rx->tail -= rx->head;
+		rx->head = 0;
 	}
 
-	return -1;
+	int status = transport->wait(transport, timeout_ms);
+	if (status <= 0) {
+		return status;
+	}
+
+	status = transport->read(transport, rx->data + rx->tail, RX_BUFFER_SIZE - rx->tail);
+	if (status < 0) {
+		return status;
+	}
+
+	rx->tail += status;
+	rx->received += status;
+	rx->reads[rx->next_read].end = rx->received;
+	rx->reads[rx->next_read].time_us = kobukiClockNowUs();
+	rx->next_read = (rx->next_read + 1) % RX_READ_MARKS;
+	return status;
 }
 
+/* Points frame at the next complete frame in the receive buffer and returns its size.
+Returns 0 if more bytes are needed. Corrupt or partial frames are skipped in-stream:
+decoding just resumes at the next header. */
+static int rx_extract(const uint8_t** frame) {
+	rx_buffer_t* rx = &rx_buffer;
+
+	while (rx->tail - rx->head >= 3) {
+		uint8_t* p = rx->data + rx->head;
+		int available = rx->tail - rx->head;
+
+		// jump straight to the next possible header
+		if (p[0] != 0xAA) {
+			uint8_t* header = memchr(p + 1, 0xAA, available - 1);
+			int skipped = header ? header - p : available;
+			rx->head += skipped;
+			uart_stats.bytesSkipped += skipped;
+			continue;
+		}
 
-/* Returns number of bytes read or < 0 on error. */
-int kobuki_uart_recv(uint8_t* buffer) {
+		if (p[1] != 0x55) {
+			rx->head++;
+			uart_stats.bytesSkipped++;
+			continue;
+		}
+
+		uint8_t payloadSize = p[2];
+		if (available < payloadSize + 4) {
+			return 0;
+		}
+
+		if (checksum_create(p + 2, payloadSize + 1) != p[payloadSize + 3]) {
+			// skip this header and resync on the next one
+			rx->head++;
+			uart_stats.bytesSkipped++;
+			uart_stats.checksumFailures++;
+			kobukiStatsCount(KOBUKI_COUNTER_CHECKSUM_FAILURES);
+			continue;
+		}
+
+		*frame = p;
+		rx->head += payloadSize + 4;
+		rx->frame_time_us = rx_arrival_time(rx->head);
+		uart_stats.frames++;
+		kobukiRecordAt(KOBUKI_RECORD_RX_FRAME, p, payloadSize + 4, rx->frame_time_us);
+		return payloadSize + 3;
+	}
 
-	typedef enum {
-			wait_until_HDR,
-			read_length,
-			read_payload,
-			read_checksum
-	} state_type;
+	return 0;
+}
 
-	state_type state = wait_until_HDR;
+/* Returns number of bytes in the frame (excluding checksum), 0 on timeout or < 0 on error. */
+int kobuki_uart_recv_frame_timeout(const uint8_t** frame, int timeout_ms) {
+	struct timespec start;
 
-	uint8_t byteBuffer;
-	int status = 0;
-	uint8_t payloadSize = 0;
-	uint8_t calcuatedCS;
+	if (!transport) {
+		return -1;
+	}
 
-	status = fsync(uart_fd);
+	// usually a frame is already buffered, so only look at the clock once we have to wait
+	int status = rx_extract(frame);
+	if (status != 0) {
+		return status;
+	}
 
-	int num_checksum_failures = 0;
-  	uint8_t p_index = 0;
-	int counter = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	while (1) {
 
-		status = read(uart_fd, buffer + p_index, 1);
-		if (status == 0) {
-			if (counter < 100) {
-				counter++;
-				usleep(250);
-				continue;
-			}
-			// try again
-			printf("No data from uart receive - will try again.\n");
-			return -1;
-		} else if (status < 0) {
+		long remaining = timeout_ms - elapsed_ms(&start);
+		if (remaining < 0) {
+			return 0;
+		}
+
+		status = rx_fill(remaining);
+		if (status < 0) {
 			printf("ERROR - received error while reading from uart\n\t%s\n", strerror(errno));
 			return status;
 		}
-
-		switch(state) {
-			case wait_until_HDR: {
-				p_index++;
-
-				if (p_index == 2 && buffer[0]==0xAA && buffer[1]==0x55) {
-					state = read_length;
-				} else if (p_index == 2) {
-					p_index = 0;
-					state = wait_until_HDR;
-				} else {
-					state = wait_until_HDR;
-				}
-
-				break;
-			}
-
-			case read_length: {
-				payloadSize = buffer[p_index];
-				byteBuffer = payloadSize;
-				p_index++;
-				state = read_payload;
-
-				break;
-			}
-
-			case read_payload: {
-				p_index++;
-				if (p_index > payloadSize+3) {
-					state = read_checksum;
-				}
-
-				break;
-			}
-
-			case read_checksum: {
-				calcuatedCS = checksum_create(buffer + 2, payloadSize + 1);
-				byteBuffer = buffer[payloadSize+3];
-				if (calcuatedCS == byteBuffer) {
-					num_checksum_failures = 0;
-					// printf("Got payload from uart - size: %d\n", payloadSize);
-					return payloadSize + 3;
-				} else {
-					state = wait_until_HDR;
-					p_index = 0;
-					if (num_checksum_failures == 3) {
-						printf("ERROR - checksum did not match data 4 times\n");
-						return -1500;
-					}
-					num_checksum_failures++;
-				}
-
-				break;
-				}
-
-				default:
-					break;
+		if (status == 0 && remaining == 0) {
+			return 0;
 		}
 
+		status = rx_extract(frame);
+		if (status != 0) {
+			return status;
+		}
 	}
 
 	return -1;
+}
+
+/* Returns number of bytes in the frame (excluding checksum) or < 0 on error. */
+int kobuki_uart_recv_frame(const uint8_t** frame) {
+	int status = kobuki_uart_recv_frame_timeout(frame, RX_TIMEOUT_MS);
+
+	if (status == 0) {
+		// try again
+		printf("No data from uart receive - will try again.\n");
+		return -1;
+	}
+
+	return status;
+}
+
+uint64_t kobuki_uart_frame_time_us(void) {
+	return rx_buffer.frame_time_us;
+}
 
+void kobuki_uart_get_stats(kobuki_uart_stats_t* stats) {
+	*stats = uart_stats;
 }
 
+/* Returns number of bytes read or < 0 on error. */
+int kobuki_uart_recv(uint8_t* buffer) {
+	const uint8_t* frame;
+
+	int status = kobuki_uart_recv_frame(&frame);
+	if (status > 0) {
+		memcpy(buffer, frame, status + 1);
+	}
+
+	return status;
+}
@@ -3,19 +3,65 @@
 
 #include <stdint.h>
 
-/* Must call before using uart functions. Returns < 0 on error. */
+#include "kobuki_transport.h"
+
+/* Must call before using uart functions. Opens the Raspberry Pi serial port. Returns < 0 on error. */
 int kobuki_uart_init(void);
 
+/* Same as kobuki_uart_init but talks through the given transport (serial port, pty, loopback or replay file).
+The transport must stay valid until kobuki_uart_close. Returns < 0 on error. */
+int kobuki_uart_init_transport(kobuki_transport_t* transport);
+
+/* Returns the file descriptor of the uart so callers can wait on it (poll, epoll, ...). */
+int kobuki_uart_fd(void);
+
 /* Must call as exiting module. */
 void kobuki_uart_close(void);
 
 /* Takes in pointer to data to send as well as length of data.
-Returns number of bytes sent or < 0 on error. */
+Returns number of bytes sent or < 0 on error.
+While a batch is open the payload is only queued and its length is returned. */
 int kobuki_uart_send(uint8_t* payload, uint8_t len);
 
+/* Opens a batch: payloads passed to kobuki_uart_send are collected as sub-payloads
+of a single frame until kobuki_uart_batch_flush. */
+void kobuki_uart_batch_begin(void);
+
+/* Closes the batch and sends the collected sub-payloads as one frame with one write.
+Returns number of bytes sent (0 if nothing was queued) or < 0 on error. */
+int kobuki_uart_batch_flush(void);
+
+/* Blocks until everything written has been transmitted. Sends do not wait on their own. Returns < 0 on error. */
+int kobuki_uart_drain(void);
+
 /* Takes in pointer to receive buffer of where to put read data.
 Buffer must be at least 140 bytes because maximum size of the packet is less than 140 based on documentation.
 Returns number of bytes read or < 0 on error. */
 int kobuki_uart_recv(uint8_t* buffer);
 
+/* Same as kobuki_uart_recv but without the copy: points frame at the next complete packet
+(starting at the 0xAA 0x55 header) inside the internal receive buffer.
+Frames with a bad checksum are skipped and decoding resumes at the next header.
+The frame is only valid until the next receive call.
+Returns number of bytes in the frame excluding the checksum or < 0 on error. */
+int kobuki_uart_recv_frame(const uint8_t** frame);
+
+/* Same as kobuki_uart_recv_frame but waits at most timeout_ms for a complete frame.
+A timeout of 0 only takes what has already arrived and never blocks.
+Returns number of bytes in the frame excluding the checksum, 0 on timeout or < 0 on error. */
+int kobuki_uart_recv_frame_timeout(const uint8_t** frame, int timeout_ms);
+
+/* Time the frame returned by the last receive call arrived (kobukiClockNowUs).
+Frames that came in with the same read share its time. */
+uint64_t kobuki_uart_frame_time_us(void);
+
+typedef struct {
+	uint32_t frames;           // frames with a valid checksum
+	uint32_t checksumFailures; // frames dropped because the checksum did not match
+	uint32_t bytesSkipped;     // bytes thrown away while looking for a header
+} kobuki_uart_stats_t;
+
+/* Copies the receive counters. */
+void kobuki_uart_get_stats(kobuki_uart_stats_t* stats);
+
 #endif
@@ -12,8 +12,12 @@
 #include <time.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 
 #include "control_library/kobuki_library.h"
@@ -22,6 +26,21 @@
 #include <signal.h>
 
 #define PORT 8080
+#define TICK_INTERVAL_MS 7
+// detectors and telemetry viewers connected at the same time
+#define MAX_CLIENTS 8
+// timer, uart, server and the clients
+#define MAX_EVENTS (3 + MAX_CLIENTS)
+#define TELEMETRY_INTERVAL_MS 100
+// a client that went quiet is probed after this many seconds, once a second, and dropped
+// after CLIENT_KEEPALIVE_PROBES unanswered probes, so it does not hold a slot for long
+#define CLIENT_KEEPALIVE_IDLE_S 2
+#define CLIENT_KEEPALIVE_PROBES 3
+// reads of the instruction socket per pass at most, so a flooding detector cannot stall the loop
+#define MAX_INSTRUCTION_READS 8
+// detections older than this when the state machine gets to them are dropped
+#define DETECTION_MAX_AGE_MS 100
+#define RECORDER_FILE "explore_flight.rec"
 
 typedef enum {
 	OFF,
@@ -44,62 +63,89 @@ typedef struct route
 	struct route *next;
 } route_t;
 
-// Doesn't work
-static long get_ms() {
-	long ms;
-	struct timespec spec;
+// A detector or a telemetry viewer, see kobukiInstruction.h
+typedef struct {
+	// channel.fd is -1 while the slot is free
+	KobukiChannel_t channel;
+	KobukiClientRole_t role;
+	// counts up with every connection, tells the detectors apart
+	uint32_t id;
+	// has something to read
+	bool ready;
+	// watched for writing, its send queue is backed up
+	bool writing;
+} client_t;
+
+static const char* role_name(KobukiClientRole_t role) {
+	return role == KOBUKI_ROLE_VIEWER ? "viewer" : "detector";
+}
 
-	clock_gettime(CLOCK_MONOTONIC_RAW, &spec);
-	ms = (spec.tv_sec * 1000.0) + (spec.tv_nsec / 1.0e9);
+static long get_ms() {
+	return kobukiClockNowUs() / 1000;
+}
 
-	// ms = round(spec.tv_nsec / 1.0e6);
+static long get_us() {
+	return kobukiClockNowUs();
+}
 
-	return ms;
+// Distance driven so far in m, forward positive, from the library's odometry.
+static float odometer(void) {
+	KobukiPose_t pose;
+	kobukiOdometryGetPose(&pose);
+	return pose.distance;
 }
 
-static float measure_distance(uint16_t current_encoder, uint16_t previous_encoder) {
-	const float CONVERSION = 0.00008529;
-	float result;
 
-	if (previous_encoder < current_encoder) {
-		result = CONVERSION * (0xFFFF - current_encoder + previous_encoder);
-	} else {
-		result = (previous_encoder - current_encoder) * CONVERSION;
-	}
-	
-	if (result > 5) {
-		return 0;
+static void free_route(route_t** route) {
+	while (*route != NULL) {
+		route_t* node = *route;
+		*route = node->next;
+		free(node);
 	}
-	return result;
 }
 
-static float measure_distance_reverse(uint16_t current_encoder, uint16_t previous_encoder) {
-	const float CONVERSION = 0.00008529;
-
-	float result;
-
-	if (previous_encoder > current_encoder) {
-		result = CONVERSION * (0xFFFF - previous_encoder + current_encoder);
-	} else {
-		result = (current_encoder - previous_encoder) * CONVERSION;
-	}
-	
-	if (result > 5) {
-		return 0;
+// Turns the route into waypoints starting at the current pose, starts following them
+// and frees the route. Returns false if the route was empty.
+static bool start_return_path(route_t** route) {
+	KobukiWaypoint_t waypoints[KOBUKI_PATH_MAX_WAYPOINTS];
+	KobukiPose_t pose;
+	int count = 0;
+
+	kobukiOdometryGetPose(&pose);
+	double heading = pose.theta;
+	double x = pose.x;
+	double y = pose.y;
+
+	for (route_t* node = *route; node != NULL; node = node->next) {
+		// each step turns relative to the previous heading, negative is right, then drives straight
+		heading += node->rotate_angle * M_PI / 180.0;
+		x += node->distance * cos(heading);
+		y += node->distance * sin(heading);
+
+		if (count == KOBUKI_PATH_MAX_WAYPOINTS) {
+			printf("Route too long, returning along the first %d steps\n", count);
+			break;
+		}
+		waypoints[count].x = x;
+		waypoints[count].y = y;
+		count++;
 	}
-	return result;
-}
+	free_route(route);
 
+	printf("Returning along %d waypoints\n", count);
+	return kobukiPathStart(waypoints, count);
+}
 
-// Returns true on success. Fills in server and client socket file descriptors.
-static bool start_instruction_server(int* server_fd, int* client_fd) {
+// Returns true on success. Fills in the server socket file descriptor; clients
+// connect later, the event loop accepts them.
+static bool start_instruction_server(int* server_fd) {
 	
 	struct sockaddr_in address;
 	int opt = 1;
 	int addrlen = sizeof(address);
 
 	// Creating socket file descriptor 
-	if ((*server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+	if ((*server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
 		printf("Error initializing server socket\t%s\n", strerror(errno));
 
 		return false;
@@ -131,190 +177,696 @@ static bool start_instruction_server(int* server_fd, int* client_fd) {
 	}
 
 	printf("Waiting for client computer to connect\n");
+	return true;
+}
+
+
+// Takes everything the client sent since the last call. Detections go into the mailbox,
+// where only the newest, by the time the frame was taken, is kept. A route is returned in route,
+// which the caller frees. Returns false if the connection is gone or unreadable.
+static bool read_instructions(client_t* client, KobukiDetectionMailbox_t* detections, route_t** route) {
+	KobukiChannel_t* channel = &client->channel;
+	KobukiInstruction_t instruction;
+	int arrived = 1;
+
+	for (int reads = 0; reads < MAX_INSTRUCTION_READS && arrived > 0; reads++) {
+		arrived = channel->poll(channel);
+		if (arrived < 0) {
+			printf("Error reading from client %u. Connection closed.\n", client->id);
+			return false;
+		}
+
+		while (channel->next(channel, &instruction)) {
+			if (instruction.type == KOBUKI_INSTRUCTION_HELLO) {
+				client->role = instruction.hello.role == KOBUKI_ROLE_VIEWER ? KOBUKI_ROLE_VIEWER : KOBUKI_ROLE_DETECTOR;
+				// a viewer that falls behind only misses telemetry
+				kobukiChannelSetQueuePolicy(channel, client->role == KOBUKI_ROLE_VIEWER ? KOBUKI_QUEUE_DROP_OLDEST : KOBUKI_QUEUE_DISCONNECT);
+				printf("Client %u is a %s\n", client->id, role_name(client->role));
+
+			} else if (client->role != KOBUKI_ROLE_DETECTOR) {
+				// viewers only watch
+
+			} else if (instruction.type == KOBUKI_INSTRUCTION_DETECTION) {
+				int32_t detection[4] = {instruction.detection.left, instruction.detection.center, instruction.detection.right, instruction.detection.ageUs};
+				kobukiRecord(KOBUKI_RECORD_DETECTION, detection, sizeof(detection));
+				kobukiDetectionPost(detections, &instruction, client->id);
+
+			} else if (instruction.type == KOBUKI_INSTRUCTION_ROUTE) {
+				kobukiRecord(KOBUKI_RECORD_ROUTE, instruction.route.steps, instruction.route.count * sizeof(KobukiRouteStep_t));
+
+				free_route(route);
+				route_t** tail = route;
+				for (int i = 0; i < instruction.route.count; i++) {
+					*tail = malloc(sizeof(route_t));
+					if (*tail == NULL) {
+						printf("It doesnt want to give us memory\n");
+						free_route(route);
+						return false;
+					}
+					(*tail)->rotate_angle = instruction.route.steps[i].angle;
+					(*tail)->distance = instruction.route.steps[i].distance * 0.95;
+					(*tail)->next = NULL;
+					tail = &(*tail)->next;
+				}
+			}
+		}
+	}
+
+	return true;
+}
 
-	if ((*client_fd = accept(*server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-		printf("Error initializing connection to client for instruction\t%s\n", strerror(errno));
-;
+// Sends a message to the client. Returns false if the connection is gone or the client
+// fell too far behind; *sent is true if the message went out or is queued.
+static bool send_instruction(client_t* client, const KobukiInstruction_t* instruction, bool* sent) {
+	int status = client->channel.send(&client->channel, instruction);
+	*sent = status > 0;
+	if (status < 0) {
+		printf("Error writing to client %u. Connection closed.\n", client->id);
 		return false;
-	}	
+	}
 
-	printf("Successfully connected to client computer for instructions\n");
 	return true;
 }
 
+// States in which explore does not act on detections
+static bool ignores_instructions(robot_state_t state) {
+	return state == GET_RETURN || state == RETURN || state == BACKUP || state == ROTATE_RETURN || state == BOOST;
+}
+
+// Returns the file descriptor of the tick timer, or -1 on error.
+static int start_tick_timer(void) {
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd == -1) {
+		printf("Error creating tick timer\t%s\n", strerror(errno));
+	}
 
-// Returns false if there was an error other than there just being no info
-// Info on select in http://beej.us/guide/bgnet/html/single/bgnet.html#blocking
-// Returns in the values for the variables passed in
-static bool read_new_instruction(int client_fd, int* duck_detect_left, int* duck_detect_center, int* duck_detect_right) {
-	const int expected_bytes = 3*sizeof(int);
-	*duck_detect_left = 0, *duck_detect_center = 0, *duck_detect_right = 0;
-	char buffer[expected_bytes];
-	memset(buffer, 0, expected_bytes);
+	return timer_fd;
+}
 
-	struct timeval tv;
-	fd_set readfds;
-	int nbytes;
+// (Re)arms the tick timer to fire once, interval_ms from now. Returns false on error.
+static bool arm_tick_timer(int timer_fd, int interval_ms) {
+	struct itimerspec timeout = {0};
+	timeout.it_value.tv_nsec = interval_ms * 1000000L;
 
-	// Wait 5ms before timing out and returning
-	tv.tv_sec = 0;
-	tv.tv_usec = 5000;
+	if (timerfd_settime(timer_fd, 0, &timeout, NULL) == -1) {
+		printf("Error starting tick timer\t%s\n", strerror(errno));
+		return false;
+	}
 
-	FD_ZERO(&readfds);
-	FD_SET(client_fd, &readfds);
+	return true;
+}
 
-	// Don't care about writefds and exceptfds:
-	select(client_fd+1, &readfds, NULL, NULL, &tv);
+// Watches fd for input on the event loop. Returns false on error.
+static bool watch_fd(int epoll_fd, int fd, int op, uint32_t events) {
+	struct epoll_event event = {0};
+	event.events = events;
+	event.data.fd = fd;
 
-	if (FD_ISSET(client_fd, &readfds)) {
-		if ((nbytes = recv(client_fd, buffer, expected_bytes, 0)) <= 0) {
-			printf("Error reading from client. Connection closed.\n");
-			close(client_fd);
-			return false;
-		}
-		if (nbytes == expected_bytes) {
-			// printf("Got expected\n");
-			*duck_detect_left = *((int *) buffer);
-			*duck_detect_center = *(((int *) buffer) + 1);
-			*duck_detect_right = *(((int *) buffer) + 2);
-			return true;
-		}
-		printf("Did not get expected\n");
+	if (epoll_ctl(epoll_fd, op, fd, &event) == -1) {
+		printf("Error updating event loop\t%s\n", strerror(errno));
+		return false;
 	}
 
 	return true;
+}
 
+// Set by SIGINT / SIGTERM: the loop stops and prints its statistics.
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int signal_number) {
+	(void) signal_number;
+	stop_requested = 1;
 }
 
-static bool requestInstructions(int client_fd) {
-	const int expected_bytes = sizeof(int);
-	const int signal = 249;
+/*
+	Where the loop's events come from.
+
+	Live, the loop waits on the uart, the instruction socket and the tick timer with epoll.
+	A replay instead plays a flight recorder file (kobukiRecorder.h) into the same state machine:
+	the recorded frames go in through a loopback transport, the recorded detections and routes
+	through a socket pair, and a virtual clock jumps straight to the next event.
+	So a replay runs as fast as the CPU allows and sends the same commands every time.
+*/
+typedef struct event_source {
+	// Waits until there is something to handle and says what: client_ready if any client
+	// has something to read, the clients that do are marked ready. Returns false to stop the loop.
+	bool (*wait)(struct event_source* source, bool* tick, bool* uart_ready, bool* client_ready);
+
+	// Called after every pass: the tick is due TICK_INTERVAL_MS from now. Returns false on error.
+	bool (*pass_done)(struct event_source* source);
+
+	// Called when a client's channel failed. Returns false if the loop cannot go on without it.
+	bool (*drop_client)(struct event_source* source, client_t* client);
+
+	// detectors send detections and routes and get the route requests, viewers get telemetry
+	client_t clients[MAX_CLIENTS];
+
+	// counts up every time a client connects, so the loop can resume the session with it
+	uint32_t connections;
+
+	union {
+		struct {
+			int server_fd;
+			int uart_fd;
+			int timer_fd;
+			int epoll_fd;
+			uint64_t tick_due_ns; // kobukiStatsNowNs
+			// real-time mode: ticks at a fixed rate instead of after every quiet tick interval
+			bool realtime;
+			KobukiTicker_t ticker;
+		} live;
+
+		struct {
+			kobuki_transport_t* transport;
+			KobukiRecording_t recording;
+			KobukiRecord_t next;
+			bool have_next;
+			// the detector's end of the socket pair
+			int detector_fd;
+			uint64_t tick_due_us;
+			uint64_t start_us;
+			uint32_t passes;
+			uint32_t frames_replayed;
+			uint32_t commands_recorded;
+			uint32_t commands_sent;
+			uint32_t command_hash;
+			uint16_t sequence;
+		} replay;
+	};
+} event_source_t;
+
+// Sets up a client slot for a channel, as a detector until it says otherwise.
+static void add_client(event_source_t* source, client_t* client) {
+	client->role = KOBUKI_ROLE_DETECTOR;
+	client->id = ++source->connections;
+	client->ready = false;
+	client->writing = false;
+}
 
-	char *buffer = (char *) &signal;
-	int nbytes;
-	struct timeval tv;
-	fd_set writefds;
+static bool live_drop_client(event_source_t* source, client_t* client) {
+	if (client->channel.fd == -1) {
+		return true;
+	}
 
-	// Wait 5ms before timing out and returning
-	tv.tv_sec = 0;
-	tv.tv_usec = 5000;
+	epoll_ctl(source->live.epoll_fd, EPOLL_CTL_DEL, client->channel.fd, NULL);
+	client->channel.close(&client->channel);
 
-	FD_ZERO(&writefds);
-	FD_SET(client_fd, &writefds);
+	// the robot carries on, the client can connect again and pick up where it left off
+	printf("Lost client %u (%s), waiting for it to reconnect\n", client->id, role_name(client->role));
+	return true;
+}
 
-	// Don't care about writefds and exceptfds:
-	select(client_fd+1, NULL, &writefds, NULL, &tv);
+// Takes a new client's connection. Returns false on error.
+static bool accept_client(event_source_t* source) {
+	int client_fd = accept(source->live.server_fd, NULL, NULL);
+	if (client_fd == -1) {
+		// gone again before we got to it
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED || errno == EINTR;
+	}
 
-	if (FD_ISSET(client_fd, &writefds)) {
-		if ((nbytes = send(client_fd, buffer, expected_bytes, 0)) <= 0) {
-			printf("Error reading from client. Connection closed.\n");
-			close(client_fd);
-			return false;
+	client_t* client = NULL;
+	for (int c = 0; c < MAX_CLIENTS && client == NULL; c++) {
+		if (source->clients[c].channel.fd == -1) {
+			client = &source->clients[c];
 		}
-   
-		// Will just try again 
-		if (nbytes != expected_bytes) {
-			printf("Did not send expected\n");
-			return true;
+	}
+	if (client == NULL) {
+		printf("Refusing a client computer, %d are connected already\n", MAX_CLIENTS);
+		close(client_fd);
+		return true;
+	}
+
+	// notices a client that vanished without closing the connection, e.g. off the network,
+	// within seconds instead of the kernel's default of over two hours
+	int opt = 1;
+	int idle = CLIENT_KEEPALIVE_IDLE_S;
+	int interval = 1;
+	int probes = CLIENT_KEEPALIVE_PROBES;
+	// the same when messages to it go unacknowledged, keepalive does not probe then
+	unsigned int user_timeout_ms = (CLIENT_KEEPALIVE_IDLE_S + CLIENT_KEEPALIVE_PROBES) * 1000;
+	setsockopt(client_fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+	setsockopt(client_fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(client_fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+	setsockopt(client_fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+	setsockopt(client_fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout_ms, sizeof(user_timeout_ms));
+
+	// the event loop reads whatever arrived and never waits for the rest of a message
+	kobukiChannelSocket(&client->channel, client_fd);
+	if (!watch_fd(source->live.epoll_fd, client_fd, EPOLL_CTL_ADD, EPOLLIN)) {
+		client->channel.close(&client->channel);
+		return false;
+	}
+
+	add_client(source, client);
+	printf("Successfully connected to client computer %u for instructions\n", client->id);
+	return true;
+}
+
+static client_t* find_client(event_source_t* source, int fd) {
+	for (int c = 0; c < MAX_CLIENTS; c++) {
+		if (source->clients[c].channel.fd == fd) {
+			return &source->clients[c];
 		}
 	}
+
+	return NULL;
+}
+
+// Writes out what is queued for a client and watches it for writing while something is left.
+// Returns false if the client had to be dropped and the loop cannot go on.
+static bool live_flush_client(event_source_t* source, client_t* client) {
+	int queued = client->channel.flush(&client->channel);
+	if (queued < 0) {
+		return source->drop_client(source, client);
+	}
+
+	if (client->writing != (queued > 0)) {
+		client->writing = queued > 0;
+		if (!watch_fd(source->live.epoll_fd, client->channel.fd, EPOLL_CTL_MOD, client->writing ? EPOLLIN | EPOLLOUT : EPOLLIN)) {
+			return false;
+		}
+	}
+
 	return true;
 }
 
-/* Must be memory from head_instruction must be freed after. */
-static bool readReturnSequence(int client_fd, route_t** head_instruction) {
-	const int expected_bytes = 2*sizeof(float);
-	char buffer[expected_bytes];
-	memset(buffer, 0, expected_bytes);
-	int n;
-	route_t **head = head_instruction;
+static bool live_wait(event_source_t* source, bool* tick, bool* uart_ready, bool* client_ready) {
+	struct epoll_event events[MAX_EVENTS];
+
+	int num_events;
+	do {
+		num_events = epoll_wait(source->live.epoll_fd, events, MAX_EVENTS, -1);
+	} while (num_events == -1 && errno == EINTR && !stop_requested);
+
+	if (stop_requested) {
+		return false;
+	}
 
-	struct timeval tv;
-	fd_set readfds;
-	int nbytes;
+	if (num_events == -1) {
+		printf("Error waiting for events\t%s\n", strerror(errno));
+		return false;
+	}
 
-	// Wait 5ms before timing out and returning
-	tv.tv_sec = 0;
-	tv.tv_usec = 5000;
+	for (int e = 0; e < num_events; e++) {
+		int fd = events[e].data.fd;
 
-	FD_ZERO(&readfds);
-	FD_SET(client_fd, &readfds);
+		if (fd == source->live.timer_fd && source->live.realtime) {
+			*tick = kobukiTickerAcknowledge(&source->live.ticker) > 0;
 
-	// Don't care about writefds and exceptfds:
-	select(client_fd+1, &readfds, NULL, NULL, &tv);
+		} else if (fd == source->live.timer_fd) {
+			uint64_t expirations;
+			read(fd, &expirations, sizeof(expirations));
+			*tick = true;
 
-	if (FD_ISSET(client_fd, &readfds)) {
+			uint64_t now = kobukiStatsNowNs();
+			uint64_t late_ns = now > source->live.tick_due_ns ? now - source->live.tick_due_ns : 0;
+			kobukiStatsRecord(KOBUKI_STAGE_WAKEUP, late_ns);
+			if (late_ns >= TICK_INTERVAL_MS * 1000000ull) {
+				kobukiStatsCount(KOBUKI_COUNTER_MISSED_TICKS);
+			}
 
-		// Wait for start sequence
-		do {
-			nbytes = recv(client_fd, buffer, sizeof(int), 0);
-			if (nbytes <= 0) {
-				printf("Error reading from client. Connection closed.\n");
-				close(client_fd);
+		} else if (fd == source->live.uart_fd) {
+			*uart_ready = true;
+
+		} else if (fd == source->live.server_fd) {
+			if (!accept_client(source)) {
+				printf("Error accepting the client computer\t%s\n", strerror(errno));
+			}
+
+		} else {
+			client_t* client = find_client(source, fd);
+			if (client == NULL) {
+				continue;
+			}
+
+			// a slow client's queue drains without holding up anyone else
+			if ((events[e].events & EPOLLOUT) && !live_flush_client(source, client)) {
 				return false;
 			}
-			// Will try again
-			if (nbytes != sizeof(int)) {
-				*head_instruction = NULL;
-				return true;
+
+			// hang ups and errors show up when reading
+			if (client->channel.fd != -1 && (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+				client->ready = true;
+				*client_ready = true;
 			}
-		} while (*((int *) buffer) != 249);
+		}
+	}
+
+	return true;
+}
+
+static bool live_pass_done(event_source_t* source) {
+	if (!source->live.realtime) {
+		if (!arm_tick_timer(source->live.timer_fd, TICK_INTERVAL_MS)) {
+			return false;
+		}
+		source->live.tick_due_ns = kobukiStatsNowNs() + TICK_INTERVAL_MS * 1000000ull;
+	}
 
-		// Get the number (n) of instructions we expect
-		if ((nbytes = recv(client_fd, buffer, sizeof(int), 0)) <= 0) {
-			printf("Error reading from client. Connection closed.\n");
-			close(client_fd);
+	// what the pass sent and the sockets did not take right away
+	for (int c = 0; c < MAX_CLIENTS; c++) {
+		client_t* client = &source->clients[c];
+		if (client->channel.fd != -1 && !live_flush_client(source, client)) {
 			return false;
 		}
-		// Will try again
-		if (nbytes != sizeof(int)) {
-			*head_instruction = NULL;
-			return true;
+	}
+
+	return true;
+}
+
+// Listens for clients, shares memory with a detector on this host if shared, and sets up the event loop.
+// Returns false on error.
+static bool start_live_source(event_source_t* source, bool realtime, bool shared) {
+	memset(source, 0, sizeof(event_source_t));
+	source->wait = live_wait;
+	source->pass_done = live_pass_done;
+	source->drop_client = live_drop_client;
+	for (int c = 0; c < MAX_CLIENTS; c++) {
+		source->clients[c].channel.fd = -1;
+	}
+	source->live.server_fd = -1;
+	source->live.timer_fd = -1;
+	source->live.ticker.fd = -1;
+	source->live.realtime = realtime;
+
+	// The loop wakes up as soon as a sensor packet or an instruction arrives, or a client connects.
+	// The tick timer is re-armed after every pass, so it only fires if nothing else
+	// woke the loop for TICK_INTERVAL_MS and keeps the commands to the robot refreshed.
+	// In real-time mode it ticks every TICK_INTERVAL_MS regardless, on absolute deadlines.
+	source->live.uart_fd = kobuki_uart_fd();
+	source->live.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	// more detectors and the viewers connect over TCP either way
+	if (!start_instruction_server(&source->live.server_fd)) {
+		return false;
+	}
+
+	if (shared) {
+		client_t* client = &source->clients[0];
+		if (!kobukiChannelSharedCreate(&client->channel, KOBUKI_CHANNEL_DEFAULT_NAME) ||
+				!watch_fd(source->live.epoll_fd, client->channel.fd, EPOLL_CTL_ADD, EPOLLIN)) {
+			return false;
 		}
-		n = *((int *) buffer);
+		add_client(source, client);
+		printf("Waiting for instructions in /dev/shm/%s\n", KOBUKI_CHANNEL_DEFAULT_NAME);
+	}
 
-		// Get n instructions in a loop
-		for (int i = 0; i < n; i+=1) {
+	if (realtime) {
+		if (kobukiTickerStart(&source->live.ticker, TICK_INTERVAL_MS * 1000)) {
+			source->live.timer_fd = source->live.ticker.fd;
+		}
+	} else {
+		source->live.timer_fd = start_tick_timer();
+		if (source->live.timer_fd != -1 && !arm_tick_timer(source->live.timer_fd, TICK_INTERVAL_MS)) {
+			close(source->live.timer_fd);
+			source->live.timer_fd = -1;
+		}
+		source->live.tick_due_ns = kobukiStatsNowNs() + TICK_INTERVAL_MS * 1000000ull;
+	}
 
-			if ((nbytes = recv(client_fd, buffer, expected_bytes, 0)) <= 0) {
-				printf("Error reading from client. Connection closed.\n");
-				close(client_fd);
-				return false;
-			}
-			// If do not receive right number, just exit and try again
-			if (nbytes != expected_bytes) {
-				*head_instruction = NULL;
-				return true;
-			}
-			*head = malloc(sizeof(route_t));
-			if (*head == NULL) {
-				printf("It doesnt want to give us memory\n");
-				return false;
-			}
-			(*head)->rotate_angle = *((float *) buffer);
-			(*head)->distance = (*(((float *) buffer)+ 1)) * 0.95;
-			(*head)->next = NULL;
-			// The address of the next route_t
-			head = &((*head)->next);
+	if (source->live.timer_fd == -1 || source->live.epoll_fd == -1 ||
+			!watch_fd(source->live.epoll_fd, source->live.timer_fd, EPOLL_CTL_ADD, EPOLLIN) ||
+			!watch_fd(source->live.epoll_fd, source->live.uart_fd, EPOLL_CTL_ADD, EPOLLIN) ||
+			!watch_fd(source->live.epoll_fd, source->live.server_fd, EPOLL_CTL_ADD, EPOLLIN)) {
+		printf("Error initializing the event loop\n");
+		return false;
+	}
+
+	return true;
+}
+
+// time of the replay, see kobukiClockSetSource
+static uint64_t replay_now_us = 0;
+
+static uint64_t replay_clock(void) {
+	return replay_now_us;
+}
+
+// The next record the state machine reacts to. Commands sent in the recording are only counted.
+static bool replay_peek(event_source_t* source) {
+	while (!source->replay.have_next) {
+		if (!kobukiRecordingNext(&source->replay.recording, &source->replay.next)) {
+			return false;
+		}
+
+		switch (source->replay.next.type) {
+			case KOBUKI_RECORD_RX_FRAME:
+			case KOBUKI_RECORD_DETECTION:
+			case KOBUKI_RECORD_ROUTE:
+				source->replay.have_next = true;
+				break;
+
+			case KOBUKI_RECORD_TX_FRAME:
+				source->replay.commands_recorded++;
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	return true;
+}
+
+// Sends a detection or route to explore the way the detector would.
+static void replay_to_client(event_source_t* source, const KobukiRecord_t* record) {
+	KobukiInstruction_t instruction = { .sequence = source->replay.sequence++ };
+	uint8_t buffer[KOBUKI_INSTRUCTION_HEADER_SIZE + KOBUKI_INSTRUCTION_MAX_PAYLOAD];
+
+	if (record->type == KOBUKI_RECORD_ROUTE) {
+		instruction.type = KOBUKI_INSTRUCTION_ROUTE;
+		instruction.route.count = record->length / sizeof(KobukiRouteStep_t);
+		if (instruction.route.count > KOBUKI_INSTRUCTION_MAX_STEPS) {
+			instruction.route.count = KOBUKI_INSTRUCTION_MAX_STEPS;
 		}
+		memcpy(instruction.route.steps, record->data, instruction.route.count * sizeof(KobukiRouteStep_t));
+	} else {
+		// left, center, right and the age, older recordings have no age
+		int32_t detection[4] = {0};
+		memcpy(detection, record->data, record->length < sizeof(detection) ? record->length : sizeof(detection));
+		instruction.type = KOBUKI_INSTRUCTION_DETECTION;
+		instruction.detection.left = detection[0];
+		instruction.detection.center = detection[1];
+		instruction.detection.right = detection[2];
+		instruction.detection.ageUs = detection[3];
+	}
+
+	int length = kobukiInstructionEncode(&instruction, buffer, sizeof(buffer));
+	send(source->replay.detector_fd, buffer, length, 0);
+}
+
+static bool client_readable(int fd) {
+	struct pollfd poll_fd = { .fd = fd, .events = POLLIN };
+	return poll(&poll_fd, 1, 0) > 0;
+}
+
+static bool replay_wait(event_source_t* source, bool* tick, bool* uart_ready, bool* client_ready) {
+	if (stop_requested) {
+		return false;
+	}
+
+	// like epoll, report data left in the socket right away
+	if (client_readable(source->clients[0].channel.fd)) {
+		source->clients[0].ready = true;
+		*client_ready = true;
+		return true;
+	}
+
+	if (!replay_peek(source)) {
+		return false;
+	}
+
+	if (source->replay.tick_due_us <= source->replay.next.hostUs) {
+		replay_now_us = source->replay.tick_due_us;
+		source->replay.tick_due_us = UINT64_MAX;
+		*tick = true;
+		return true;
 	}
 
+	// everything recorded at the same time arrived together
+	replay_now_us = source->replay.next.hostUs;
+	do {
+		const KobukiRecord_t* record = &source->replay.next;
+
+		if (record->type == KOBUKI_RECORD_RX_FRAME) {
+			kobuki_loopback_inject(source->replay.transport, record->data, record->length);
+			source->replay.frames_replayed++;
+			*uart_ready = true;
+		} else {
+			replay_to_client(source, record);
+			source->clients[0].ready = true;
+			*client_ready = true;
+		}
+
+		source->replay.have_next = false;
+	} while (replay_peek(source) && source->replay.next.hostUs == replay_now_us);
+
 	return true;
 }
 
+// the recording goes on, but what explore does without the detector was not recorded
+static bool replay_drop_client(event_source_t* source, client_t* client) {
+	(void) source;
+	(void) client;
+	printf("Replay lost its instruction channel\n");
+	return false;
+}
 
-int main(void) { // to start the kinect recorder, lets try putting the function in track_yellow and starting it by calling a python function, and when we get a SIGINT, handle it in the python function by killing the recorder
+static bool replay_pass_done(event_source_t* source) {
+	uint8_t buffer[256];
+	int count;
+
+	// what explore sent to the robot: one command frame per pass at most
+	count = kobuki_loopback_take(source->replay.transport, buffer, sizeof(buffer));
+	if (count > 0) {
+		source->replay.commands_sent++;
+		// FNV-1a over all command bytes, equal between runs if the commands are
+		for (int i = 0; i < count; i++) {
+			source->replay.command_hash = (source->replay.command_hash ^ buffer[i]) * 16777619u;
+		}
+	}
+
+	// requests for the return route, nobody answers them but the recording
+	source->clients[0].channel.flush(&source->clients[0].channel);
+	while (recv(source->replay.detector_fd, buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+	}
+
+	source->replay.passes++;
+	source->replay.tick_due_us = replay_now_us + TICK_INTERVAL_MS * 1000;
+	return true;
+}
+
+// Opens the recording and sets up the library to replay it. Returns false on error.
+static bool start_replay_source(event_source_t* source, kobuki_transport_t* transport, const char* path) {
+	memset(source, 0, sizeof(event_source_t));
+	source->wait = replay_wait;
+	source->pass_done = replay_pass_done;
+	source->drop_client = replay_drop_client;
+	for (int c = 0; c < MAX_CLIENTS; c++) {
+		source->clients[c].channel.fd = -1;
+	}
+	source->replay.detector_fd = -1;
+	source->replay.transport = transport;
+	source->replay.command_hash = 2166136261u;
+
+	if (!kobukiRecordingOpen(&source->replay.recording, path)) {
+		return false;
+	}
+
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1) {
+		printf("Error creating replay socket\t%s\n", strerror(errno));
+		return false;
+	}
+	kobukiChannelSocket(&source->clients[0].channel, pair[0]);
+	add_client(source, &source->clients[0]);
+	source->replay.detector_fd = pair[1];
+
+	// start the clock at the first record, ticking from there
+	if (!replay_peek(source)) {
+		printf("Recording %s is empty\n", path);
+		return false;
+	}
+	replay_now_us = source->replay.next.hostUs;
+	source->replay.start_us = replay_now_us;
+	source->replay.tick_due_us = replay_now_us + TICK_INTERVAL_MS * 1000;
+	kobukiClockSetSource(replay_clock);
+
+	kobuki_transport_loopback(transport);
+	return true;
+}
+
+static uint64_t cpu_time_us(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void stop_event_source(event_source_t* source, uint64_t cpu_us) {
+	if (source->wait == replay_wait) {
+		double replayed_s = (replay_now_us - source->replay.start_us) / 1e6;
+		printf("Replayed %.1fs in %.3fs of CPU (%.0fx), %u frames, %u passes, %.1fus per pass\n",
+				replayed_s, cpu_us / 1e6, cpu_us > 0 ? replayed_s * 1e6 / cpu_us : 0,
+				source->replay.frames_replayed, source->replay.passes,
+				source->replay.passes > 0 ? (double) cpu_us / source->replay.passes : 0);
+		printf("Command frames: %u (recorded %u), hash %08x\n", source->replay.commands_sent,
+				source->replay.commands_recorded, source->replay.command_hash);
+
+		kobukiClockSetSource(NULL);
+		kobukiRecordingClose(&source->replay.recording);
+		close(source->replay.detector_fd);
+		source->clients[0].channel.close(&source->clients[0].channel);
+		return;
+	}
+
+	if (source->live.realtime) {
+		kobukiTickerPrint(&source->live.ticker);
+		kobukiTickerStop(&source->live.ticker);
+	} else {
+		close(source->live.timer_fd);
+	}
+	close(source->live.epoll_fd);
+	for (int c = 0; c < MAX_CLIENTS; c++) {
+		if (source->clients[c].channel.fd != -1) {
+			source->clients[c].channel.close(&source->clients[c].channel);
+		}
+	}
+	close(source->live.server_fd);
+}
 
-	if (!kobukiLibraryInit()) {
+int main(int argc, char** argv) { // to start the kinect recorder, lets try putting the function in track_yellow and starting it by calling a python function, and when we get a SIGINT, handle it in the python function by killing the recorder
+
+	// Optional arguments: the serial port the Kobuki is connected to,
+	// or --replay and a flight recorder file to run the state machine on instead of the robot
+	bool replay = argc > 2 && strcmp(argv[1], "--replay") == 0;
+	kobuki_transport_t transport;
+	event_source_t source;
+	uint64_t cpu_start_us = cpu_time_us();
+
+	if (replay) {
+		if (!start_replay_source(&source, &transport, argv[2])) {
+			exit(1);
+		}
+	} else {
+		kobuki_transport_serial(&transport, argc > 1 ? argv[1] : KOBUKI_DEFAULT_SERIAL, KOBUKI_DEFAULT_BAUD);
+	}
+
+	if (!kobukiLibraryInitTransport(&transport)) {
 		printf("Error initializing the Kobuki Library\n");
 		exit(1);
 	}
 
 	printf("Kobuki Library Initiated\n");
-	
-	int server_fd, client_fd;
 
-	start_instruction_server(&server_fd, &client_fd);
+	// the state machine only looks at bumpers and buttons, the odometry at the encoders and the gyro
+	kobukiSensorSubscribe(KOBUKI_SENSOR_BASIC | KOBUKI_SENSOR_INERTIAL);
+
+	// no SA_RESTART, so the signal wakes up the event loop
+	struct sigaction stop_action = {0};
+	stop_action.sa_handler = request_stop;
+	sigaction(SIGINT, &stop_action, NULL);
+	sigaction(SIGTERM, &stop_action, NULL);
+
+	if (!replay) {
+		// keep the last few minutes of traffic with the robot and the detector, for looking into runs afterwards
+		kobukiRecorderOpen(RECORDER_FILE, KOBUKI_RECORD_DEFAULT_SIZE);
+
+		// watch with test_code/stats_view while running
+		kobukiStatsShare(KOBUKI_STATS_DEFAULT_NAME);
+
+		// opt-in real-time mode, see kobukiRealtime.h
+		KobukiRealtimeConfig_t realtime;
+		kobukiRealtimeConfigFromEnv(&realtime);
+		kobukiRealtimeEnter(&realtime);
+
+		// KOBUKI_CHANNEL=shm: the detector runs on this host and talks through shared memory, see kobukiChannel.h
+		const char* channel = getenv("KOBUKI_CHANNEL");
+		bool shared = channel != NULL && strcmp(channel, "shm") == 0;
+
+		if (!start_live_source(&source, realtime.enabled, shared)) {
+			goto end;
+		}
+	}
 
 	// configure initial state
 	robot_state_t state = OFF;
@@ -322,66 +874,160 @@ int main(void) { // to start the kinect recorder, lets try putting the function
 	
 
 	bool started_rotation = false;
-	bool started_distance = false;
 	unsigned long start_time = 0;
-	float target_rotation_time = kobukiTimeToReachAngle(90);
 	float distance_traveled = 0;
-	uint16_t old_encoder = 0;
-	uint16_t new_encoder = 0;
-	route_t *next_instr_ptr = NULL, *terminator = NULL;
+	// odometer reading where the current straight segment started
+	float segment_start = 0;
+	route_t *next_instr_ptr = NULL;
 
 	int duck_detect_left;
 	int duck_detect_center;
 	int duck_detect_right;
 
+	// messages from the detectors, see kobukiInstruction.h
+	static KobukiDetectionMailbox_t detections;
+	KobukiDetection_t detection;
+	route_t *received_route = NULL;
+	bool route_requested = false;
+	long route_requested_ms = 0;
+	uint16_t request_sequence = 0;
+	// connections of clients seen so far, see event_source_t
+	uint32_t connections = 0;
+
+	// what the viewers see, see kobukiInstruction.h
+	KobukiInstruction_t telemetry = { .type = KOBUKI_INSTRUCTION_TELEMETRY };
+	long telemetry_sent_ms = 0;
+
+	KobukiCommandStats_t command_stats;
+
+	KobukiPollInfo_t poll_info;
+
+	// time the latest sensor packet arrived, to report how quickly we react to a bump
+	long sensors_received_us = 0;
+
+	// bumpers currently pressed, one bit per KobukiEventSource_t, kept up to date from edge events
+	uint16_t bumpers_down = 0;
+	KobukiSensorEvent_t event;
+
 	int i = 0;
 	// loop forever, running state machine
-	const int sleep_interval_in_ms = 7;
 	while (1) {
 		// printf("STATE: %d\n", state);
 
-		// usleep takesleep in microseconds
-		usleep(sleep_interval_in_ms * 1000);
+		bool tick = false;
+		bool uart_ready = false;
+		bool sensors_updated = false;
+		bool instruction_ready = false;
 
-		// read sensors from robot - uses old one if theres no new values read
-		kobukiSensorPoll(&sensors);
+		if (!source.wait(&source, &tick, &uart_ready, &instruction_ready)) {
+			goto end;
+		}
+		uint64_t pass_start_ns = kobukiStatsNowNs();
+
+		// read sensors from robot - skips to the newest packet if we fell behind,
+		// keeps the old values if no complete packet arrived yet
+		if (uart_ready && kobukiSensorPollLatest(&sensors, &poll_info, 0) > 0) {
+			sensors_received_us = poll_info.receivedUs;
+			sensors_updated = true;
+			if (poll_info.framesDiscarded > 0) {
+				printf("Skipped %u stale sensor packets (%ums)\n", poll_info.framesDiscarded, poll_info.skippedMs);
+			}
+		}
+
+		// a bump that came and went between two passes still counts
+		bool bumped = false;
+		while (kobukiSensorNextEvent(&event)) {
+			if (event.source > KOBUKI_EVENT_BUMP_RIGHT) {
+				continue;
+			}
+			if (event.down) {
+				bumpers_down |= 1 << event.source;
+				bumped = true;
+				sensors_received_us = event.hostReceiveTimeUs;
+			} else {
+				bumpers_down &= ~(1 << event.source);
+			}
+		}
+		bumped = bumped || bumpers_down;
 
 		duck_detect_left = 0;
 		duck_detect_center = 0;
 		duck_detect_right = 0;
 
-		if (state != GET_RETURN && state != RETURN && state != BACKUP && state != ROTATE_RETURN && state != BOOST ) {
-			if (!read_new_instruction(client_fd, &duck_detect_left,
-							&duck_detect_center, &duck_detect_right)) {
-				// Break for now if cannot get instructions
-				goto end;
+		// A detector that (re)connected picks up the session where it was: the detections
+		// it sends go on in the same mailbox, and a route request it may have missed goes out again.
+		// Viewers connecting only cost an extra request.
+		if (source.connections != connections) {
+			connections = source.connections;
+			route_requested = false;
+		}
+
+		// Always drain the socket, so nothing old is queued when explore looks at detections again
+		if (instruction_ready) {
+			uint64_t start_ns = kobukiStatsNowNs();
+			for (int c = 0; c < MAX_CLIENTS; c++) {
+				client_t* client = &source.clients[c];
+				if (!client->ready) {
+					continue;
+				}
+				client->ready = false;
+				if (!read_instructions(client, &detections, &received_route) &&
+						!source.drop_client(&source, client)) {
+					goto end;
+				}
+			}
+			kobukiStatsLap(KOBUKI_STAGE_INSTRUCTION, start_ns);
+
+			// only the route we asked for is driven
+			if (received_route != NULL && state != GET_RETURN) {
+				free_route(&received_route);
 			}
 		}
+
+		if (!ignores_instructions(state) &&
+				kobukiDetectionTake(&detections, &detection, DETECTION_MAX_AGE_MS * 1000)) {
+			duck_detect_left = detection.left;
+			duck_detect_center = detection.center;
+			duck_detect_right = detection.right;
+			telemetry.telemetry.left = detection.left;
+			telemetry.telemetry.center = detection.center;
+			telemetry.telemetry.right = detection.right;
+		}
+
+		// Nothing to act on: the socket only said nobody sees a duck.
+		if (!tick && !sensors_updated && received_route == NULL &&
+				!duck_detect_left && !duck_detect_center && !duck_detect_right) {
+			continue;
+		}
 		
 		i++;
 		
 		if (duck_detect_left) {
 			// printf("\nNetwork reads: %d\n", i);
-			printf("Duck_left:\t%d\n", duck_detect_left);
+			printf("Duck_left:\t%d (#%u, %ldus old)\n", duck_detect_left, detection.sequence, get_us() - (long) detection.receivedUs);
 		}
 		if (duck_detect_center) {
 			// printf("\nNetwork reads: %d\n", i);
-			printf("Duck_center:\t%d\n", duck_detect_center);
+			printf("Duck_center:\t%d (#%u, %ldus old)\n", duck_detect_center, detection.sequence, get_us() - (long) detection.receivedUs);
 		}
 		if (duck_detect_right) {
 			// printf("\nNetwork reads: %d\n", i);
-			printf("Duck_right:\t%d\n", duck_detect_right);
+			printf("Duck_right:\t%d (#%u, %ldus old)\n", duck_detect_right, detection.sequence, get_us() - (long) detection.receivedUs);
 		}
 
+		// every command issued while handling the state goes out as one frame
+		kobukiCommandBatchBegin();
+		uint64_t state_start_ns = kobukiStatsNowNs();
+
 		// handle states
 		switch(state) {
 
 			case OFF: {
 				// transition logic
-				if (isButtonPressed(&sensors)) {
+				if (kobukiButtonPressed()) {
 					printf("driving\n");
 					state = DRIVE_STRAIGHT;
-					new_encoder = sensors.leftWheelEncoder;
+					segment_start = odometer();
 				} else {
 					// perform state-specific actions here
 					kobukiDriveDirect(0, 0);
@@ -392,20 +1038,21 @@ int main(void) { // to start the kinect recorder, lets try putting the function
 
 			case DRIVE_STRAIGHT: {
 
-				if (isButtonPressed(&sensors) ) {
+				if (kobukiButtonPressed() ) {
 					state = OFF;
 
-				} else if (sensors.bumps_wheelDrops.bumpCenter || sensors.bumps_wheelDrops.bumpLeft || sensors.bumps_wheelDrops.bumpRight) {
+				} else if (bumped) {
 					printf("rotating\n");
 					printf("\nNetwork reads: %d\n", i);
 					state = ROTATING;
 					kobukiDriveDirect(0, 0);
+					printf("Bump reaction: %ldus\n", get_us() - sensors_received_us);
 					//	total_rotated = 0;
 
 				} else if (duck_detect_center) {
 					printf("approaching\n");
 					state = APPROACH;
-					new_encoder = sensors.leftWheelEncoder;
+					segment_start = odometer();
 					kobukiDriveDirect(0, 0);
 
 				} else if (duck_detect_left) {
@@ -431,20 +1078,19 @@ int main(void) { // to start the kinect recorder, lets try putting the function
 			case ROTATING: {
 
 				if (!started_rotation) {
-					start_time = get_ms(); // # time(NULL);
-					printf("Target_rotation_time: %fms\n", target_rotation_time);
-					// printf("Start time: %lu\n", time(NULL));
-					printf("Start time: %lu\n", get_ms());
+					start_time = get_ms();
+					kobukiTurnStart(-90);
+					printf("Start time: %lu\n", start_time);
 					started_rotation = true;
 				}
 
-				if (isButtonPressed(&sensors)) {
+				if (kobukiButtonPressed()) {
 					state = OFF;
 
 				} else if (duck_detect_center) {
 					printf("approaching\n");
 					state = APPROACH;
-					new_encoder = sensors.leftWheelEncoder;
+					segment_start = odometer();
 					kobukiDriveDirect(0, 0);
 					started_rotation = false;
 
@@ -460,17 +1106,14 @@ int main(void) { // to start the kinect recorder, lets try putting the function
 					kobukiDriveDirect(0, 0);
 					started_rotation = false;
 
-				// } else if (((float)(clock() - start_time) / (CLOCKS_PER_SEC/1000.0)) < target_rotation_time) {
-				// } else if ((time(NULL) - start_time) < target_rotation_time) {
-				} else if ((get_ms() - start_time) < target_rotation_time) {
-					kobukiTurnRightFixed();
+				} else if (kobukiTurnUpdate() == KOBUKI_TURN_RUNNING) {
+					// turning right
 
 				} else {
 					printf("driving straight\n");
 					state = DRIVE_STRAIGHT;
-					new_encoder = sensors.leftWheelEncoder;
-					// printf("End time: %lu\n", time(NULL));
-					printf("End time: %lu\n", get_ms());
+					segment_start = odometer();
+					printf("End time: %lu (%lums)\n", get_ms(), get_ms() - start_time);
 					kobukiDriveDirect(0, 0);
 					started_rotation = false;
 				}
@@ -482,14 +1125,14 @@ int main(void) { // to start the kinect recorder, lets try putting the function
 			case ROTATE_LEFT: {
 				// transition logic
 				
-				if (isButtonPressed(&sensors) ) {
+				if (kobukiButtonPressed() ) {
 					state = OFF;
 
 				} else if (duck_detect_center) {
 					printf("approaching\n");
 					kobukiDriveDirect(0, 0);
 					state = APPROACH;
-					new_encoder = sensors.leftWheelEncoder;
+					segment_start = odometer();
 
 				} else if (duck_detect_right) {
 					printf("rotate right\n");
@@ -508,14 +1151,14 @@ int main(void) { // to start the kinect recorder, lets try putting the function
 			case ROTATE_RIGHT: {
 				// transition logic
 				
-				if (isButtonPressed(&sensors) ) {
+				if (kobukiButtonPressed() ) {
 					state = OFF;
 
 				} else if (duck_detect_center) {
 					printf("approaching\n");
 					kobukiDriveDirect(0, 0);
 					state = APPROACH;
-					new_encoder = sensors.leftWheelEncoder;
+					segment_start = odometer();
 
 				} else if (duck_detect_left) {
 					printf("rotate left\n");
@@ -532,16 +1175,16 @@ int main(void) { // to start the kinect recorder, lets try putting the function
 			}
 
 			case APPROACH: {
-				if (isButtonPressed(&sensors)) {
+				if (kobukiButtonPressed()) {
 					state = OFF;
 
-				} else if (sensors.bumps_wheelDrops.bumpCenter || sensors.bumps_wheelDrops.bumpLeft || sensors.bumps_wheelDrops.bumpRight) {
+				} else if (bumped) {
 					kobukiDriveDirect(0, 0);
 					kobukiPlaySoundSequence(kobukiCleaningStart);
 					printf("Waiting for return instructions\n");
 					distance_traveled = 0;
 					state = BACKUP;
-					new_encoder = sensors.leftWheelEncoder;
+					segment_start = odometer();
 
 				} else {
 					kobukiDriveDirect(50, 50);
@@ -552,14 +1195,12 @@ int main(void) { // to start the kinect recorder, lets try putting the function
 			}
 
 			case BACKUP: {
-				if (isButtonPressed(&sensors)) {
+				if (kobukiButtonPressed()) {
 					state = OFF;
 
 				} else if (distance_traveled < 0.25) {
 					kobukiDriveDirect(-50, -50);
-					old_encoder = new_encoder;
-					new_encoder = sensors.leftWheelEncoder;
-					distance_traveled += measure_distance_reverse(old_encoder, new_encoder);
+					distance_traveled = segment_start - odometer();
 					state = BACKUP;
 
 				} else {
@@ -573,17 +1214,15 @@ int main(void) { // to start the kinect recorder, lets try putting the function
 			case ROTATE_RETURN: {
 
 				if (!started_rotation) {
-					target_rotation_time = kobukiTimeToReachAngle(140);
-					start_time = get_ms(); // time(NULL);
+					kobukiTurnStart(-140);
 					started_rotation = true;
 				}
 
-				if (isButtonPressed(&sensors)) {
+				if (kobukiButtonPressed()) {
 					state = OFF;
 
-				// } else if ((time(NULL) - start_time) < target_rotation_time) {
-				} else if ((get_ms() - start_time) < target_rotation_time) {
-					kobukiTurnRightFixed();
+				} else if (kobukiTurnUpdate() == KOBUKI_TURN_RUNNING) {
+					// turning right
 
 				} else {
 					state = GET_RETURN;
@@ -596,23 +1235,41 @@ int main(void) { // to start the kinect recorder, lets try putting the function
 
 			case GET_RETURN: {
 				
-				if (isButtonPressed(&sensors)) {
+				if (kobukiButtonPressed()) {
+					route_requested = false;
 					state = OFF;
 
 				} else {
 
-					if (!requestInstructions(client_fd)) {
-						goto end;
+					// ask once, and again every second in case the detectors missed it;
+					// any of the detectors may answer
+					if (!route_requested || get_ms() - route_requested_ms >= 1000) {
+						KobukiInstruction_t request = { .type = KOBUKI_INSTRUCTION_ROUTE_REQUEST, .sequence = request_sequence };
+						route_requested = false;
+						for (int c = 0; c < MAX_CLIENTS; c++) {
+							client_t* client = &source.clients[c];
+							bool sent = false;
+							if (client->channel.fd == -1 || client->role != KOBUKI_ROLE_DETECTOR) {
+								continue;
+							}
+							if (!send_instruction(client, &request, &sent) && !source.drop_client(&source, client)) {
+								goto end;
+							}
+							route_requested = route_requested || sent;
+						}
+						if (route_requested) {
+							request_sequence++;
+							route_requested_ms = get_ms();
+						}
 					}
 
-					next_instr_ptr = NULL;
-					if (!readReturnSequence(client_fd, &next_instr_ptr)) {
-						goto end;
-					}
+					next_instr_ptr = received_route;
+					received_route = NULL;
 
 					if (next_instr_ptr != NULL) {
+						route_requested = false;
 						distance_traveled = 0;
-						new_encoder = sensors.leftWheelEncoder;
+						segment_start = odometer();
 						started_rotation = false;
 						printf("returning\n");
 						kobukiDriveDirect(50,50);
@@ -628,14 +1285,12 @@ int main(void) { // to start the kinect recorder, lets try putting the function
 			}
 
 			case BOOST: {
-				if (isButtonPressed(&sensors)) {
+				if (kobukiButtonPressed()) {
 					state = OFF;
 
 				} else if (distance_traveled < 0.04) {
 					kobukiDriveDirect(50, 50);
-					old_encoder = new_encoder;
-					new_encoder = sensors.leftWheelEncoder;
-					distance_traveled += measure_distance(old_encoder, new_encoder);
+					distance_traveled = odometer() - segment_start;
 					state = BOOST;
 
 				} else {
@@ -649,73 +1304,44 @@ int main(void) { // to start the kinect recorder, lets try putting the function
 			
 			case RETURN: {
 
-				if (isButtonPressed(&sensors)) {
-					state = OFF;
-
-				} else if (next_instr_ptr == NULL) {
-					kobukiPlaySoundSequence(kobukiCleaningEnd);
-					started_rotation = false;
-					target_rotation_time = kobukiTimeToReachAngle(90);
-					printf("YAY, WE DID IT\n");
+				if (kobukiButtonPressed()) {
+					kobukiPathCancel();
+					free_route(&next_instr_ptr);
 					state = OFF;
 
 				} else {
-					
+
+					KobukiPathStatus_t status = KOBUKI_PATH_RUNNING;
 					if (!started_rotation) {
+						// the whole route is driven as one path, without stopping at the corners
 						started_rotation = true;
-						started_distance = false;
-						target_rotation_time = kobukiTimeToReachAngle(fabsf(next_instr_ptr->rotate_angle));
-						printf("Turning %f degrees, Driving %fm\n", next_instr_ptr->rotate_angle, next_instr_ptr->distance);
-						printf("Time to reach: %fms\n", target_rotation_time);
-						start_time = get_ms(); // time(NULL);
-						if (next_instr_ptr->rotate_angle < 0) {
-							// Rotating right
-							kobukiTurnRightFixed();
-							
-						} else {
-							// Rotating left
-							kobukiTurnLeftFixed();
+						start_time = get_ms();
+						if (!start_return_path(&next_instr_ptr)) {
+							status = KOBUKI_PATH_IDLE;
 						}
-						
 					}
-					
-					// if (((float)(time(NULL) - start_time) / (CLOCKS_PER_SEC/1000.0)) < target_rotation_time) {
-					// if ((time(NULL) - start_time) < target_rotation_time) {
-					 if ((get_ms() - start_time) < target_rotation_time) {
-						if (next_instr_ptr->rotate_angle < 0) {
-							// Rotating right
-							kobukiTurnRightFixed();
-							
-						} else {
-							// Rotating left
-							kobukiTurnLeftFixed();
-						}
 
-					} else if (distance_traveled < next_instr_ptr->distance) {
-						if (!started_distance) {
-							started_distance = true;
-							kobukiDriveDirect(0, 0);
-							usleep(5000);
-							new_encoder = sensors.leftWheelEncoder;
-						}
-						kobukiDriveDirect(50, 50);
-						old_encoder = new_encoder;
-						new_encoder = sensors.leftWheelEncoder;
-						distance_traveled += measure_distance(old_encoder, new_encoder);
+					if (status == KOBUKI_PATH_RUNNING) {
+						status = kobukiPathUpdate();
+					}
 
-					} else {
-						kobukiDriveDirect(0, 0);
-						distance_traveled = 0;
-						terminator = next_instr_ptr;
-						next_instr_ptr = next_instr_ptr->next;
+					if (status == KOBUKI_PATH_DONE) {
+						kobukiPlaySoundSequence(kobukiCleaningEnd);
 						started_rotation = false;
-						new_encoder = sensors.leftWheelEncoder;
-						free(terminator);
-						state = RETURN;
+						printf("YAY, WE DID IT (%lums)\n", get_ms() - start_time);
+						state = OFF;
+
+					} else if (status != KOBUKI_PATH_RUNNING) {
+						// stuck, or there was no route to drive; the wheels are stopped either way
+						kobukiPlaySoundSequence(kobukiError);
+						started_rotation = false;
+						printf("Did not make it back: %s (%lums)\n",
+								status == KOBUKI_PATH_TIMEOUT ? "gave up on the path" : "empty route", get_ms() - start_time);
+						state = OFF;
 					}
 				}
-				
-				break;				
+
+				break;
 			}
 			// add other cases here
 
@@ -724,11 +1350,48 @@ int main(void) { // to start the kinect recorder, lets try putting the function
 			}
 
 		}
+
+		kobukiStatsLap(KOBUKI_STAGE_STATE, state_start_ns);
+		kobukiCommandBatchFlush();
+
+		// the viewers hear about every state change and otherwise get a few updates a second
+		if (telemetry.telemetry.state != state || get_ms() - telemetry_sent_ms >= TELEMETRY_INTERVAL_MS) {
+			KobukiPose_t pose;
+			kobukiOdometryGetPose(&pose);
+			telemetry.sequence++;
+			telemetry.telemetry.timeMs = get_ms();
+			telemetry.telemetry.state = state;
+			telemetry.telemetry.bumpers = bumpers_down;
+			telemetry.telemetry.x = pose.x;
+			telemetry.telemetry.y = pose.y;
+			telemetry.telemetry.theta = pose.theta;
+			telemetry_sent_ms = get_ms();
+
+			for (int c = 0; c < MAX_CLIENTS; c++) {
+				client_t* client = &source.clients[c];
+				bool sent;
+				if (client->channel.fd != -1 && client->role == KOBUKI_ROLE_VIEWER &&
+						!send_instruction(client, &telemetry, &sent) && !source.drop_client(&source, client)) {
+					goto end;
+				}
+			}
+		}
+
+		if (!source.pass_done(&source)) {
+			goto end;
+		}
+		kobukiStatsLap(KOBUKI_STAGE_PASS, pass_start_ns);
 	}
 	
 	end:
-	close(client_fd);
-	close(server_fd);
+	kobukiGetCommandStats(&command_stats);
+	printf("Commands sent: %u (%u bytes), suppressed: %u (%u bytes)\n", command_stats.sent,
+			command_stats.bytesSent, command_stats.suppressed, command_stats.bytesSuppressed);
+	printf("Detections received: %u, stale: %u\n", detections.received, detections.stale);
+
+	stop_event_source(&source, cpu_time_us() - cpu_start_us);
+	kobukiStatsPrint(kobukiStatsGet());
+	kobukiRecorderClose();
 	
 }
 
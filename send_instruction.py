@@ -1,4 +1,5 @@
 import binascii
+import ctypes
 import os
 import select
 import socket
@@ -16,10 +17,26 @@ CLOUD_FILE = POINT_CLOUD_FOLDER + "final_cloud.pcd"
 POSITIONS_FILE = POINT_CLOUD_FOLDER + "final_position.txt"
 SERVER_ADDR = "10.42.0.1"
 SERVER_PORT = 8080
+# KOBUKI_CHANNEL=shm when running next to explore: messages go through shared memory instead of TCP,
+# published by the control library (make libkobuki.so), see control_library/kobukiChannel.h
+CHANNEL = os.environ.get("KOBUKI_CHANNEL", "tcp")
+LIBRARY = os.path.join(os.path.dirname(os.path.abspath(__file__)), "libkobuki.so")
+SHARED_NAME = "kobuki_instructions"
 SLEEP_INTERVAL_IN_S = 0.01
 i = 0
 DEBUG = False
 
+# Framing of the messages to and from explore, see control_library/kobukiInstruction.h
+MAGIC = 0xB5
+VERSION = 1
+HEADER = "<BBBBHH"
+HEADER_SIZE = struct.calcsize(HEADER)
+DETECTION = 1
+ROUTE_REQUEST = 2
+ROUTE = 3
+HELLO = 4
+ROLE_DETECTOR = 1
+
 class Client():
 	def __init__(self, address, port):
 		# Destination IP Address
@@ -31,18 +48,50 @@ class Client():
 		# Opens Socket (default arguments: AF_INET means we use IPv4, SOCK_STREAM means use TCP)
 		self.socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM) 
                 self.start_read = False
+		self.sequence = 0
+		self.received = b""
 
 	def connect(self):
-		# Connect to Destination Machine
+		# Connect to Destination Machine, waiting for explore to listen
 		destination_IP = self.address
 		destination_Port = self.port
-		self.socket.connect((destination_IP, destination_Port))
+		while True:
+			try:
+				self.socket.connect((destination_IP, destination_Port))
+				# explore serves viewers too, say who we are
+				self.socket.sendall(self.packMessage(HELLO, struct.pack("<B", ROLE_DETECTOR)))
+				return
+			except socket.error as error:
+				print("Could not connect, trying again:", error)
+				self.socket.close()
+				self.socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+				time.sleep(1)
+
+	def reconnect(self):
+		# explore keeps our session: the detections go on and an open route request is sent again
+		print("Lost the connection to explore, reconnecting")
+		self.socket.close()
+		self.socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		self.received = b""
+		self.connect()
+
+	def packMessage(self, message_type, payload):
+		# Header and payload of one message, with the next sequence number
+		header = struct.pack(HEADER, MAGIC, VERSION, message_type, 0, len(payload), self.sequence)
+		self.sequence = (self.sequence + 1) & 0xFFFF
+		return header + payload
 
-	def sendInfo(self, info):
-		# Send (transmit) message to destination socket
-		arr = [struct.pack("i", int(num)) for num in info]
-		data = b"".join(arr)
-		self.socket.send(data)
+	def sendInfo(self, info, captured=None):
+		# Send (transmit) message to destination socket. captured is the time.time() the frame was
+		# read at: explore keeps the detection of the newest frame when several detectors send
+		detection = [int(num) for num in info]
+		if captured is None:
+			payload = struct.pack("<iii", *detection)
+		else:
+			age_us = min(max(int((time.time() - captured) * 1e6), 0), 0xFFFFFFFF)
+			payload = struct.pack("<iiiI", *(detection + [age_us]))
+		data = self.packMessage(DETECTION, payload)
+		self.transmit(data)
 		# If center
 		if info[1]:
 			self.start_read = True
@@ -51,11 +100,19 @@ class Client():
 		        print("Network writes:", i)
 
 	def sendInstructions(self, list_of_instructions):
-		data = [struct.pack("i", 249), struct.pack("i", len(list_of_instructions))]
+		data = [struct.pack("<H", len(list_of_instructions))]
 		for angle, distance in list_of_instructions:
-			data.append(struct.pack("f", angle))
-			data.append(struct.pack("f", distance))
-		self.socket.send(b"".join(data))
+			data.append(struct.pack("<ff", angle, distance))
+		self.transmit(self.packMessage(ROUTE, b"".join(data)))
+
+	def transmit(self, data):
+		while True:
+			try:
+				self.socket.sendall(data)
+				return
+			except socket.error as error:
+				print("Send failed:", error)
+				self.reconnect()
 
 	def recvSignal(self):
 		ready_to_read, _, _ = select.select([self.socket], [], [], 0)
@@ -63,19 +120,67 @@ class Client():
 		for sock in ready_to_read:
 			if sock == self.socket:
                                 print("Reading")
-				signal = self.socket.recv(4)
-                                if not signal:
+				try:
+					data = self.socket.recv(4096)
+				except socket.error as error:
+					print("Read failed:", error)
+					data = b""
+                                if not data:
                                         print("Read failed - connection closed")
-                                        exit(1)
+					self.reconnect()
+					return False
+				self.received += data
+
+		# Messages can arrive split up or several at once, keep what is incomplete for later
+		got_request = False
+		while len(self.received) >= HEADER_SIZE:
+			magic, version, message_type, _, length, _ = struct.unpack(HEADER, self.received[:HEADER_SIZE])
+			if magic != MAGIC or version != VERSION:
+				print("Explore speaks another protocol version")
+				exit(1)
+			if len(self.received) < HEADER_SIZE + length:
+				break
+			self.received = self.received[HEADER_SIZE + length:]
 
-                                # int_signal = int(binascii.hexlify(signal)[::-1], 16)
-                                int_signal = struct.unpack("i", signal)[0]
-				if int_signal == 249:
-                                        print("Got the start instruction signal!")
-					return True
-                                else:
-                                        print("Wrong int my guy", int_signal)
+			if message_type == ROUTE_REQUEST:
+                                print("Got the start instruction signal!")
+				got_request = True
+                        else:
+                                print("Wrong message my guy", message_type)
 
+		return got_request
+
+class SharedMemoryClient(Client):
+	def __init__(self, name):
+		self.name = name
+		self.start_read = False
+		self.sequence = 0
+		self.library = ctypes.CDLL(LIBRARY)
+		self.library.kobukiChannelSharedAttach.restype = ctypes.c_void_p
+		self.library.kobukiChannelPublish.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_int]
+		self.library.kobukiChannelRouteRequests.argtypes = [ctypes.c_void_p]
+		self.library.kobukiChannelRouteRequests.restype = ctypes.c_uint32
+		self.shared = None
+		self.requests = 0
+
+	def connect(self):
+		# explore creates the shared memory when it starts
+		self.shared = self.library.kobukiChannelSharedAttach(self.name.encode())
+		if not self.shared:
+			print("No instruction channel - is explore running with KOBUKI_CHANNEL=shm?")
+			exit(1)
+		self.requests = self.library.kobukiChannelRouteRequests(self.shared)
+
+	def transmit(self, data):
+		if self.library.kobukiChannelPublish(self.shared, data, len(data)) < 0:
+			print("Could not publish", len(data), "bytes")
+
+	def recvSignal(self):
+		requests = self.library.kobukiChannelRouteRequests(self.shared)
+		if requests != self.requests:
+			self.requests = requests
+			print("Got the start instruction signal!")
+			return True
 		return False
 
 if __name__ == "__main__":
@@ -89,9 +194,14 @@ if __name__ == "__main__":
 	# port = input()
 	port = SERVER_PORT
 
-	client = Client(address, port)
-	client.connect()
-	print("Connected to " + SERVER_ADDR)
+	if CHANNEL == "shm":
+		client = SharedMemoryClient(SHARED_NAME)
+		client.connect()
+		print("Attached to /dev/shm/" + SHARED_NAME)
+	else:
+		client = Client(address, port)
+		client.connect()
+		print("Connected to " + SERVER_ADDR)
 
 	start_mapping_back = False
 	#msg = "0,0,0"
@@ -106,8 +216,9 @@ if __name__ == "__main__":
 			client.sendInfo(msg)
 		else:
 			# Sends input (msg) to specified socket
+			captured = time.time()
 			detect_left, detect_center, detect_right = duck_direction(FOLDER)
-			client.sendInfo([detect_left, detect_center, detect_right])
+			client.sendInfo([detect_left, detect_center, detect_right], captured)
 	
 		if client.start_read:
 			start_mapping_back = client.recvSignal()
@@ -0,0 +1,172 @@
+// Frame decoder microbenchmark
+//
+// Feeds synthetic feedback streams through the in-memory loopback transport
+// and measures how fast kobukiSensorPoll decodes and parses them, with every
+// sub-payload subscribed and with only the basic sensor data explore uses.
+// Runs without a robot.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../control_library/kobuki_library.h"
+#include "../control_library/kobukiSensorTypes.h"
+
+#define STREAM_SIZE (64 * 1024)
+#define NUM_FRAMES 2000000
+
+typedef struct {
+	uint8_t data[STREAM_SIZE];
+	int len;
+	int position;
+} stream_t;
+
+static stream_t stream;
+
+static double now_s(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Builds a feedback frame like the Kobuki's default stream:
+// basic sensors, inertial, cliff, current, raw gyro, docking, general purpose input and firmware.
+static int build_frame(uint8_t* frame, uint16_t time_stamp) {
+	uint8_t* p = frame + 3;
+
+	*p++ = 0x01; *p++ = 0x0F;
+	memcpy(p, &time_stamp, 2);
+	memset(p + 2, 0, 13);
+	p[15 - 2] = 160; // battery
+	p += 15;
+
+	*p++ = 0x04; *p++ = 0x07; memset(p, 0, 7); p += 7;
+	*p++ = 0x05; *p++ = 0x06; memset(p, 0, 6); p += 6;
+	*p++ = 0x06; *p++ = 0x02; memset(p, 0, 2); p += 2;
+	*p++ = 0x0D; *p++ = 0x0E; *p++ = (uint8_t) time_stamp; *p++ = 0x06; memset(p, 0, 12); p += 12;
+	*p++ = 0x03; *p++ = 0x03; memset(p, 0, 3); p += 3;
+	*p++ = 0x10; *p++ = 0x10; memset(p, 0, 16); p += 16;
+	*p++ = 0x0B; *p++ = 0x04; memset(p, 0, 4); p += 4;
+
+	uint8_t len = p - (frame + 3);
+	frame[0] = 0xAA;
+	frame[1] = 0x55;
+	frame[2] = len;
+
+	uint8_t cs = 0;
+	for (int i = 2; i < len + 3; i++) {
+		cs ^= frame[i];
+	}
+	frame[len + 3] = cs;
+
+	return len + 4;
+}
+
+// Fills the stream with frames. With corrupt set, about one frame in ten gets a flipped byte,
+// is cut short or is preceded by noise, like a line with a loose connector.
+static void build_stream(bool corrupt) {
+	uint16_t time_stamp = 0;
+	stream.len = 0;
+	srand(1);
+
+	while (stream.len < STREAM_SIZE - 300) {
+		uint8_t* frame = stream.data + stream.len;
+		int len = build_frame(frame, time_stamp);
+		time_stamp += 20;
+
+		if (corrupt) {
+			switch (rand() % 30) {
+				case 0:
+					frame[3 + rand() % (len - 3)] ^= 1 << (rand() % 8);
+					break;
+				case 1:
+					len = 3 + rand() % (len - 3);
+					break;
+				case 2:
+					for (int i = 0; i < len; i++) {
+						frame[i] = (i % 7 == 0) ? 0xAA : rand();
+					}
+					len = 5 + rand() % (len - 5);
+					break;
+			}
+		}
+
+		stream.len += len;
+	}
+	stream.position = 0;
+}
+
+// Called by the loopback transport whenever the decoder runs out of bytes.
+static void refill(kobuki_transport_t* transport, void* context) {
+	(void) context;
+
+	int len = 2048;
+	if (stream.position + len > stream.len) {
+		len = stream.len - stream.position;
+	}
+
+	kobuki_loopback_inject(transport, stream.data + stream.position, len);
+	stream.position = (stream.position + len) % stream.len;
+}
+
+static void run(const char* name, bool corrupt, uint32_t mask) {
+	kobuki_transport_t transport;
+	KobukiSensors_t sensors = {0};
+	kobuki_uart_stats_t before, after;
+
+	build_stream(corrupt);
+	kobuki_transport_loopback(&transport);
+	transport.loopback.refill = refill;
+
+	if (!kobukiLibraryInitTransport(&transport)) {
+		printf("Error initializing the Kobuki Library\n");
+		exit(1);
+	}
+	kobukiSensorSubscribe(mask);
+
+	kobuki_uart_get_stats(&before);
+	double start = now_s();
+
+	for (int i = 0; i < NUM_FRAMES; i++) {
+		if (kobukiSensorPoll(&sensors) < 0) {
+			printf("Decoder gave up after %d frames\n", i);
+			break;
+		}
+	}
+
+	double elapsed = now_s() - start;
+	kobuki_uart_get_stats(&after);
+	kobuki_uart_close();
+
+	uint32_t frames = after.frames - before.frames;
+	printf("%-11s frames/s %10.0f  ns/frame %6.1f  checksum_failures %u  bytes_skipped %u\n",
+			name, frames / elapsed, elapsed * 1e9 / frames,
+			after.checksumFailures - before.checksumFailures, after.bytesSkipped - before.bytesSkipped);
+}
+
+int main(void) {
+	run("full", false, KOBUKI_SENSOR_ALL);
+	run("basic", false, KOBUKI_SENSOR_BASIC);
+	run("corrupted", true, KOBUKI_SENSOR_ALL);
+
+	// the parser alone, on one frame that stays in the cache
+	uint8_t frame[3 + 255 + 1];
+	KobukiSensors_t sensors = {0};
+	build_frame(frame, 0);
+
+	const uint32_t masks[] = { KOBUKI_SENSOR_ALL, KOBUKI_SENSOR_BASIC };
+	const char* names[] = { "parse full", "parse basic" };
+	for (int m = 0; m < 2; m++) {
+		double start = now_s();
+		for (int i = 0; i < NUM_FRAMES; i++) {
+			kobukiParseSensorPacketMasked(frame, &sensors, masks[m]);
+		}
+		double elapsed = now_s() - start;
+		printf("%-11s ns/frame %6.1f\n", names[m], elapsed * 1e9 / NUM_FRAMES);
+	}
+
+	return 0;
+}
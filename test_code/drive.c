@@ -3,6 +3,7 @@
 // Framework for creating applications that control the Kobuki robot
 
 #include <math.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -17,6 +18,13 @@ typedef enum {
   DRIVING,
 } robot_state_t;
 
+// cleared by Ctrl-C, so the loop can report its timing
+static volatile sig_atomic_t running = 1;
+
+static void stop_running(int signal_number) {
+	(void) signal_number;
+	running = 0;
+}
 
 int main(void) {
 	
@@ -31,14 +39,31 @@ int main(void) {
 	robot_state_t state = OFF;
 	KobukiSensors_t sensors = {0};
 	const int sleep_interval_in_ms = 10;
+
+	// opt-in real-time mode (KOBUKI_RT=1, see kobukiRealtime.h): fixed rate ticks instead of sleeping
+	KobukiRealtimeConfig_t realtime;
+	KobukiTicker_t ticker;
+	kobukiRealtimeConfigFromEnv(&realtime);
+	if (realtime.enabled) {
+		kobukiRealtimeEnter(&realtime);
+		if (!kobukiTickerStart(&ticker, sleep_interval_in_ms * 1000)) {
+			exit(1);
+		}
+	}
+	signal(SIGINT, stop_running);
 	
-	// loop forever, running state machine
-	while (1) {
-		// usleep takesleep in microseconds
-		usleep(sleep_interval_in_ms * 1000);
+	// loop until Ctrl-C, running state machine
+	while (running) {
+		if (realtime.enabled) {
+			kobukiTickerWait(&ticker);
+		} else {
+			// usleep takesleep in microseconds
+			usleep(sleep_interval_in_ms * 1000);
+		}
 
-		// read sensors from robot
-		if (kobukiSensorPoll(&sensors) < 0) continue;
+		// read sensors from robot, in real-time mode without waiting for a packet
+		int32_t status = realtime.enabled ? kobukiSensorPollLatest(&sensors, NULL, 0) : kobukiSensorPoll(&sensors);
+		if (status < 0) continue;
 	
 	
 		// handle states
@@ -86,6 +111,11 @@ int main(void) {
 
 		}
 	}
-}
-
 
+	kobukiDriveDirect(0, 0);
+	if (realtime.enabled) {
+		kobukiTickerPrint(&ticker);
+	}
+	kobukiStatsPrint(kobukiStatsGet());
+	return 0;
+}
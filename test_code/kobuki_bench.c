@@ -0,0 +1,412 @@
+// Control library benchmark suite
+//
+// Runs the library against a simulated Kobuki on a pseudo-terminal (or the in-memory
+// loopback) and measures:
+//   parse      frames decoded per second through the loopback
+//   stream     a 50 Hz feedback stream like the real robot's, and stress rates up to
+//              as fast as the pty takes it: frames received, lost, and how old each is when parsed
+//   roundtrip  drive command out, the robot's next packet reflecting it back in
+//   jitter     a TICK_US loop period, idle and with every core kept busy
+// Prints one JSON object per line, for comparing runs and catching regressions.
+// Honours the KOBUKI_RT* variables (kobukiRealtime.h) for the loops it times.
+//
+// Usage: kobuki_bench [seconds per run], default 2
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "../control_library/kobuki_library.h"
+#include "../control_library/kobukiSensorTypes.h"
+
+#define TICK_US 7000
+#define ROUNDTRIPS 2000
+#define PARSE_FRAMES 1000000
+#define MAX_FRAME (3 + 255 + 1)
+
+typedef struct {
+	kobuki_transport_t* transport;
+	uint32_t rate_hz;        // 0 for as fast as possible
+	double seconds;
+	volatile bool done;
+	uint32_t sent;
+	uint64_t sent_us[65536]; // by time stamp
+} robot_sim_t;
+
+static robot_sim_t sim;
+static volatile bool load_running;
+// the cores the process could run on before real-time mode pinned it
+static cpu_set_t ordinary_cpus;
+
+static double now_s(void) {
+	return kobukiStatsNowNs() / 1e9;
+}
+
+// Starts a simulated robot or load thread with the normal scheduler on every core. Threads
+// inherit real-time mode otherwise, and load at the loop's priority on the loop's core would
+// measure starvation instead of the jitter of the loop.
+static void start_ordinary_thread(pthread_t* thread, void* (*thread_main)(void*)) {
+	pthread_attr_t attr;
+	struct sched_param param = { .sched_priority = 0 };
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+	pthread_attr_setschedparam(&attr, &param);
+	pthread_attr_setaffinity_np(&attr, sizeof(ordinary_cpus), &ordinary_cpus);
+
+	int status = pthread_create(thread, &attr, thread_main, NULL);
+	pthread_attr_destroy(&attr);
+	if (status != 0) {
+		fprintf(stderr, "ERROR - cannot start a thread\n\t%s\n", strerror(status));
+		exit(1);
+	}
+}
+
+// A feedback frame with the sub-payloads of the Kobuki's default stream.
+static int build_frame(uint8_t* frame, uint16_t time_stamp) {
+	uint8_t* p = frame + 3;
+
+	*p++ = 0x01; *p++ = 0x0F;
+	memcpy(p, &time_stamp, 2);
+	memset(p + 2, 0, 13);
+	p[15 - 2] = 160; // battery
+	p += 15;
+
+	*p++ = 0x04; *p++ = 0x07; memset(p, 0, 7); p += 7;
+	*p++ = 0x05; *p++ = 0x06; memset(p, 0, 6); p += 6;
+	*p++ = 0x06; *p++ = 0x02; memset(p, 0, 2); p += 2;
+	*p++ = 0x0D; *p++ = 0x0E; *p++ = (uint8_t) time_stamp; *p++ = 0x06; memset(p, 0, 12); p += 12;
+	*p++ = 0x03; *p++ = 0x03; memset(p, 0, 3); p += 3;
+
+	uint8_t len = p - (frame + 3);
+	frame[0] = 0xAA;
+	frame[1] = 0x55;
+	frame[2] = len;
+
+	uint8_t cs = 0;
+	for (int i = 2; i < len + 3; i++) {
+		cs ^= frame[i];
+	}
+	frame[len + 3] = cs;
+
+	return len + 4;
+}
+
+static bool write_all(int fd, const uint8_t* data, int len) {
+	while (len > 0) {
+		int count = write(fd, data, len);
+		if (count <= 0) {
+			return false;
+		}
+		data += count;
+		len -= count;
+	}
+	return true;
+}
+
+static void start_library(kobuki_transport_t* transport) {
+	if (!kobukiLibraryInitTransport(transport)) {
+		printf("Error initializing the Kobuki Library\n");
+		exit(1);
+	}
+}
+
+static void print_histogram(const char* name, const KobukiHistogram_t* histogram) {
+	printf(", \"%s_us_p50\": %.1f, \"%s_us_p99\": %.1f, \"%s_us_max\": %.1f",
+			name, kobukiStatsPercentile(histogram, 0.5) / 1000.0,
+			name, kobukiStatsPercentile(histogram, 0.99) / 1000.0,
+			name, histogram->maxNs / 1000.0);
+}
+
+
+/* ---------------- parse ---------------- */
+
+static uint8_t parse_frame[MAX_FRAME];
+static int parse_frame_len;
+
+// Called by the loopback transport whenever the decoder runs out of bytes.
+static void refill(kobuki_transport_t* transport, void* context) {
+	(void) context;
+	while (kobuki_loopback_inject(transport, parse_frame, parse_frame_len) == parse_frame_len) {
+	}
+}
+
+static void bench_parse(void) {
+	kobuki_transport_t transport;
+	KobukiSensors_t sensors = {0};
+
+	parse_frame_len = build_frame(parse_frame, 0);
+	kobuki_transport_loopback(&transport);
+	transport.loopback.refill = refill;
+	start_library(&transport);
+	kobukiSensorSubscribe(KOBUKI_SENSOR_ALL);
+
+	double start = now_s();
+	for (int i = 0; i < PARSE_FRAMES; i++) {
+		kobukiSensorPoll(&sensors);
+	}
+	double elapsed = now_s() - start;
+	kobuki_uart_close();
+
+	printf("{\"bench\": \"parse\", \"transport\": \"loopback\", \"frames\": %d, \"frames_per_s\": %.0f, \"ns_per_frame\": %.1f}\n",
+			PARSE_FRAMES, PARSE_FRAMES / elapsed, elapsed * 1e9 / PARSE_FRAMES);
+}
+
+
+/* ---------------- stream ---------------- */
+
+// The robot: sends a frame at rate_hz, stamped with its sequence number.
+static void* stream_robot(void* arg) {
+	(void) arg;
+	uint8_t frame[MAX_FRAME];
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	double end = now_s() + sim.seconds;
+
+	while (now_s() < end) {
+		uint16_t time_stamp = sim.sent;
+		int len = build_frame(frame, time_stamp);
+
+		sim.sent_us[time_stamp] = kobukiClockNowUs();
+		if (!write_all(sim.transport->pty.peer_fd, frame, len)) {
+			break;
+		}
+		sim.sent++;
+
+		if (sim.rate_hz > 0) {
+			next.tv_nsec += 1000000000 / sim.rate_hz;
+			if (next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+	}
+
+	sim.done = true;
+	return NULL;
+}
+
+static void bench_stream(uint32_t rate_hz, double seconds) {
+	kobuki_transport_t transport;
+	KobukiSensors_t sensors = {0};
+	KobukiPollInfo_t info;
+	KobukiHistogram_t age = {0};
+	kobuki_uart_stats_t uart_stats;
+	pthread_t robot;
+
+	kobuki_transport_pty(&transport);
+	start_library(&transport);
+	kobukiSensorSubscribe(KOBUKI_SENSOR_BASIC);
+
+	memset(&sim, 0, sizeof(sim));
+	sim.transport = &transport;
+	sim.rate_hz = rate_hz;
+	sim.seconds = seconds;
+	start_ordinary_thread(&robot, stream_robot);
+
+	// like explore: take the newest packet, counting the ones skipped
+	uint32_t received = 0, polls = 0;
+	double start = now_s();
+	while (true) {
+		int32_t status = kobukiSensorPollLatest(&sensors, &info, 100);
+		if (status < 0 || (status == 0 && sim.done)) {
+			break;
+		}
+		if (status == 0) {
+			continue;
+		}
+
+		polls++;
+		received += info.framesDiscarded + 1;
+		uint64_t parsed_us = kobukiClockNowUs();
+		kobukiHistogramRecord(&age, (parsed_us - sim.sent_us[sensors.timeStamp]) * 1000);
+	}
+	double elapsed = now_s() - start;
+
+	pthread_join(robot, NULL);
+	kobuki_uart_get_stats(&uart_stats);
+	kobuki_uart_close();
+
+	printf("{\"bench\": \"stream\", \"transport\": \"pty\", \"rate_hz\": %u, \"seconds\": %.2f, "
+			"\"frames_sent\": %u, \"frames_received\": %u, \"frames_lost\": %d, \"frames_per_s\": %.0f, "
+			"\"polls\": %u, \"checksum_failures\": %u",
+			rate_hz, elapsed, sim.sent, received, (int) (sim.sent - received), received / elapsed,
+			polls, uart_stats.checksumFailures);
+	print_histogram("age", &age);
+	printf("}\n");
+}
+
+
+/* ---------------- roundtrip ---------------- */
+
+// The robot: answers every drive command at once with a packet whose time stamp is the commanded speed.
+static void* echo_robot(void* arg) {
+	(void) arg;
+	uint8_t buffer[1024];
+	uint8_t frame[MAX_FRAME];
+	int len = 0;
+
+	while (!sim.done) {
+		struct pollfd poll_fd = { .fd = sim.transport->pty.peer_fd, .events = POLLIN };
+		if (poll(&poll_fd, 1, 50) <= 0) {
+			continue;
+		}
+
+		int count = read(sim.transport->pty.peer_fd, buffer + len, sizeof(buffer) - len);
+		if (count <= 0) {
+			break;
+		}
+		len += count;
+
+		// commands are AA 55 length payload checksum; a drive sub-payload is 01 04 speed radius
+		int i = 0;
+		while (len - i >= 4 && len - i >= buffer[i + 2] + 4) {
+			if (buffer[i] != 0xAA || buffer[i + 1] != 0x55) {
+				i++;
+				continue;
+			}
+
+			uint8_t* payload = buffer + i + 3;
+			int payload_len = buffer[i + 2];
+			for (int j = 0; j + 1 < payload_len; j += payload[j + 1] + 2) {
+				if (payload[j] == 0x01 && payload[j + 1] == 0x04) {
+					int16_t speed;
+					memcpy(&speed, payload + j + 2, 2);
+					int frame_len = build_frame(frame, speed);
+					write_all(sim.transport->pty.peer_fd, frame, frame_len);
+				}
+			}
+			i += payload_len + 4;
+		}
+		memmove(buffer, buffer + i, len - i);
+		len -= i;
+	}
+
+	return NULL;
+}
+
+static void bench_roundtrip(void) {
+	kobuki_transport_t transport;
+	KobukiSensors_t sensors = {0};
+	KobukiHistogram_t roundtrip = {0};
+	pthread_t robot;
+
+	kobuki_transport_pty(&transport);
+	start_library(&transport);
+	kobukiSensorSubscribe(KOBUKI_SENSOR_BASIC);
+
+	memset(&sim, 0, sizeof(sim));
+	sim.transport = &transport;
+	start_ordinary_thread(&robot, echo_robot);
+
+	uint32_t lost = 0;
+	for (int i = 1; i <= ROUNDTRIPS; i++) {
+		uint64_t start = kobukiStatsNowNs();
+		kobukiDriveRadius(0, i);
+
+		// wait for the packet answering this command, at most 100 ms
+		bool answered = false;
+		while (!answered && kobukiStatsNowNs() - start < 100000000) {
+			if (kobukiSensorPollLatest(&sensors, NULL, 100) > 0) {
+				answered = sensors.timeStamp == i;
+			}
+		}
+
+		if (answered) {
+			kobukiHistogramRecord(&roundtrip, kobukiStatsNowNs() - start);
+		} else {
+			lost++;
+		}
+	}
+
+	sim.done = true;
+	pthread_join(robot, NULL);
+	kobuki_uart_close();
+
+	printf("{\"bench\": \"roundtrip\", \"transport\": \"pty\", \"commands\": %d, \"lost\": %u",
+			ROUNDTRIPS, lost);
+	print_histogram("rtt", &roundtrip);
+	printf("}\n");
+}
+
+
+/* ---------------- jitter ---------------- */
+
+static void* burn(void* arg) {
+	(void) arg;
+	volatile uint64_t x = 0;
+	while (load_running) {
+		x++;
+	}
+	return NULL;
+}
+
+static void bench_jitter(int load_threads, double seconds, bool realtime) {
+	KobukiTicker_t ticker;
+	KobukiHistogram_t jitter = {0};
+	pthread_t threads[64];
+
+	if (load_threads > 64) {
+		load_threads = 64;
+	}
+	load_running = true;
+	for (int i = 0; i < load_threads; i++) {
+		start_ordinary_thread(&threads[i], burn);
+	}
+
+	if (!kobukiTickerStart(&ticker, TICK_US)) {
+		exit(1);
+	}
+	uint64_t ticks = seconds * 1e6 / TICK_US;
+	while (ticker.ticks < ticks) {
+		if (kobukiTickerWait(&ticker) < 0) {
+			break;
+		}
+		int64_t late = kobukiStatsNowNs() - (ticker.startNs + ticker.ticks * ticker.periodNs);
+		kobukiHistogramRecord(&jitter, late > 0 ? late : 0);
+	}
+	kobukiTickerStop(&ticker);
+
+	load_running = false;
+	for (int i = 0; i < load_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	printf("{\"bench\": \"jitter\", \"period_us\": %d, \"load_threads\": %d, \"realtime\": %s, "
+			"\"ticks\": %lu, \"overruns\": %lu",
+			TICK_US, load_threads, realtime ? "true" : "false",
+			(unsigned long) ticker.ticks, (unsigned long) ticker.overruns);
+	print_histogram("jitter", &jitter);
+	printf("}\n");
+}
+
+
+int main(int argc, char** argv) {
+	double seconds = argc > 1 ? atof(argv[1]) : 2;
+	int cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+	KobukiRealtimeConfig_t realtime;
+	kobukiRealtimeConfigFromEnv(&realtime);
+	sched_getaffinity(0, sizeof(ordinary_cpus), &ordinary_cpus);
+	kobukiRealtimeEnter(&realtime);
+
+	bench_parse();
+	bench_stream(50, seconds);
+	bench_stream(1000, seconds);
+	bench_stream(0, seconds);
+	bench_roundtrip();
+	bench_jitter(0, seconds, realtime.enabled);
+	bench_jitter(cores, seconds, realtime.enabled);
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+// Prints what the flight recorder kept, oldest first.
+// Usage: record_dump [file], default explore_flight.rec
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../control_library/kobukiRecorder.h"
+
+static const char* type_name(uint8_t type) {
+	switch (type) {
+		case KOBUKI_RECORD_RX_FRAME: return "rx";
+		case KOBUKI_RECORD_TX_FRAME: return "tx";
+		case KOBUKI_RECORD_DETECTION: return "detection";
+		case KOBUKI_RECORD_ROUTE: return "route";
+		case KOBUKI_RECORD_MARK: return "mark";
+		default: return "?";
+	}
+}
+
+static void print_data(uint8_t type, const uint8_t* data, uint16_t length) {
+	if (type == KOBUKI_RECORD_DETECTION && (length == 3 * sizeof(int) || length == 4 * sizeof(int))) {
+		// older recordings have no age
+		int detect[4] = {0};
+		memcpy(detect, data, length);
+		printf(" left %d center %d right %d age %dus", detect[0], detect[1], detect[2], detect[3]);
+
+	} else if (type == KOBUKI_RECORD_ROUTE) {
+		for (size_t i = 0; i + 2 * sizeof(float) <= length; i += 2 * sizeof(float)) {
+			float step[2];
+			memcpy(step, data + i, sizeof(step));
+			printf(" (%.1f deg, %.2f m)", step[0], step[1]);
+		}
+
+	} else if (type == KOBUKI_RECORD_MARK) {
+		printf(" %.*s", length, data);
+
+	} else {
+		for (int i = 0; i < length; i++) {
+			printf(" %02x", data[i]);
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	const char* path = argc > 1 ? argv[1] : "explore_flight.rec";
+	KobukiRecording_t recording;
+	KobukiRecord_t record;
+
+	if (!kobukiRecordingOpen(&recording, path)) {
+		return 1;
+	}
+
+	printf("%lu records written, %lu bytes kept\n", (unsigned long) recording.header.records,
+			(unsigned long) (recording.header.head - recording.header.tail));
+
+	uint64_t first_us = 0;
+	while (kobukiRecordingNext(&recording, &record)) {
+		if (first_us == 0) {
+			first_us = record.hostUs;
+		}
+
+		printf("%10.3f ms %-9s", (record.hostUs - first_us) / 1000.0, type_name(record.type));
+		print_data(record.type, record.data, record.length);
+		printf("\n");
+	}
+
+	kobukiRecordingClose(&recording);
+	return 0;
+}
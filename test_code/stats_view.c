@@ -0,0 +1,39 @@
+// Shows the loop latency histograms of a running explore (kobukiStats.h) once a second.
+// Usage: stats_view [name], default kobuki_stats in /dev/shm
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../control_library/kobukiStats.h"
+
+int main(int argc, char** argv) {
+	char path[128];
+	snprintf(path, sizeof(path), "/dev/shm/%s", argc > 1 ? argv[1] : KOBUKI_STATS_DEFAULT_NAME);
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		printf("ERROR - cannot open %s, is explore running?\n", path);
+		return 1;
+	}
+
+	const KobukiStatsShared_t* stats = mmap(NULL, sizeof(KobukiStatsShared_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (stats == MAP_FAILED || memcmp(stats->magic, KOBUKI_STATS_MAGIC, sizeof(stats->magic)) != 0 ||
+			stats->version != KOBUKI_STATS_VERSION) {
+		printf("ERROR - %s does not hold loop statistics\n", path);
+		return 1;
+	}
+
+	while (1) {
+		// the counts move while we read them, close enough for watching
+		kobukiStatsPrint(stats);
+		printf("\n");
+		fflush(stdout);
+		sleep(1);
+	}
+
+	return 0;
+}
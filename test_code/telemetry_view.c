@@ -0,0 +1,67 @@
+// Watches a running explore as a telemetry viewer (kobukiInstruction.h) and prints what it sends.
+// Usage: telemetry_view [address] [port], default 127.0.0.1 8080
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../control_library/kobukiInstruction.h"
+
+int main(int argc, char** argv) {
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(argc > 2 ? atoi(argv[2]) : 8080);
+	if (inet_pton(AF_INET, argc > 1 ? argv[1] : "127.0.0.1", &address.sin_addr) != 1) {
+		printf("ERROR - not an IPv4 address: %s\n", argv[1]);
+		return 1;
+	}
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr*) &address, sizeof(address)) == -1) {
+		printf("ERROR - cannot connect to explore\n\t%s\n", strerror(errno));
+		return 1;
+	}
+
+	uint8_t hello[KOBUKI_INSTRUCTION_HEADER_SIZE + 1];
+	KobukiInstruction_t instruction = { .type = KOBUKI_INSTRUCTION_HELLO, .hello.role = KOBUKI_ROLE_VIEWER };
+	int length = kobukiInstructionEncode(&instruction, hello, sizeof(hello));
+	if (send(fd, hello, length, 0) != length) {
+		printf("ERROR - cannot say hello to explore\n\t%s\n", strerror(errno));
+		return 1;
+	}
+
+	KobukiInstructionDecoder_t decoder;
+	kobukiInstructionDecoderInit(&decoder);
+	struct pollfd readable = { .fd = fd, .events = POLLIN };
+
+	while (poll(&readable, 1, -1) > 0) {
+		if (kobukiInstructionRead(&decoder, fd) < 0) {
+			printf("explore closed the connection\n");
+			break;
+		}
+
+		while (kobukiInstructionNext(&decoder, &instruction)) {
+			if (instruction.type != KOBUKI_INSTRUCTION_TELEMETRY) {
+				continue;
+			}
+
+			// the sequence skips what explore dropped because we were too slow
+			printf("#%-5u %8u ms state %2u bumpers %x pose %6.3f %6.3f %6.1f deg duck %d %d %d\n",
+					instruction.sequence, instruction.telemetry.timeMs, instruction.telemetry.state,
+					instruction.telemetry.bumpers, instruction.telemetry.x, instruction.telemetry.y,
+					instruction.telemetry.theta * 180 / 3.14159265, instruction.telemetry.left,
+					instruction.telemetry.center, instruction.telemetry.right);
+		}
+		fflush(stdout);
+	}
+
+	close(fd);
+	return 0;
+}